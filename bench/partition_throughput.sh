@@ -0,0 +1,55 @@
+#!/usr/bin/env bash
+# partition_throughput.sh -- Compares partitioning records by key with mkmimo to awk and split
+# $ bench/partition_throughput.sh [TOTAL_MIB] [NUM_OUTPUTS]...
+#
+# TOTAL_MIB of tab-separated records are partitioned into NUM_OUTPUTS files by
+# the hash of their first field with `mkmimo -k f1`, and with awk(1) printing
+# each record to the file for its key.  GNU split(1) distributing the records
+# round-robin without looking at any key is measured as a baseline.
+##
+set -eu
+cd "$(dirname "$0")"/..
+mkmimo=$PWD/mkmimo
+
+TotalMiB=${1:-256}; shift || true
+[[ $# -gt 0 ]] || set -- 2 8 32
+
+tmpdir=$(mktemp -d "${TMPDIR:-/tmp}"/mkmimo-partition.XXXXXX)
+trap 'rm -rf "$tmpdir"' EXIT
+cd "$tmpdir"
+
+seq 1000000000 |
+awk '{ printf "user%d\t%d\tsome payload of the record\n", $1 * 7919 % 100003, $1 }' |
+head -c $(( TotalMiB * 1048576 )) >input
+
+measure() {
+    local begin end
+    rm -f out.*
+    begin=$(date +%s.%N)
+    "$@"
+    end=$(date +%s.%N)
+    awk "BEGIN { printf \" %10.1fMiB/s\", $TotalMiB / ($end - $begin) }"
+}
+partition_by_mkmimo() { "$mkmimo" -k f1 input \> $(seq -f out.%g $1); }
+partition_by_awk() {
+    awk -F'\t' -v n=$1 '
+        BEGIN { for (i = 0; i < 256; ++i) ord[sprintf("%c", i)] = i }
+        !($1 in out) {
+            # a simple hash of the key, as awk has none built in, remembered
+            # for every key seen
+            h = 0; for (i = 1; i <= length($1); ++i)
+                h = (h * 31 + ord[substr($1, i, 1)]) % 1000003
+            out[$1] = "out." h % n
+        }
+        { print >out[$1] }' input
+}
+split_round_robin() { split -n r/$1 input out.; }
+
+printf '%8s %14s %14s %14s\n' outputs mkmimo awk split
+for numouts; do
+    printf '%8d' $numouts
+    measure partition_by_mkmimo $numouts
+    measure partition_by_awk $numouts
+    measure split_round_robin $numouts
+    echo
+done
@@ -0,0 +1,95 @@
+/**
+ * queue_contention -- Measures buffer handoffs/sec as the thread count grows
+ * $ bench/queue_contention [MAX_THREADS] [HANDOFFS_PER_THREAD]
+ *
+ * Compares the Queue guarded by a mutex against the lock-free Ring by passing
+ * buffers around just like mkmimo_multithreaded does: half of the threads take
+ * one from the empty pool and put it to the full pool, while the other half
+ * do the opposite, with two buffers per thread circulating.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include "../queue.h"
+#include "../ring.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BUFFERS_PER_THREAD 2
+
+typedef struct {
+  const char *name;
+  void *(*new_pool)(int num_buffers);
+  void (*put)(void *pool, void *buf);
+  void *(*take)(void *pool);
+} Pool;
+
+static void *new_queue_pool(int num_buffers) { return new_queue(); }
+static void put_queue(void *q, void *buf) { queue_and_signal(q, buf); }
+static void *take_queue(void *q) { return dequeue_or_wait(q); }
+
+static void *new_ring_pool(int num_buffers) { return new_ring(num_buffers); }
+static void put_ring(void *r, void *buf) { ring_enqueue_or_wait(r, buf); }
+static void *take_ring(void *r) { return ring_dequeue_or_wait(r); }
+
+static const Pool pools[] = {
+    {"mutex", new_queue_pool, put_queue, take_queue},
+    {"lock-free", new_ring_pool, put_ring, take_ring},
+};
+
+typedef struct {
+  const Pool *pool;
+  void *from, *to;
+  long num_handoffs;
+} Worker;
+
+static void *hand_off(void *arg) {
+  Worker *w = arg;
+  for (long i = 0; i < w->num_handoffs; ++i)
+    w->pool->put(w->to, w->pool->take(w->from));
+  return NULL;
+}
+
+static double measure(const Pool *pool, int num_threads, long num_handoffs) {
+  int num_buffers = BUFFERS_PER_THREAD * num_threads;
+  void *empty = pool->new_pool(num_buffers);
+  void *full = pool->new_pool(num_buffers);
+  static char buffers[1];  // only the addresses are passed around
+  for (int i = 0; i < num_buffers; ++i) pool->put(empty, &buffers[0]);
+
+  Worker workers[num_threads];
+  pthread_t threads[num_threads];
+  struct timespec begin, end;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  for (int i = 0; i < num_threads; ++i) {
+    Worker w = {pool, i % 2 ? full : empty, i % 2 ? empty : full,
+                num_handoffs};
+    workers[i] = w;
+    pthread_create(&threads[i], NULL, hand_off, &workers[i]);
+  }
+  for (int i = 0; i < num_threads; ++i) pthread_join(threads[i], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double elapsed =
+      (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+  return num_threads * num_handoffs / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+  int max_threads = argc > 1 ? atoi(argv[1]) : 64;
+  long num_handoffs = argc > 2 ? atol(argv[2]) : 100000;
+  printf("%8s", "threads");
+  for (int p = 0; p < sizeof(pools) / sizeof(*pools); ++p)
+    printf(" %14s", pools[p].name);
+  printf(" %8s\n", "speedup");
+  for (int num_threads = 2; num_threads <= max_threads; num_threads *= 2) {
+    double handoffs_per_sec[sizeof(pools) / sizeof(*pools)];
+    printf("%8d", num_threads);
+    for (int p = 0; p < sizeof(pools) / sizeof(*pools); ++p) {
+      handoffs_per_sec[p] = measure(&pools[p], num_threads, num_handoffs);
+      printf(" %10.2fM/s", handoffs_per_sec[p] / 1e6);
+    }
+    printf(" %7.2fx\n", handoffs_per_sec[1] / handoffs_per_sec[0]);
+    fflush(stdout);
+  }
+  return 0;
+}
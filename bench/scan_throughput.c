@@ -0,0 +1,76 @@
+/**
+ * scan_throughput -- Measures how fast the last record separator is found
+ * $ bench/scan_throughput [SIZE_MIB] [RECORD_SIZE]
+ *
+ * Compares the vectorized find_last_byte() against the bytewise loop by
+ * scanning a buffer whose only record separators appear every RECORD_SIZE
+ * bytes near its beginning, so almost all bytes must be scanned, just like
+ * a large record that grew the buffer.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include "../buffer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TIMER_UNIT "cycle"
+static inline unsigned long long timer(void) { return __rdtsc(); }
+#else
+#define TIMER_UNIT "ns"
+static inline unsigned long long timer(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+/* Declared externally in buffer.h */
+int BLOCKSIZE = DEFAULT_BLOCKSIZE;
+int MAX_BUFFERED_MIB = DEFAULT_MAX_BUFFERED_MIB;
+int POOL_HIGH_WATER_MIB = DEFAULT_POOL_HIGH_WATER_MIB;
+int MMAP_INPUTS = DEFAULT_MMAP_INPUTS;
+int BUFFER_ARENA = DEFAULT_BUFFER_ARENA;
+char RECORD_DELIMITER[MAX_RECORD_DELIMITER_LENGTH] = DEFAULT_RECORD_DELIMITER;
+int RECORD_DELIMITER_LENGTH = sizeof(DEFAULT_RECORD_DELIMITER) - 1;
+RecordFraming RECORD_FRAMING = FRAMING_DELIMITER;
+SplitRecordPolicy SPLIT_RECORD_POLICY = SPLIT_RECORD_RESEND;
+
+#define NUM_REPEATS 10
+
+static double measure(const char *name,
+                      const char *(*find)(const char *, size_t, char),
+                      const char *data, size_t size) {
+  unsigned long long best = -1;
+  const char *found = NULL;
+  for (int i = 0; i < NUM_REPEATS; ++i) {
+    unsigned long long begin = timer();
+    found = find(data, size, '\n');
+    unsigned long long elapsed = timer() - begin;
+    if (elapsed < best) best = elapsed;
+  }
+  double bytes_per_unit = (double)size / best;
+  printf("%-10s %12zu bytes  %8.3f bytes/%s  (found at %ld)\n", name, size,
+         bytes_per_unit, TIMER_UNIT, found ? (long)(found - data) : -1L);
+  return bytes_per_unit;
+}
+
+int main(int argc, char *argv[]) {
+  size_t size = (argc > 1 ? atoi(argv[1]) : 64) * (1 << 20);
+  size_t record_size = argc > 2 ? atoi(argv[2]) : 100;
+  char *data = malloc(size);
+  if (data == NULL) {
+    perror("malloc");
+    return 1;
+  }
+  memset(data, 'x', size);
+  for (size_t i = record_size - 1; i < 4096 && i < size; i += record_size)
+    data[i] = '\n';
+
+  double bytewise = measure("bytewise", find_last_byte_bytewise, data, size);
+  double vectorized = measure("vectorized", find_last_byte, data, size);
+  printf("speedup    %.2fx\n", vectorized / bytewise);
+  free(data);
+  return 0;
+}
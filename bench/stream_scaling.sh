@@ -0,0 +1,40 @@
+#!/usr/bin/env bash
+# stream_scaling.sh -- Measures mkmimo's throughput as the number of streams grows
+# $ bench/stream_scaling.sh [TOTAL_MIB] [NUM_STREAMS]... 
+#
+# Half of the NUM_STREAMS are inputs reading a regular file of records, and
+# the other half are outputs, i.e., named pipes drained by cat(1), so
+# TOTAL_MIB of data is moved in total for every number of streams.  Each
+# implementation listed in MKMIMO_IMPLS is measured, defaulting to
+# multithreaded, nonblocking, epoll, and workers.
+##
+set -eu
+cd "$(dirname "$0")"/..
+mkmimo=$PWD/mkmimo
+
+TotalMiB=${1:-256}; shift || true
+[[ $# -gt 0 ]] || set -- 10 20 50 100 200 500 1000 2000
+Impls=${MKMIMO_IMPLS:-multithreaded nonblocking epoll workers}
+
+tmpdir=$(mktemp -d "${TMPDIR:-/tmp}"/mkmimo-scaling.XXXXXX)
+trap 'rm -rf "$tmpdir"' EXIT
+cd "$tmpdir"
+
+printf '%8s' streams; for impl in $Impls; do printf ' %14s' $impl; done; echo
+for numstreams; do
+    numins=$(( numstreams / 2 )) numouts=$(( numstreams - numstreams / 2 ))
+    # every input reads the same file, so the total stays the same
+    seq 1000000000 | head -c $(( TotalMiB * 1048576 / numins )) >input
+    printf '%8d' $numstreams
+    for impl in $Impls; do
+        rm -f out.*
+        for i in $(seq $numouts); do mkfifo out.$i; cat out.$i >/dev/null & done
+        inputs=(); for i in $(seq $numins); do inputs+=(input); done
+        begin=$(date +%s.%N)
+        MKMIMO_IMPL=$impl "$mkmimo" "${inputs[@]}" \> out.* 2>/dev/null
+        wait
+        end=$(date +%s.%N)
+        awk "BEGIN { printf \" %10.1fMiB/s\", $TotalMiB / ($end - $begin) }"
+    done
+    echo
+done
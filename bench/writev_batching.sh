@@ -0,0 +1,35 @@
+#!/usr/bin/env bash
+# writev_batching.sh -- Measures how writing several buffers with a single writev(2) cuts system calls
+# $ bench/writev_batching.sh [TOTAL_MIB] [WRITEV_BATCH]...
+#
+# TOTAL_MIB of lines are passed through the multi-threaded mkmimo with a small
+# BLOCKSIZE, and plenty of buffers to queue up behind its output, for each
+# WRITEV_BATCH, counting the calls to write the output from the final
+# statistics.
+##
+set -eu
+cd "$(dirname "$0")"/..
+mkmimo=$PWD/mkmimo
+
+TotalMiB=${1:-64}; shift || true
+[[ $# -gt 0 ]] || set -- 1 4 16 64
+export MKMIMO_IMPL=multithreaded BLOCKSIZE=${BLOCKSIZE:-512} MULTIBUFFERING=32
+
+tmpdir=$(mktemp -d "${TMPDIR:-/tmp}"/mkmimo-writev.XXXXXX)
+trap 'rm -rf "$tmpdir"' EXIT
+cd "$tmpdir"
+
+seq 1000000000 | head -c $(( TotalMiB * 1048576 )) >input
+
+printf '%8s %14s %14s\n' batch writes throughput
+for batch; do
+    begin=$(date +%s.%N)
+    WRITEV_BATCH=$batch MKMIMO_STATS_INTERVAL=1000000 MKMIMO_STATS_FILE=stats \
+        "$mkmimo" <input | cat >/dev/null
+    end=$(date +%s.%N)
+    writes=$(tail -n 1 stats |
+        sed 's/.*"total_out":{[^}]*"syscalls":\([0-9]*\).*/\1/')
+    rm -f stats
+    awk "BEGIN { printf \"%8d %14d %12.1fMiB/s\\n\", $batch, $writes, \
+        $TotalMiB / ($end - $begin) }"
+done
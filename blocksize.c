@@ -0,0 +1,73 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "blocksize.h"
+#include <time.h>
+
+// number of reads to estimate the rate of an input over, at the least
+#define NUM_READS_PER_WINDOW 16
+#define MIN_USEC_PER_WINDOW 1000
+
+static inline uint64_t clock_usec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/**
+ * Account for bytes just read into the buffer of an input, whose last record
+ * separator has been found, and retune the block size of the input once in a
+ * while.  The block size is chosen large enough to read the input at no more
+ * than TARGET_READS_PER_SEC, yet small enough to fill within
+ * TARGET_FILL_LATENCY_USEC, and to hold a couple of records, then rounded up
+ * to a power of two between MIN_BLOCKSIZE and MAX_BLOCKSIZE.
+ */
+void adapt_block_size(BlockSizing *sizing, Buffer *buf, int num_bytes_read) {
+  if (!ADAPTIVE_BLOCKSIZE || num_bytes_read <= 0) return;
+  uint64_t now = clock_usec();
+  if (sizing->usec_window_began == 0) {
+    sizing->block_size = BLOCKSIZE;
+    sizing->usec_window_began = now;
+  }
+  ++sizing->num_reads;
+  sizing->num_bytes += num_bytes_read;
+  // bytes after the last record separator are part of a record at least as
+  // large, so the largest of them tells how large the records can get
+  int num_partial_bytes =
+      buf->begin + buf->size - (buf->end_of_last_record + 1);
+  if (num_partial_bytes > sizing->record_size)
+    sizing->record_size = num_partial_bytes;
+  uint64_t usec_elapsed = now - sizing->usec_window_began;
+  if (sizing->num_reads < NUM_READS_PER_WINDOW ||
+      usec_elapsed < MIN_USEC_PER_WINDOW)
+    return;
+  double bytes_per_usec = (double)sizing->num_bytes / usec_elapsed;
+  double size = bytes_per_usec * 1e6 / TARGET_READS_PER_SEC;
+  double max_size = bytes_per_usec * TARGET_FILL_LATENCY_USEC;
+  if (size > max_size) size = max_size;
+  if (size < 2.0 * sizing->record_size) size = 2.0 * sizing->record_size;
+  int block_size = MIN_BLOCKSIZE;
+  while (block_size < size && block_size < MAX_BLOCKSIZE) block_size *= 2;
+  if (block_size > MAX_BLOCKSIZE) block_size = MAX_BLOCKSIZE;
+  sizing->block_size = block_size;
+  // let the record size decay, so smaller records shrink blocks again
+  sizing->record_size /= 2;
+  sizing->num_reads = 0;
+  sizing->num_bytes = 0;
+  sizing->usec_window_began = now;
+}
+
+/**
+ * Number of microseconds the buffer of an input, which holds some records, can
+ * wait for more to batch before it's handed off.  It's zero once the buffer
+ * holds MIN_BATCH_BYTES, or is full, or MAX_FLUSH_LATENCY_USEC has passed since
+ * the batch got its first record, until start_next_batch() is called.
+ */
+uint64_t usec_left_to_batch(BlockSizing *sizing, Buffer *buf) {
+  if (buf->size >= MIN_BATCH_BYTES || buf->size >= buf->capacity) return 0;
+  uint64_t now = clock_usec();
+  if (sizing->usec_batch_began == 0) sizing->usec_batch_began = now;
+  uint64_t usec_waited = now - sizing->usec_batch_began;
+  return usec_waited < MAX_FLUSH_LATENCY_USEC
+             ? MAX_FLUSH_LATENCY_USEC - usec_waited
+             : 0;
+}
@@ -0,0 +1,63 @@
+#ifndef BLOCKSIZE_H
+#define BLOCKSIZE_H
+
+#include "buffer.h"
+#include <stdint.h>
+
+// each input can tune how many bytes it reads into a buffer at a time, instead
+// of always reading BLOCKSIZE, e.g., small ones for a trickle of small records
+// to be handed off sooner, and large ones for bulk streams to make fewer calls
+#define DEFAULT_ADAPTIVE_BLOCKSIZE 0
+#define DEFAULT_MIN_BLOCKSIZE 512
+#define DEFAULT_MAX_BLOCKSIZE (4 << 20)        // 4MiB
+#define DEFAULT_TARGET_READS_PER_SEC 1000
+#define DEFAULT_TARGET_FILL_LATENCY_USEC 10000  // 10ms
+extern int ADAPTIVE_BLOCKSIZE;
+extern int MIN_BLOCKSIZE;
+extern int MAX_BLOCKSIZE;
+extern int TARGET_READS_PER_SEC;
+extern int TARGET_FILL_LATENCY_USEC;
+
+// an input can coalesce reads into a batch of records before handing it off,
+// to cut the overhead per buffer, but only for so long
+#define DEFAULT_MIN_BATCH_BYTES 0  // hand off as soon as a record is read
+#define DEFAULT_MAX_FLUSH_LATENCY_USEC 10000  // 10ms
+extern int MIN_BATCH_BYTES;
+extern int MAX_FLUSH_LATENCY_USEC;
+
+/**
+ * What an input has read lately, to estimate its rate and record size.
+ */
+typedef struct block_sizing {
+  int block_size;              // Bytes to read into a buffer, 0 for BLOCKSIZE
+  int record_size;             // Largest partial record seen, decaying
+  int num_reads;               // Reads since the window began
+  uint64_t num_bytes;          // Bytes read since the window began
+  uint64_t usec_window_began;  // When the estimates were last updated
+  uint64_t usec_batch_began;   // When the current batch got its first record
+} BlockSizing;
+
+/**
+ * Number of bytes to read into the buffer of an input next, enlarging it to
+ * the block size of the input if needed.  Once the buffer holds that many
+ * bytes without a complete record, the rest of its capacity is read, so it's
+ * enlarged as usual for a large record.
+ */
+static inline int num_bytes_to_read(BlockSizing *sizing, Buffer *buf) {
+  if (ADAPTIVE_BLOCKSIZE && sizing->block_size > 0 &&
+      buf->size < sizing->block_size) {
+    if (sizing->block_size > buf->capacity)
+      enlarge_buffer(buf, sizing->block_size);
+    return sizing->block_size - buf->size;
+  }
+  return buf->capacity - buf->size;
+}
+
+void adapt_block_size(BlockSizing *sizing, Buffer *buf, int num_bytes_read);
+
+uint64_t usec_left_to_batch(BlockSizing *sizing, Buffer *buf);
+static inline void start_next_batch(BlockSizing *sizing) {
+  sizing->usec_batch_began = 0;
+}
+
+#endif /* BLOCKSIZE_H */
@@ -1,42 +1,400 @@
+#define _GNU_SOURCE  // for splice(2), tee(2), and F_SETPIPE_SZ
 #include "buffer.h"
 #include "mkmimo.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_SUPPORTED
+#include <immintrin.h>
+#endif
 
-Buffer *new_buffer() {
-  Buffer *buf = malloc(sizeof(Buffer));
-  if (buf == NULL) {
-    perror("malloc");
-    return NULL;
+/**
+ * Pool of the large blocks that buffers outgrow their own into for records
+ * larger than BLOCKSIZE, kept in free lists of power-of-two size classes,
+ * i.e., BLOCKSIZE times 2, 4, 8, and so on.  A buffer gives its large block
+ * back once cleared, i.e., once the large record has been written, instead of
+ * holding on to it for the rest of the pipe's life.  Blocks are mapped rather
+ * than allocated from the heap, and unmapped as soon as the free lists would
+ * hold more than the high-water mark, so the memory is returned to the system.
+ */
+#define NUM_SIZE_CLASSES 32
+typedef struct free_block {
+  struct free_block *next;
+} FreeBlock;
+static FreeBlock *free_blocks[NUM_SIZE_CLASSES];
+static size_t num_bytes_pooled;    // Held by the free lists
+static size_t num_bytes_buffered;  // Held by buffers, including large blocks
+static bool has_exceeded_max_buffered_bytes = false;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline size_t size_of_class(int k) { return (size_t)BLOCKSIZE << k; }
+
+static inline int size_class_of(size_t capacity) {
+  int k = 1;
+  while (k < NUM_SIZE_CLASSES - 1 && size_of_class(k) < capacity) ++k;
+  return k;
+}
+
+static inline size_t max_buffered_bytes(void) {
+  return MAX_BUFFERED_MIB > 0 ? (size_t)MAX_BUFFERED_MIB << 20 : SIZE_MAX;
+}
+
+/**
+ * Unmap all blocks in the free lists, to make room under MAX_BUFFERED_MIB.
+ * Must be called with the pool locked.
+ */
+static void unmap_pooled_blocks(void) {
+  for (int k = 1; k < NUM_SIZE_CLASSES; ++k) {
+    while (free_blocks[k] != NULL) {
+      FreeBlock *block = free_blocks[k];
+      free_blocks[k] = block->next;
+      munmap(block, size_of_class(k));
+      num_bytes_pooled -= size_of_class(k);
+    }
+  }
+}
+
+/**
+ * Take a large block of the size class that fits given capacity from its free
+ * list, or map a new one.  Stores the size of the block.
+ */
+static void *take_large_block(size_t capacity, size_t *size) {
+  int k = size_class_of(capacity);
+  *size = size_of_class(k);
+  // blocks of a size an int can't hold are never pooled
+  if (*size > INT_MAX) *size = capacity;
+  CHECK_ERRNO(pthread_mutex_lock, &pool_lock);
+  void *block = NULL;
+  if (*size == size_of_class(k) && free_blocks[k] != NULL) {
+    block = free_blocks[k];
+    free_blocks[k] = free_blocks[k]->next;
+    num_bytes_pooled -= *size;
+  } else if (num_bytes_buffered + num_bytes_pooled + *size >
+             max_buffered_bytes()) {
+    unmap_pooled_blocks();
+    if (num_bytes_buffered + *size > max_buffered_bytes() &&
+        !has_exceeded_max_buffered_bytes) {
+      // a record can't be held in pieces, so it's buffered anyway
+      fprintf(stderr, "Exceeding MAX_BUFFERED_MIB=%d for a %zu byte record\n",
+              MAX_BUFFERED_MIB, capacity);
+      has_exceeded_max_buffered_bytes = true;
+    }
+  }
+  num_bytes_buffered += *size;
+  CHECK_ERRNO(pthread_mutex_unlock, &pool_lock);
+  if (block == NULL) {
+    block = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block == MAP_FAILED) {
+      perror("mmap");
+      // TODO handle out of memory more gracefully?
+      abort();
+    }
+  }
+  return block;
+}
+
+/**
+ * Give a large block back to the free list of its size class, or unmap it if
+ * it's not to be pooled or the free lists are already holding as much as the
+ * high-water mark.
+ */
+static void give_back_large_block(void *block, size_t size, bool to_pool) {
+  int k = size_class_of(size);
+  CHECK_ERRNO(pthread_mutex_lock, &pool_lock);
+  num_bytes_buffered -= size;
+  if (to_pool && size == size_of_class(k) &&
+      num_bytes_pooled + size <= (size_t)POOL_HIGH_WATER_MIB << 20 &&
+      num_bytes_buffered + num_bytes_pooled + size <= max_buffered_bytes()) {
+    FreeBlock *free_block = block;
+    free_block->next = free_blocks[k];
+    free_blocks[k] = free_block;
+    num_bytes_pooled += size;
+    block = NULL;
   }
-  buf->data = malloc(BLOCKSIZE);
-  if (buf->data == NULL) {
-    perror("malloc");
-    return NULL;
+  CHECK_ERRNO(pthread_mutex_unlock, &pool_lock);
+  if (block != NULL) munmap(block, size);
+}
+
+/**
+ * Pool of the pipes buffers hold spliced records in.  A buffer takes one when
+ * records are first spliced into it, and gives it back once cleared, so only
+ * as many pipes are open as buffers holding records in them, and they never
+ * take more than half of the file descriptors the process may open, leaving
+ * the rest for the streams.
+ */
+typedef struct {
+  int fds[2];
+  int capacity;
+} PooledPipe;
+static PooledPipe *free_pipes;
+static int num_free_pipes, max_free_pipes;
+static int num_pipes_open;
+static int max_pipes_open = -1;  // Decided upon first use
+static pthread_mutex_t pipe_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Give the buffer a pipe from the pool, or a new one unless too many are open.
+ * Returns false if it can't have one, e.g., when out of file descriptors.
+ */
+static bool take_pipe(Buffer *buf) {
+  CHECK_ERRNO(pthread_mutex_lock, &pipe_pool_lock);
+  if (max_pipes_open < 0) {
+    struct rlimit limit;
+    max_pipes_open = INT_MAX;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+        limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur / 4 < INT_MAX)
+      max_pipes_open = limit.rlim_cur / 4;
+  }
+  if (num_free_pipes > 0) {
+    PooledPipe *pooled = &free_pipes[--num_free_pipes];
+    buf->pipe[0] = pooled->fds[0];
+    buf->pipe[1] = pooled->fds[1];
+    buf->pipe_capacity = pooled->capacity;
+  } else if (num_pipes_open < max_pipes_open &&
+             (buf->pipe_capacity = open_pipe(buf->pipe)) >= 0) {
+    ++num_pipes_open;
+  } else {
+    buf->pipe[0] = buf->pipe[1] = -1;
+  }
+  CHECK_ERRNO(pthread_mutex_unlock, &pipe_pool_lock);
+  return buf->pipe[0] >= 0;
+}
+
+/**
+ * Take the pipe away from the buffer, and put it in the pool if it's empty,
+ * or close it otherwise, as whatever's left in it is of no use to others.
+ */
+static void give_back_pipe(Buffer *buf, bool is_empty) {
+  CHECK_ERRNO(pthread_mutex_lock, &pipe_pool_lock);
+  if (is_empty && num_free_pipes == max_free_pipes) {
+    int max = max_free_pipes > 0 ? 2 * max_free_pipes : 16;
+    PooledPipe *pipes = realloc(free_pipes, max * sizeof(PooledPipe));
+    if (pipes != NULL) {
+      free_pipes = pipes;
+      max_free_pipes = max;
+    }
+  }
+  if (is_empty && num_free_pipes < max_free_pipes) {
+    free_pipes[num_free_pipes++] = (PooledPipe){
+        {buf->pipe[0], buf->pipe[1]}, buf->pipe_capacity};
+  } else {
+    close(buf->pipe[0]);
+    close(buf->pipe[1]);
+    --num_pipes_open;
+  }
+  CHECK_ERRNO(pthread_mutex_unlock, &pipe_pool_lock);
+  buf->pipe[0] = buf->pipe[1] = -1;
+}
+
+/**
+ * Lower the multiple buffering factor so the buffers for given number of
+ * streams fit in MAX_BUFFERED_MIB, but no lower than single buffering.
+ */
+int cap_multibuffering(int multibuffering, int num_streams) {
+  size_t max_factor = max_buffered_bytes() / ((size_t)BLOCKSIZE * num_streams);
+  if (multibuffering <= max_factor) return multibuffering;
+  if (max_factor < 1) max_factor = 1;
+  fprintf(stderr, "Lowering MULTIBUFFERING to %zu to fit MAX_BUFFERED_MIB=%d\n",
+          max_factor, MAX_BUFFERED_MIB);
+  return max_factor;
+}
+
+/**
+ * Arena of the initial buffers, carved out of a single mapping backed by huge
+ * pages and faulted in up front, so large buffers for many streams neither
+ * miss the TLB on every page nor fault page by page once data flows.  Buffer
+ * headers are laid out a cache line apart, so threads updating different
+ * buffers never write to the same line.
+ */
+#define CACHE_LINE_SIZE 64
+#define HUGE_PAGE_SIZE (2 << 20)
+static char *arena_headers, *arena_blocks;
+static size_t arena_header_stride, arena_block_stride;
+static int num_arena_buffers_left = 0;
+
+static inline size_t round_up(size_t n, size_t unit) {
+  return (n + unit - 1) / unit * unit;
+}
+
+static void *map_arena(size_t size) {
+  void *arena = MAP_FAILED;
+#if defined(MAP_HUGETLB) && defined(MAP_POPULATE)
+  // explicit huge pages, only when the system has some reserved
+  arena = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+  if (arena != MAP_FAILED) return arena;
+#endif
+  // otherwise, transparent huge pages, which need the mapping aligned to them
+  char *region = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (region == MAP_FAILED) return MAP_FAILED;
+  char *aligned = (char *)round_up((uintptr_t)region, HUGE_PAGE_SIZE);
+  if (aligned > region) munmap(region, aligned - region);
+  munmap(aligned + size, region + HUGE_PAGE_SIZE - aligned);
+#ifdef MADV_HUGEPAGE
+  madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+  // fault all pages in now, as MAP_POPULATE would before the advice
+  memset(aligned, 0, size);
+  return aligned;
+}
+
+/**
+ * Reserve room for given number of buffers in the arena, which new_buffer()
+ * takes from before falling back to malloc(3).  Does nothing unless
+ * BUFFER_ARENA is set.
+ */
+void reserve_buffer_arena(int num_buffers) {
+  if (!BUFFER_ARENA || num_buffers <= 0) return;
+  arena_header_stride = round_up(sizeof(Buffer), CACHE_LINE_SIZE);
+  arena_block_stride = round_up(BLOCKSIZE, CACHE_LINE_SIZE);
+  size_t headers_size = arena_header_stride * num_buffers;
+  size_t size = round_up(headers_size + arena_block_stride * num_buffers,
+                         HUGE_PAGE_SIZE);
+  char *arena = map_arena(size);
+  if (arena == MAP_FAILED) {
+    perror("mmap buffer arena");
+    return;
+  }
+  arena_headers = arena;
+  arena_blocks = arena + headers_size;
+  num_arena_buffers_left = num_buffers;
+}
+
+Buffer *new_buffer() {
+  Buffer *buf;
+  if (num_arena_buffers_left > 0) {
+    buf = (Buffer *)arena_headers;
+    buf->data = buf->own_data = arena_blocks;
+    arena_headers += arena_header_stride;
+    arena_blocks += arena_block_stride;
+    --num_arena_buffers_left;
+  } else {
+    buf = malloc(sizeof(Buffer));
+    if (buf == NULL) {
+      perror("malloc");
+      return NULL;
+    }
+    buf->data = buf->own_data = malloc(BLOCKSIZE);
+    if (buf->data == NULL) {
+      perror("malloc");
+      return NULL;
+    }
   }
   buf->capacity = BLOCKSIZE;
+  CHECK_ERRNO(pthread_mutex_lock, &pool_lock);
+  num_bytes_buffered += BLOCKSIZE;
+  CHECK_ERRNO(pthread_mutex_unlock, &pool_lock);
   buf->begin = 0;
   buf->size = 0;
   buf->end_of_last_record = -1;
+  buf->fixed_index = -1;
+  buf->pipe[0] = buf->pipe[1] = -1;
+  buf->pipe_capacity = 0;
+  buf->is_in_pipe = false;
+  buf->is_mapped = false;
+  buf->parent = NULL;
+  buf->num_slices = 0;
+  buf->num_records = 0;
+  buf->seq = 0;
   return buf;
 }
 
 void clear_buffer(Buffer *buf) {
+  // the pipe is of use to other buffers unless records are left in it
+  if (buf->pipe[0] >= 0)
+    give_back_pipe(buf, !buf->is_in_pipe || buf->size == 0);
   buf->begin = buf->size = 0;
   buf->end_of_last_record = -1;
+  buf->is_in_pipe = false;
+  buf->num_slices = 0;
+  if (buf->is_mapped || buf->parent != NULL) {
+    // the mapped file stays mapped for the other buffers pointing into it,
+    // and the data of a slice is its parent's to give back
+    buf->is_mapped = false;
+    buf->parent = NULL;
+    buf->data = buf->own_data;
+    buf->capacity = BLOCKSIZE;
+  } else if (buf->data != buf->own_data) {
+    // the large record is gone, and so should be the large block
+    give_back_large_block(buf->data, buf->capacity, true);
+    buf->data = buf->own_data;
+    buf->capacity = BLOCKSIZE;
+  }
 }
 
+/**
+ * Enlarge the buffer to hold at least given number of bytes, moving its data
+ * to a large block from the pool.  Its own block is kept aside to return to
+ * once cleared, while the large block it outgrows is unmapped rather than
+ * pooled, as a record growing that large is likely to keep growing.
+ */
 void enlarge_buffer(Buffer *buf, size_t new_capacity) {
-  void *buf_larger = realloc(buf->data, new_capacity);
-  if (buf_larger != NULL) {
-    buf->data = buf_larger;
-    buf->capacity = new_capacity;
-  } else {
-    perror("realloc");
-    // TODO handle out of memory more gracefully?
-    abort();
+  size_t size;
+  void *block = take_large_block(new_capacity, &size);
+  // data held in its pipe may be larger than its memory
+  size_t num_bytes_held = buf->begin + buf->size;
+  if (num_bytes_held > buf->capacity) num_bytes_held = buf->capacity;
+  memcpy(block, buf->data, num_bytes_held);
+  if (buf->data != buf->own_data)
+    give_back_large_block(buf->data, buf->capacity, false);
+  buf->data = block;
+  buf->capacity = size;
+}
+
+/**
+ * End of the slice of records in the buffer from given position, i.e., the
+ * last record boundary within about given size, or past it when a record
+ * straddles that, or the end of data when no boundary is found.
+ */
+int end_of_slice(Buffer *buf, int pos, int size) {
+  int end = buf->begin + buf->size;
+  Buffer window = *buf;
+  window.begin = pos;
+  window.end_of_last_record = pos - 1;
+  int scanned_size = 0;
+  while (size < end - pos) {
+    window.size = size;
+    find_end_of_last_record(&window, pos + scanned_size);
+    if (window.end_of_last_record >= pos) return window.end_of_last_record + 1;
+    scanned_size = size;
+    if (size > (end - pos) / 2) break;
+    size *= 2;
   }
+  return end;
+}
+
+/**
+ * Point the slice at the records of the buffer between given positions, so
+ * they can be handed off separately without copying them.  The slice keeps
+ * the buffer from being recycled until it is (See: release_slice).
+ */
+void point_slice_at(Buffer *slice, Buffer *buf, int pos, int end) {
+  slice->data = buf->data;
+  slice->capacity = buf->capacity;
+  slice->begin = pos;
+  slice->size = end - pos;
+  slice->end_of_last_record = end - 1;
+  slice->parent = buf;
+  __atomic_add_fetch(&buf->num_slices, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Release one of the slices of the buffer, or the hold on it while slicing,
+ * and tell whether the buffer can be recycled, i.e., none is left, or it was
+ * never sliced.
+ */
+bool release_slice(Buffer *buf) {
+  return buf->num_slices == 0 ||
+         __atomic_sub_fetch(&buf->num_slices, 1, __ATOMIC_SEQ_CST) == 0;
 }
 
 /**
@@ -48,11 +406,11 @@ inline void move_trailing_data_after_last_record(Buffer *tgt, Buffer *src) {
   int num_trailing_bytes_to_copy =
       src->size - (trailing_bytes_begin - src->begin);
   if (num_trailing_bytes_to_copy > 0) {
-    // ensure capacity
+    // ensure capacity, leaving room for reading the rest of the record
     DEBUG(" trailing data found in buffer %p (%d bytes, from %d)", src,
           num_trailing_bytes_to_copy, trailing_bytes_begin);
     int capacity = tgt->capacity;
-    while (capacity - tgt->size < num_trailing_bytes_to_copy) {
+    while (capacity - tgt->size <= num_trailing_bytes_to_copy) {
       capacity *= 2;
     }
     if (capacity > tgt->capacity) {
@@ -68,3 +426,836 @@ inline void move_trailing_data_after_last_record(Buffer *tgt, Buffer *src) {
     src->size -= num_trailing_bytes_to_copy;
   }
 }
+
+/**
+ * Find the last occurrence of given byte by checking one byte at a time
+ * backwards.  Returns NULL if none is found.
+ */
+const char *find_last_byte_bytewise(const char *data, size_t size, char c) {
+  for (const char *p = data + size - 1; p >= data; --p)
+    if (*p == c) return p;
+  return NULL;
+}
+
+#ifdef SIMD_SUPPORTED
+/**
+ * Find the last occurrence of given byte by comparing 16 bytes at a time with
+ * SSE2.
+ */
+__attribute__((target("sse2"))) static const char *find_last_byte_sse2(
+    const char *data, size_t size, char c) {
+  const __m128i cs = _mm_set1_epi8(c);
+  const char *p = data + size;
+  while (p - data >= 16) {
+    p -= 16;
+    int mask = _mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), cs));
+    if (mask) return p + 31 - __builtin_clz(mask);
+  }
+  return find_last_byte_bytewise(data, p - data, c);
+}
+
+/**
+ * Find the last occurrence of given byte by comparing 32 bytes at a time with
+ * AVX2.
+ */
+__attribute__((target("avx2"))) static const char *find_last_byte_avx2(
+    const char *data, size_t size, char c) {
+  const __m256i cs = _mm256_set1_epi8(c);
+  const char *p = data + size;
+  while (p - data >= 32) {
+    p -= 32;
+    unsigned mask = _mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), cs));
+    if (mask) return p + 31 - __builtin_clz(mask);
+  }
+  return find_last_byte_sse2(data, p - data, c);
+}
+#elif defined(__GLIBC__)
+static const char *find_last_byte_memrchr(const char *data, size_t size,
+                                          char c) {
+  return memrchr(data, c, size);
+}
+#endif
+
+/**
+ * The fastest implementation supported by the processor, chosen at startup
+ */
+static const char *(*find_last_byte_impl)(const char *, size_t, char) =
+    find_last_byte_bytewise;
+
+__attribute__((constructor)) static void choose_find_last_byte(void) {
+#ifdef SIMD_SUPPORTED
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    find_last_byte_impl = find_last_byte_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    find_last_byte_impl = find_last_byte_sse2;
+#elif defined(__GLIBC__)
+  find_last_byte_impl = find_last_byte_memrchr;
+#endif
+}
+
+/**
+ * Find the last occurrence of given byte.  Returns NULL if none is found.
+ */
+const char *find_last_byte(const char *data, size_t size, char c) {
+  return find_last_byte_impl(data, size, c);
+}
+
+/**
+ * Count the occurrences of given byte by checking one byte at a time.
+ */
+static size_t count_bytes_bytewise(const char *data, size_t size, char c) {
+  size_t count = 0;
+  for (const char *p = data; p < data + size; ++p) count += *p == c;
+  return count;
+}
+
+#ifdef SIMD_SUPPORTED
+/**
+ * Count the occurrences of given byte by comparing 16 bytes at a time with
+ * SSE2.
+ */
+__attribute__((target("sse2"))) static size_t count_bytes_sse2(
+    const char *data, size_t size, char c) {
+  const __m128i cs = _mm_set1_epi8(c);
+  const char *p = data;
+  size_t count = 0;
+  for (; data + size - p >= 16; p += 16)
+    count += __builtin_popcount(_mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), cs)));
+  return count + count_bytes_bytewise(p, data + size - p, c);
+}
+
+/**
+ * Count the occurrences of given byte by comparing 32 bytes at a time with
+ * AVX2.
+ */
+__attribute__((target("avx2,popcnt"))) static size_t count_bytes_avx2(
+    const char *data, size_t size, char c) {
+  const __m256i cs = _mm256_set1_epi8(c);
+  const char *p = data;
+  size_t count = 0;
+  for (; data + size - p >= 32; p += 32)
+    count += __builtin_popcount(_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), cs)));
+  return count + count_bytes_sse2(p, data + size - p, c);
+}
+#endif
+
+static size_t (*count_bytes_impl)(const char *, size_t, char) =
+    count_bytes_bytewise;
+
+__attribute__((constructor)) static void choose_count_bytes(void) {
+#ifdef SIMD_SUPPORTED
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+    count_bytes_impl = count_bytes_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    count_bytes_impl = count_bytes_sse2;
+#endif
+}
+
+/**
+ * Find the last record delimiter that ends in given bytes, which may start in
+ * the given number of bytes preceding them, so a multi-byte delimiter
+ * straddling two reads is found.  Returns a pointer to the last byte of the
+ * delimiter, or NULL if none is found.
+ */
+const char *find_last_delimiter(const char *data, size_t size,
+                                size_t num_preceding) {
+  const int len = RECORD_DELIMITER_LENGTH;
+  const char last_byte = RECORD_DELIMITER[len - 1];
+  if (len == 1) return find_last_byte_impl(data, size, last_byte);
+  // find the last byte of the delimiter, then check the bytes before it
+  const char *earliest =
+      data - (num_preceding < len - 1 ? num_preceding : len - 1);
+  for (const char *p = data + size; p > data;) {
+    p = find_last_byte_impl(data, p - data, last_byte);
+    if (p == NULL) break;
+    if (p - earliest >= len - 1 &&
+        memcmp(p - (len - 1), RECORD_DELIMITER, len - 1) == 0)
+      return p;
+  }
+  return NULL;
+}
+
+/**
+ * Decode the length prefix at given data.  Returns the number of bytes of the
+ * prefix, 0 if it is incomplete, or -1 if it is malformed.
+ */
+static inline int decode_length_prefix(const unsigned char *data, size_t size,
+                                       uint64_t *length) {
+  int num_bytes = 0;
+  switch (RECORD_FRAMING) {
+    case FRAMING_U32BE:
+    case FRAMING_U32LE:
+      num_bytes = 4;
+      break;
+    case FRAMING_U64BE:
+    case FRAMING_U64LE:
+      num_bytes = 8;
+      break;
+    case FRAMING_VARINT:
+      // seven bits per byte, least significant group first, and the most
+      // significant bit set on all bytes but the last one
+      *length = 0;
+      for (int shift = 0; shift < 64; shift += 7, ++num_bytes) {
+        if (num_bytes >= size) return 0;
+        *length |= (uint64_t)(data[num_bytes] & 0x7f) << shift;
+        if (!(data[num_bytes] & 0x80)) return num_bytes + 1;
+      }
+      return -1;
+    default:
+      return -1;
+  }
+  if (size < num_bytes) return 0;
+  *length = 0;
+  if (RECORD_FRAMING == FRAMING_U32BE || RECORD_FRAMING == FRAMING_U64BE)
+    for (int i = 0; i < num_bytes; ++i) *length = *length << 8 | data[i];
+  else
+    for (int i = num_bytes - 1; i >= 0; --i) *length = *length << 8 | data[i];
+  return num_bytes;
+}
+
+/**
+ * Find the end of last length-prefixed record in the buffer by jumping from a
+ * length prefix to the next one, starting after the last record found.  Only
+ * the prefixes are looked at, so the cost depends on the number of records
+ * rather than the number of bytes.  Returns -1 with errno set to EBADMSG upon
+ * a malformed prefix, which is dropped from the buffer along with whatever
+ * follows it, as no record can be told apart after it.
+ */
+static int find_end_of_last_framed_record(Buffer *buf) {
+  const unsigned char *data = buf->data;
+  int end = buf->begin + buf->size;
+  int next = buf->end_of_last_record + 1;
+  if (next < buf->begin) next = buf->begin;
+  while (next < end) {
+    uint64_t length;
+    int num_prefix_bytes = decode_length_prefix(data + next, end - next,
+                                                &length);
+    if (num_prefix_bytes == 0) break;  // prefix not fully read yet
+    if (num_prefix_bytes < 0 || length > INT_MAX / 2 - num_prefix_bytes) {
+      // no buffer can hold such record, so there's no point in going on
+      buf->size = next - buf->begin;
+      errno = EBADMSG;
+      return -1;
+    }
+    if (length > end - next - num_prefix_bytes) break;  // partial record
+    next += num_prefix_bytes + length;
+    buf->end_of_last_record = next - 1;
+  }
+  return 0;
+}
+
+/**
+ * Find the last record delimiter in the buffer, scanning the data down to
+ * given position, and update the end of last record if found.  Returns -1 if
+ * the records are malformed, which is only when framed by length prefixes.
+ */
+int find_end_of_last_record(Buffer *buf, int scan_down_to) {
+  if (RECORD_FRAMING != FRAMING_DELIMITER)
+    return find_end_of_last_framed_record(buf);
+  int scan_end = buf->begin + buf->size;
+  if (scan_end <= scan_down_to) return 0;
+  // a delimiter may start before the scanned range, but not before the
+  // beginning of data or within the last record
+  int earliest = buf->end_of_last_record + 1;
+  if (earliest < buf->begin) earliest = buf->begin;
+  int num_preceding = scan_down_to > earliest ? scan_down_to - earliest : 0;
+  const char *data = buf->data;
+  const char *delimiter = find_last_delimiter(
+      data + scan_down_to, scan_end - scan_down_to, num_preceding);
+  if (delimiter != NULL) buf->end_of_last_record = delimiter - data;
+  return 0;
+}
+
+/**
+ * Find the record starting at given position in the buffer, and where its
+ * content lies, i.e., without the length prefix or delimiter.  Returns the
+ * position right after the record, where an incomplete one extends to the end
+ * of the data.
+ */
+int find_record_at(Buffer *buf, int pos, int *content_begin,
+                   int *content_end) {
+  const char *data = buf->data;
+  int end = buf->begin + buf->size;
+  if (RECORD_FRAMING != FRAMING_DELIMITER) {
+    uint64_t length;
+    int num_prefix_bytes = decode_length_prefix(
+        (const unsigned char *)data + pos, end - pos, &length);
+    *content_begin = num_prefix_bytes > 0 ? pos + num_prefix_bytes : end;
+    if (num_prefix_bytes <= 0 || length > end - *content_begin) {
+      *content_end = end;
+      return end;
+    }
+    *content_end = *content_begin + length;
+    return *content_end;
+  }
+  const char *delimiter = memmem(data + pos, end - pos, RECORD_DELIMITER,
+                                 RECORD_DELIMITER_LENGTH);
+  *content_begin = pos;
+  if (delimiter == NULL) {
+    *content_end = end;
+    return end;
+  }
+  *content_end = delimiter - data;
+  return *content_end + RECORD_DELIMITER_LENGTH;
+}
+
+/**
+ * Count the record delimiters ending in the data, where a multi-byte one may
+ * begin in as many bytes preceding it.
+ */
+static int count_delimiters(const char *data, size_t size,
+                            size_t num_preceding) {
+  const int len = RECORD_DELIMITER_LENGTH;
+  if (len == 1) return count_bytes_impl(data, size, RECORD_DELIMITER[0]);
+  const char *p = data - (num_preceding < len - 1 ? num_preceding : len - 1);
+  int count = 0;
+  for (; (p = memmem(p, data + size - p, RECORD_DELIMITER, len)) != NULL;
+       p += len)
+    ++count;
+  return count;
+}
+
+/**
+ * Count the records held in the buffer, where trailing bytes not followed by a
+ * delimiter count as the last record.  Unlike finding the last record, this
+ * looks at every record, so it's only done for reporting statistics.
+ */
+int count_records(Buffer *buf) {
+  int num_records = 0;
+  // records held in the pipe were counted while being peeked at
+  if (buf->is_in_pipe) return buf->num_records;
+  if (RECORD_FRAMING == FRAMING_DELIMITER && RECORD_DELIMITER_LENGTH == 1) {
+    // counting the delimiters at once instead of looking for each record
+    const char *data = buf->data + buf->begin;
+    if (buf->size == 0) return 0;
+    num_records = count_bytes_impl(data, buf->size, RECORD_DELIMITER[0]);
+    return num_records + (data[buf->size - 1] != RECORD_DELIMITER[0]);
+  }
+  int content_begin, content_end;
+  for (int pos = buf->begin; pos < buf->begin + buf->size; ++num_records)
+    pos = find_record_at(buf, pos, &content_begin, &content_end);
+  return num_records;
+}
+
+/**
+ * Skip the records an output has written from the buffer before it failed,
+ * i.e., those from records_begin up to where the buffer now begins, so only
+ * the rest gets rerouted to another output.  The record it stopped in the
+ * middle of is resent whole or dropped by SPLIT_RECORD_POLICY.  A negative
+ * records_begin means what's written can't be looked back at, e.g., as it was
+ * spliced, so the record at the beginning is taken to be split, and dropped.
+ * Returns -1 if a record was split and the policy is to fail.
+ */
+int skip_written_records(Buffer *buf, int records_begin) {
+  int end = buf->begin + buf->size;
+  int split_begin = buf->begin, split_end = buf->begin;
+  int content_begin, content_end;
+  if (records_begin < 0) {
+    if (buf->size > 0)
+      split_end = find_record_at(buf, buf->begin, &content_begin,
+                                 &content_end);
+  } else {
+    // walking from the beginning as length prefixes can't be found otherwise
+    for (split_end = records_begin; split_end < buf->begin;)
+      split_end = find_record_at(buf, split_begin = split_end, &content_begin,
+                                 &content_end);
+  }
+  if (split_end > buf->begin) {
+    if (SPLIT_RECORD_POLICY == SPLIT_RECORD_FAIL) return -1;
+    bool can_resend = records_begin >= 0;
+    buf->begin = SPLIT_RECORD_POLICY == SPLIT_RECORD_RESEND && can_resend
+                     ? split_begin
+                     : split_end;
+    buf->size = end - buf->begin;
+  }
+  return 0;
+}
+
+/**
+ * Encode the length prefix of a record of given length into the data, which
+ * must have room for 10 bytes.  Returns the number of bytes of the prefix.
+ */
+static inline int encode_length_prefix(unsigned char *data, uint64_t length) {
+  int num_bytes = 0;
+  switch (RECORD_FRAMING) {
+    case FRAMING_U32BE:
+    case FRAMING_U32LE:
+      num_bytes = 4;
+      break;
+    case FRAMING_U64BE:
+    case FRAMING_U64LE:
+      num_bytes = 8;
+      break;
+    case FRAMING_VARINT:
+      for (; length >= 0x80; length >>= 7) data[num_bytes++] = length | 0x80;
+      data[num_bytes++] = length;
+      return num_bytes;
+    default:
+      return 0;
+  }
+  if (RECORD_FRAMING == FRAMING_U32BE || RECORD_FRAMING == FRAMING_U64BE)
+    for (int i = num_bytes - 1; i >= 0; --i, length >>= 8) data[i] = length;
+  else
+    for (int i = 0; i < num_bytes; ++i, length >>= 8) data[i] = length;
+  return num_bytes;
+}
+
+/**
+ * Format the record marking the sequence number of the records that follow
+ * it, which is the magic followed by the number in decimal, delimited or
+ * length-prefixed just as other records.  Returns the number of bytes.
+ */
+int format_sequence_header(char *header, uint64_t seq) {
+  char content[MAX_SEQUENCE_HEADER_LENGTH];
+  int content_size = snprintf(content, sizeof(content),
+                              SEQUENCE_HEADER_MAGIC "%llu",
+                              (unsigned long long)seq);
+  int size = 0;
+  if (RECORD_FRAMING != FRAMING_DELIMITER)
+    size = encode_length_prefix((unsigned char *)header, content_size);
+  memcpy(header + size, content, content_size);
+  size += content_size;
+  if (RECORD_FRAMING == FRAMING_DELIMITER) {
+    memcpy(header + size, RECORD_DELIMITER, RECORD_DELIMITER_LENGTH);
+    size += RECORD_DELIMITER_LENGTH;
+  }
+  return size;
+}
+
+/**
+ * Parse the sequence number from the content of a record, if it's a sequence
+ * header.
+ */
+static inline bool parse_sequence_header(const char *content, int size,
+                                         uint64_t *seq) {
+  int magic_size = sizeof(SEQUENCE_HEADER_MAGIC) - 1;
+  if (size <= magic_size || memcmp(content, SEQUENCE_HEADER_MAGIC, magic_size))
+    return false;
+  *seq = 0;
+  for (int i = magic_size; i < size; ++i) {
+    if (content[i] < '0' || content[i] > '9') return false;
+    *seq = *seq * 10 + (content[i] - '0');
+  }
+  return true;
+}
+
+/**
+ * Find the first sequence header among the records between given positions,
+ * which must start at a record.  Returns its position, while storing its
+ * sequence number and size, or -1 if there is none.  Delimited records are
+ * not looked at one by one, but the magic is searched for, and only where it
+ * follows a delimiter the header is parsed, so the cost stays close to that
+ * of finding the delimiters.
+ */
+int find_sequence_header(Buffer *buf, int pos, int end, uint64_t *seq,
+                         int *header_size) {
+  const char *data = buf->data;
+  int content_begin, content_end;
+  if (RECORD_FRAMING != FRAMING_DELIMITER) {
+    for (int next; pos < end; pos = next) {
+      next = find_record_at(buf, pos, &content_begin, &content_end);
+      if (parse_sequence_header(data + content_begin,
+                                content_end - content_begin, seq)) {
+        *header_size = next - pos;
+        return pos;
+      }
+    }
+    return -1;
+  }
+  int magic_size = sizeof(SEQUENCE_HEADER_MAGIC) - 1;
+  for (int begin = pos; begin < end;) {
+    // the first byte of the magic is rare enough to be looked for alone
+    const char *magic = memchr(data + begin, SEQUENCE_HEADER_MAGIC[0],
+                               end - begin);
+    if (magic == NULL) break;
+    int found = magic - data;
+    begin = found + 1;
+    if (end - found < magic_size ||
+        memcmp(magic, SEQUENCE_HEADER_MAGIC, magic_size))
+      continue;
+    // the magic must start a record
+    if (found != pos &&
+        (found - RECORD_DELIMITER_LENGTH < pos ||
+         memcmp(magic - RECORD_DELIMITER_LENGTH, RECORD_DELIMITER,
+                RECORD_DELIMITER_LENGTH)))
+      continue;
+    int next = find_record_at(buf, found, &content_begin, &content_end);
+    if (next <= end && content_end < next &&
+        parse_sequence_header(data + content_begin,
+                              content_end - content_begin, seq)) {
+      *header_size = next - found;
+      return found;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Parse bytes given with C-style escape sequences, e.g., \n, \0, \r\n, \t,
+ * \\, \x1e, or \036, into at most given number of bytes.  Returns the number
+ * of bytes parsed, or -1 if it is empty, too long, or malformed.
+ */
+int parse_escaped_bytes(const char *escaped, char *bytes, int max_len) {
+  int len = 0;
+  for (const char *p = escaped; *p != '\0'; ++len) {
+    if (len >= max_len) return -1;
+    if (*p != '\\') {
+      bytes[len] = *p++;
+      continue;
+    }
+    ++p;
+    int num_digits = 0, value = 0;
+    switch (*p) {
+      case 'a': bytes[len] = '\a'; ++p; break;
+      case 'b': bytes[len] = '\b'; ++p; break;
+      case 'f': bytes[len] = '\f'; ++p; break;
+      case 'n': bytes[len] = '\n'; ++p; break;
+      case 'r': bytes[len] = '\r'; ++p; break;
+      case 't': bytes[len] = '\t'; ++p; break;
+      case 'v': bytes[len] = '\v'; ++p; break;
+      case '\\': bytes[len] = '\\'; ++p; break;
+      case 'x':
+        // up to two hexadecimal digits
+        for (++p; num_digits < 2; ++num_digits, ++p) {
+          if ('0' <= *p && *p <= '9') value = value * 16 + *p - '0';
+          else if ('a' <= *p && *p <= 'f') value = value * 16 + *p - 'a' + 10;
+          else if ('A' <= *p && *p <= 'F') value = value * 16 + *p - 'A' + 10;
+          else break;
+        }
+        if (num_digits == 0) return -1;
+        bytes[len] = value;
+        break;
+      default:
+        // up to three octal digits
+        for (; num_digits < 3 && '0' <= *p && *p <= '7'; ++num_digits, ++p)
+          value = value * 8 + *p - '0';
+        if (num_digits == 0) return -1;
+        bytes[len] = value;
+    }
+  }
+  return len > 0 ? len : -1;
+}
+
+/**
+ * Parse a record delimiter given with C-style escape sequences.  Returns 0 upon
+ * success, or -1 if it is empty, too long, or malformed.
+ */
+int parse_record_delimiter(const char *escaped) {
+  char delimiter[MAX_RECORD_DELIMITER_LENGTH];
+  int len =
+      parse_escaped_bytes(escaped, delimiter, MAX_RECORD_DELIMITER_LENGTH);
+  if (len < 0) return -1;
+  memcpy(RECORD_DELIMITER, delimiter, len);
+  RECORD_DELIMITER_LENGTH = len;
+  return 0;
+}
+
+/**
+ * Parse the name of a record framing, i.e., delimiter, u32be, u32le, u64be,
+ * u64le, or varint.  Returns 0 upon success, or -1 if it is unknown.
+ */
+int parse_record_framing(const char *name) {
+  static const char *names[] = {
+      [FRAMING_DELIMITER] = "delimiter",
+      [FRAMING_U32BE] = "u32be",
+      [FRAMING_U32LE] = "u32le",
+      [FRAMING_U64BE] = "u64be",
+      [FRAMING_U64LE] = "u64le",
+      [FRAMING_VARINT] = "varint",
+  };
+  for (int i = 0; i < sizeof(names) / sizeof(*names); ++i)
+    if (!strcmp(name, names[i])) {
+      RECORD_FRAMING = i;
+      return 0;
+    }
+  return -1;
+}
+
+/**
+ * Parse the policy for the record an output failed in the middle of writing,
+ * i.e., resend, drop, or fail.  Returns 0 upon success, or -1 if unknown.
+ */
+int parse_split_record_policy(const char *name) {
+  static const char *names[] = {
+      [SPLIT_RECORD_RESEND] = "resend",
+      [SPLIT_RECORD_DROP] = "drop",
+      [SPLIT_RECORD_FAIL] = "fail",
+  };
+  for (int i = 0; i < sizeof(names) / sizeof(*names); ++i)
+    if (!strcmp(name, names[i])) {
+      SPLIT_RECORD_POLICY = i;
+      return 0;
+    }
+  return -1;
+}
+
+/**
+ * Create a pipe that can hold at least a block of data.  Returns the number of
+ * bytes the pipe can hold, or -1 upon error.
+ */
+int open_pipe(int pipe_fds[2]) {
+#ifdef SPLICE_SUPPORTED
+  if (pipe(pipe_fds) < 0) return -1;
+  int capacity = fcntl(pipe_fds[1], F_GETPIPE_SZ);
+  if (capacity < BLOCKSIZE) {
+    // it's fine to keep the default capacity if pipe-max-size is smaller
+    int larger_capacity = fcntl(pipe_fds[1], F_SETPIPE_SZ, BLOCKSIZE);
+    if (larger_capacity > 0) capacity = larger_capacity;
+  }
+  return capacity;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/**
+ * Move complete records from the input pipe into the pipe of the buffer
+ * without copying them to user space.  The record separator is found by
+ * peeking the data with tee(2) into the scratch pipe and scanning it, so only
+ * the bytes up to the last record separator are consumed from the input.
+ * Partial records are moved as well until their separator arrives, so a record
+ * is never split across buffers, and when a record does not fit in the pipe,
+ * or no pipe can be had, the buffer falls back to holding the records in
+ * memory.  Returns the number of bytes
+ * moved, which is zero only at EOF, or -1 upon error, e.g., EINVAL when the
+ * input isn't a pipe.
+ */
+int splice_records_from(Buffer *buf, int fd, int scratch_pipe[2]) {
+#ifdef SPLICE_SUPPORTED
+  if (buf->size == 0 && buf->pipe[0] < 0 && !take_pipe(buf))
+    DEBUG(" no pipe for buffer %p, holding records in memory", buf);
+  buf->is_in_pipe = buf->pipe[0] >= 0 && (buf->size == 0 || buf->is_in_pipe);
+  int num_bytes_to_peek = buf->pipe[0] >= 0 ? buf->pipe_capacity : BLOCKSIZE;
+  int num_bytes_moved = 0;
+  // the last bytes scanned are carried over to find multi-byte delimiters
+  int num_carry = RECORD_DELIMITER_LENGTH - 1, num_carried = 0;
+  for (;;) {
+    // peek the data without consuming it from the input
+    ssize_t num_bytes_peeked = tee(fd, scratch_pipe[1], num_bytes_to_peek, 0);
+    if (num_bytes_peeked < 0) return -1;
+    if (num_bytes_peeked == 0) {  // EOF reached
+      // where trailing bytes not followed by a delimiter are the last record
+      if (STATS_ENABLED && buf->is_in_pipe && buf->size > 0 &&
+          buf->end_of_last_record < buf->begin + buf->size - 1)
+        ++buf->num_records;
+      return num_bytes_moved;
+    }
+    // find the last record separator in the peeked data, using the memory
+    // of the buffer as scratch space when data is held in its pipe
+    int scan_offset = buf->is_in_pipe ? 0 : buf->begin + buf->size;
+    int scan_size = buf->capacity - scan_offset - num_carry;
+    if (!buf->is_in_pipe && scan_size < num_bytes_peeked) {
+      int capacity = buf->capacity;
+      while (capacity - scan_offset < num_bytes_peeked) capacity *= 2;
+      enlarge_buffer(buf, capacity);
+      scan_size = num_bytes_peeked;
+    }
+    int end_of_last_record = -1;
+    for (int offset = 0; offset < num_bytes_peeked;) {
+      int num_bytes_to_scan = num_bytes_peeked - offset;
+      if (num_bytes_to_scan > scan_size) num_bytes_to_scan = scan_size;
+      char *scan_data =
+          buf->data + scan_offset + (buf->is_in_pipe ? num_carried : offset);
+      num_bytes_to_scan = read(scratch_pipe[0], scan_data, num_bytes_to_scan);
+      if (num_bytes_to_scan <= 0) return -1;
+      // a delimiter may start in the bytes scanned earlier, which are carried
+      // over in front of the scanned ones when data is held in the pipe
+      const char *delimiter = find_last_delimiter(
+          scan_data, num_bytes_to_scan,
+          buf->is_in_pipe ? num_carried : buf->size + offset);
+      if (delimiter != NULL)
+        end_of_last_record = offset + (delimiter - scan_data);
+      // as they can't be counted once in the pipe (See: count_records)
+      if (STATS_ENABLED && buf->is_in_pipe)
+        buf->num_records += count_delimiters(scan_data, num_bytes_to_scan,
+                                             num_carried);
+      offset += num_bytes_to_scan;
+      if (buf->is_in_pipe && num_carry > 0) {
+        num_carried += num_bytes_to_scan;
+        if (num_carried > num_carry) num_carried = num_carry;
+        memmove(buf->data, scan_data + num_bytes_to_scan - num_carried,
+                num_carried);
+      }
+    }
+    // consume the complete records, or the whole partial record
+    int num_bytes_to_move =
+        end_of_last_record > -1 ? end_of_last_record + 1 : num_bytes_peeked;
+    while (num_bytes_to_move > 0) {
+      ssize_t num_bytes_consumed;
+      if (buf->is_in_pipe) {
+        DEBUG(" splicing %d bytes into buffer %p's pipe", num_bytes_to_move,
+              buf);
+        num_bytes_consumed =
+            splice(fd, NULL, buf->pipe[1], NULL, num_bytes_to_move,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (num_bytes_consumed < 0 && errno == EAGAIN) {
+          // hold the record in memory instead when the pipe is full, and
+          // peek the rest again
+          move_data_out_of_pipe(buf);
+          end_of_last_record = -1;
+          break;
+        }
+      } else {
+        // the peeked bytes are already in memory, but consume them
+        num_bytes_consumed = read(fd, buf->data + buf->begin + buf->size,
+                                  num_bytes_to_move);
+      }
+      if (num_bytes_consumed <= 0) return -1;
+      num_bytes_to_move -= num_bytes_consumed;
+      buf->size += num_bytes_consumed;
+      num_bytes_moved += num_bytes_consumed;
+    }
+    if (end_of_last_record > -1) {
+      buf->end_of_last_record = buf->begin + buf->size - 1;
+      return num_bytes_moved;
+    }
+  }
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/**
+ * Move data in the pipe of the buffer to the output without copying them to
+ * user space.  Returns the number of bytes moved, or -1 upon error, e.g.,
+ * EINVAL when the output doesn't support splice(2).
+ */
+int splice_data_to(Buffer *buf, int fd) {
+#ifdef SPLICE_SUPPORTED
+  ssize_t num_bytes_spliced =
+      splice(buf->pipe[0], NULL, fd, NULL, buf->size, SPLICE_F_MOVE);
+  if (num_bytes_spliced > 0) buf->size -= num_bytes_spliced;
+  return num_bytes_spliced;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/**
+ * Move data held in the pipe of the buffer back to its memory, so it can be
+ * handled the usual way.
+ */
+void move_data_out_of_pipe(Buffer *buf) {
+  if (!buf->is_in_pipe) return;
+  buf->is_in_pipe = false;
+  int capacity = buf->capacity;
+  while (capacity - buf->begin < buf->size) capacity *= 2;
+  if (capacity > buf->capacity) enlarge_buffer(buf, capacity);
+  for (int offset = 0; offset < buf->size;) {
+    int num_bytes_read = read(buf->pipe[0], buf->data + buf->begin + offset,
+                              buf->size - offset);
+    if (num_bytes_read <= 0) {
+      perror("read pipe");
+      abort();
+    }
+    offset += num_bytes_read;
+  }
+  DEBUG(" moved %d bytes out of buffer %p's pipe", buf->size, buf);
+}
+
+/**
+ * Number of bytes the kernel is asked to read ahead of the records handed off
+ * from a mapped file, on top of what it does for sequential access.
+ */
+#define MAPPED_READAHEAD_SIZE (4 << 20)  // 4MiB
+
+/**
+ * Map a regular file to hand off its records right from the mapping, i.e.,
+ * without reading them into buffers, starting where the file descriptor is
+ * positioned, e.g., by whatever read from it before.  Returns -1 if the file
+ * can't be, or needn't be mapped, e.g., it's not a regular file, or there's
+ * nothing left in it.
+ */
+int map_file(MappedFile *file, int fd) {
+  struct stat st;
+  file->data = NULL;
+  if (!MMAP_INPUTS || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) return -1;
+  off_t position = lseek(fd, 0, SEEK_CUR);
+  if (position < 0 || position >= st.st_size) return -1;
+  // mappings must begin at a page boundary
+  off_t page_size = sysconf(_SC_PAGESIZE);
+  off_t start = position / page_size * page_size;
+  void *data =
+      mmap(NULL, st.st_size - start, PROT_READ, MAP_PRIVATE, fd, start);
+  if (data == MAP_FAILED) return -1;
+  madvise(data, st.st_size - start, MADV_SEQUENTIAL);
+  file->data = data;
+  file->fd = fd;
+  file->start = start;
+  file->size = st.st_size - start;
+  file->offset = file->readahead_offset = position - start;
+  file->is_malformed = false;
+  return 0;
+}
+
+/**
+ * Point the buffer at the next chunk of complete records in the mapped file,
+ * which is BLOCKSIZE bytes up to the last record separator in it, or larger
+ * when a record straddles that, while the last chunk also includes whatever
+ * follows the last separator.  Returns the number of bytes in the chunk,
+ * which is zero only at the end of file, or -1 if the records are malformed.
+ */
+int map_next_records(MappedFile *file, Buffer *buf) {
+  if (file->is_malformed) {
+    errno = EBADMSG;
+    return -1;
+  }
+  // pages past the end of a file truncated since can't be touched, so its
+  // records end there, although chunks already handed off may still fault
+  struct stat st;
+  if (fstat(file->fd, &st) == 0 &&
+      st.st_size < file->start + (off_t)file->size) {
+    size_t size = st.st_size > file->start ? st.st_size - file->start : 0;
+    file->size = size > file->offset ? size : file->offset;
+  }
+  size_t num_bytes_left = file->size - file->offset;
+  if (num_bytes_left == 0) return 0;
+  buf->data = (char *)file->data + file->offset;
+  buf->is_mapped = true;
+  buf->begin = 0;
+  buf->end_of_last_record = -1;
+  size_t chunk_size = BLOCKSIZE, scanned_size = 0;
+  for (;;) {
+    if (chunk_size >= num_bytes_left || chunk_size > INT_MAX / 2) {
+      chunk_size = num_bytes_left < INT_MAX / 2 ? num_bytes_left : INT_MAX / 2;
+      buf->end_of_last_record = chunk_size - 1;
+      break;
+    }
+    buf->size = chunk_size;
+    if (find_end_of_last_record(buf, scanned_size) < 0) {
+      // the records before the malformed one are handed off first
+      if (buf->end_of_last_record < 0) return -1;
+      file->is_malformed = true;
+    }
+    if (buf->end_of_last_record > -1) {
+      chunk_size = buf->end_of_last_record + 1;
+      break;
+    }
+    scanned_size = chunk_size;
+    chunk_size *= 2;
+  }
+  buf->size = buf->capacity = chunk_size;
+  file->offset += chunk_size;
+  // keeping the position past what's handed off, as if it were read
+  lseek(file->fd, file->start + file->offset, SEEK_SET);
+  // ask for the chunks after the next ones in advance
+  if (file->offset + MAPPED_READAHEAD_SIZE > file->readahead_offset &&
+      file->readahead_offset < file->size) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t begin = file->readahead_offset / page_size * page_size;
+    size_t end = file->offset + 2 * MAPPED_READAHEAD_SIZE;
+    if (end > file->size) end = file->size;
+    madvise((char *)file->data + begin, end - begin, MADV_WILLNEED);
+    file->readahead_offset = end;
+  }
+  return chunk_size;
+}
@@ -1,22 +1,130 @@
 #ifndef BUFFER_H
 #define BUFFER_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
+// splice(2) and tee(2) allow moving data between pipes without copying
+#ifdef __linux__
+#define SPLICE_SUPPORTED
+#endif
+
 #define DEFAULT_BLOCKSIZE (4 * BUFSIZ)  // 4096
 extern int BLOCKSIZE;
 
+// bounds on the memory held by buffers (See: enlarge_buffer)
+#define DEFAULT_MAX_BUFFERED_MIB 0      // no limit by default
+#define DEFAULT_POOL_HIGH_WATER_MIB 64  // large blocks kept for reuse
+extern int MAX_BUFFERED_MIB;
+extern int POOL_HIGH_WATER_MIB;
+
+// regular files given as inputs are mapped into memory instead of read
+#define DEFAULT_MMAP_INPUTS 0
+extern int MMAP_INPUTS;
+
+// records an output failed to write can be rerouted to the other outputs
+// instead of tearing everything down, which needs SIGPIPE to be ignored
+#define DEFAULT_FAILOVER 0
+extern int FAILOVER;
+
+// what becomes of the record an output failed in the middle of writing
+typedef enum {
+  SPLIT_RECORD_RESEND = 0,  // Resend it whole to another output
+  SPLIT_RECORD_DROP,        // Drop the rest of it
+  SPLIT_RECORD_FAIL,        // Tear everything down as if not failing over
+} SplitRecordPolicy;
+extern SplitRecordPolicy SPLIT_RECORD_POLICY;
+
+// initial buffers can be carved out of a single huge-page mapping
+#define DEFAULT_BUFFER_ARENA 0
+extern int BUFFER_ARENA;
+
+#define DEFAULT_RECORD_DELIMITER "\n"
+#define MAX_RECORD_DELIMITER_LENGTH 16
+extern char RECORD_DELIMITER[MAX_RECORD_DELIMITER_LENGTH];
+extern int RECORD_DELIMITER_LENGTH;
+
+// records can be framed by a length prefix instead of a delimiter
+typedef enum {
+  FRAMING_DELIMITER = 0,  // Records end with RECORD_DELIMITER
+  FRAMING_U32BE,          // 32-bit big endian length before each record
+  FRAMING_U32LE,          // 32-bit little endian length
+  FRAMING_U64BE,          // 64-bit big endian length
+  FRAMING_U64LE,          // 64-bit little endian length
+  FRAMING_VARINT,         // Unsigned LEB128 varint length, as in protobuf
+} RecordFraming;
+extern RecordFraming RECORD_FRAMING;
+
 struct input;
 typedef struct input_buffer {
   void *data;
+  void *own_data;          // Block of BLOCKSIZE bytes, while data outgrows it
   int capacity;
   int begin, size;         // Byte range containing data
   int end_of_last_record;  // Last record seperator found in range
+  int fixed_index;         // Index among buffers registered to the kernel
+  int pipe[2];             // Kernel pipe to hold data without copying
+  int pipe_capacity;       // Num bytes the pipe can hold
+  bool is_in_pipe;         // Whether data is in the pipe instead of memory
+  bool is_mapped;          // Whether data lies in a mapped file instead
+  int num_slices;          // Slices of its data not yet recycled, if sliced
+  struct input_buffer *parent;  // Whose data a slice points into
+  int num_records;         // Num records held, when counted (See: stats.h)
+  uint64_t seq;            // Sequence number, when stamped for reordering
 } Buffer;
 
+void reserve_buffer_arena(int num_buffers);
 Buffer *new_buffer();
 void clear_buffer(Buffer *buf);
 void enlarge_buffer(Buffer *buf, size_t new_capacity);
+int cap_multibuffering(int multibuffering, int num_streams);
 void move_trailing_data_after_last_record(Buffer *target, Buffer *source);
+int end_of_slice(Buffer *buf, int pos, int size);
+void point_slice_at(Buffer *slice, Buffer *buf, int pos, int end);
+bool release_slice(Buffer *buf);
+
+// vectorized search for record delimiters
+const char *find_last_byte(const char *data, size_t size, char c);
+const char *find_last_byte_bytewise(const char *data, size_t size, char c);
+const char *find_last_delimiter(const char *data, size_t size,
+                                size_t num_preceding);
+int find_end_of_last_record(Buffer *buf, int scan_down_to);
+int find_record_at(Buffer *buf, int pos, int *content_begin,
+                   int *content_end);
+int count_records(Buffer *buf);
+int skip_written_records(Buffer *buf, int records_begin);
+
+// records marking the sequence number of the records that follow them, so a
+// merging mkmimo can restore the order a splitting one handed them off in
+#define SEQUENCE_HEADER_MAGIC "\036mkmimo-seq "
+#define MAX_SEQUENCE_HEADER_LENGTH 64
+int format_sequence_header(char *header, uint64_t seq);
+int find_sequence_header(Buffer *buf, int pos, int end, uint64_t *seq,
+                         int *header_size);
+
+int parse_escaped_bytes(const char *escaped, char *bytes, int max_len);
+int parse_record_delimiter(const char *escaped);
+int parse_record_framing(const char *name);
+int parse_split_record_policy(const char *name);
+
+// records handed off right from the mapping of a regular file
+typedef struct mapped_file {
+  const char *data;           // NULL unless mapped
+  int fd;
+  off_t start;                // Where in the file the mapping begins
+  size_t size;                // Num bytes mapped, or left since truncated
+  size_t offset;              // Where the records not yet handed off begin
+  size_t readahead_offset;    // Up to where the kernel was asked to read
+  bool is_malformed;          // Whether no record can be told apart at offset
+} MappedFile;
+int map_file(MappedFile *file, int fd);
+int map_next_records(MappedFile *file, Buffer *buf);
+
+// zero-copy transfer of records between pipes
+int open_pipe(int pipe_fds[2]);
+int splice_records_from(Buffer *buf, int fd, int scratch_pipe[2]);
+int splice_data_to(Buffer *buf, int fd);
+void move_data_out_of_pipe(Buffer *buf);
 
 #endif /* BUFFER_H */
@@ -0,0 +1,271 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "codec.h"
+#include "mkmimo.h"
+
+// how much compressed data is read or written at a time
+#define COMPRESSED_CHUNK_SIZE 65536
+
+#ifdef ZLIB_SUPPORTED
+#include <zlib.h>
+
+// what every gzip member starts with (See: RFC 1952)
+static const unsigned char GZIP_MAGIC[2] = {0x1f, 0x8b};
+
+struct decompressor {
+  z_stream stream;
+  bool is_gzipped;    // Whether the input turned out to be gzipped at all
+  bool is_in_member;  // Whether a gzip member has begun but not yet ended
+  unsigned char in[COMPRESSED_CHUNK_SIZE];
+};
+
+struct compressor {
+  z_stream stream;
+  bool has_unflushed;  // Whether anything was compressed since the last flush
+  unsigned char out[COMPRESSED_CHUNK_SIZE];
+};
+
+/**
+ * Whether the file starts like a gzip member, which is told without reading
+ * it, so only regular files can be.
+ */
+bool is_gzipped_file(int fd) {
+  unsigned char magic[sizeof(GZIP_MAGIC)];
+  return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+         memcmp(magic, GZIP_MAGIC, sizeof(magic)) == 0;
+}
+
+/**
+ * Read the first bytes of an input into the data to tell whether it's gzipped,
+ * and set the decompressor up accordingly.  Returns the number of bytes to
+ * hand as they are, which are none if it's gzipped, since they're moved to
+ * the decompressor.
+ */
+static ssize_t detect_gzip(Decompressor **decompressor, int fd,
+                           unsigned char *data, size_t size) {
+  ssize_t num_bytes_read = read(fd, data, size);
+  // a pipe may give the magic in pieces
+  while (num_bytes_read > 0 && num_bytes_read < sizeof(GZIP_MAGIC) &&
+         data[0] == GZIP_MAGIC[0] && size >= sizeof(GZIP_MAGIC)) {
+    ssize_t n = read(fd, data + num_bytes_read, size - num_bytes_read);
+    if (n <= 0) break;
+    num_bytes_read += n;
+  }
+  if (num_bytes_read <= 0) return num_bytes_read;
+  Decompressor *d = calloc(1, sizeof(Decompressor));
+  if (d == NULL) return -1;
+  *decompressor = d;
+  d->is_gzipped = num_bytes_read >= sizeof(GZIP_MAGIC) &&
+                  memcmp(data, GZIP_MAGIC, sizeof(GZIP_MAGIC)) == 0;
+  if (!d->is_gzipped) return num_bytes_read;
+  // decoding only gzip, so members are told apart from trailing garbage
+  if (inflateInit2(&d->stream, 16 + MAX_WBITS) != Z_OK) {
+    errno = ENOMEM;
+    return -1;
+  }
+  memcpy(d->in, data, num_bytes_read);
+  d->stream.next_in = d->in;
+  d->stream.avail_in = num_bytes_read;
+  return 0;
+}
+
+/**
+ * Read from the input into the data, decompressing what's read if the input
+ * turns out to be gzipped, or as read(2) would otherwise.  The decompressor
+ * is set up upon the first read.  Returns the number of decompressed bytes,
+ * which are as many as can be without waiting for more of the input, 0 at
+ * the end of it, or -1 upon error, e.g., EIO for malformed or truncated data.
+ * The input is read at most once, and only if nothing's pending, so whoever
+ * calls can wait for it beforehand, and EAGAIN tells them to call again when
+ * what's pending decompresses to nothing.
+ */
+ssize_t read_decompressed(Decompressor **decompressor, int fd, void *data,
+                          size_t size) {
+  if (*decompressor == NULL) {
+    ssize_t num_bytes = detect_gzip(decompressor, fd, data, size);
+    if (num_bytes != 0 || *decompressor == NULL) return num_bytes;
+  }
+  Decompressor *d = *decompressor;
+  if (!d->is_gzipped) return read(fd, data, size);
+
+  z_stream *z = &d->stream;
+  bool may_read = z->avail_in == 0;
+  z->next_out = data;
+  z->avail_out = size;
+  while (z->avail_out > 0) {
+    if (z->avail_in == 0) {
+      // hand what's decompressed so far rather than wait for more
+      if (z->avail_out < size) break;
+      if (!may_read) {
+        errno = EAGAIN;
+        return -1;
+      }
+      may_read = false;
+      ssize_t num_bytes_read = read(fd, d->in, sizeof(d->in));
+      if (num_bytes_read < 0) return -1;
+      if (num_bytes_read == 0) {
+        if (!d->is_in_member) return 0;
+        fprintf(stderr, "Unexpected end of gzipped input\n");
+        errno = EIO;
+        return -1;
+      }
+      z->next_in = d->in;
+      z->avail_in = num_bytes_read;
+    }
+    d->is_in_member = true;
+    int ret = inflate(z, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END) {
+      // gzip members can be concatenated, as gzip(1) decompresses them
+      d->is_in_member = false;
+      inflateReset(z);
+    } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      fprintf(stderr, "Malformed gzipped input: %s\n",
+              z->msg ? z->msg : zError(ret));
+      errno = EIO;
+      return -1;
+    }
+  }
+  return size - z->avail_out;
+}
+
+/**
+ * Whether some of what's read is yet to be decompressed, so the input isn't
+ * read next (See: read_decompressed)
+ */
+bool has_pending_input(Decompressor *decompressor) {
+  return decompressor != NULL && decompressor->is_gzipped &&
+         decompressor->stream.avail_in > 0;
+}
+
+void free_decompressor(Decompressor *decompressor) {
+  if (decompressor == NULL) return;
+  if (decompressor->is_gzipped) inflateEnd(&decompressor->stream);
+  free(decompressor);
+}
+
+/**
+ * Start a gzip stream compressed at the given level.
+ */
+Compressor *new_compressor(int level) {
+  Compressor *c = calloc(1, sizeof(Compressor));
+  if (c == NULL) return NULL;
+  if (level > Z_BEST_COMPRESSION) level = Z_BEST_COMPRESSION;
+  if (deflateInit2(&c->stream, level, Z_DEFLATED, 16 + MAX_WBITS, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    free(c);
+    return NULL;
+  }
+  c->stream.next_out = c->out;
+  c->stream.avail_out = sizeof(c->out);
+  return c;
+}
+
+/**
+ * Write all of the compressed chunk out, and start over.
+ */
+static int write_chunk(Compressor *c, int fd, Stats *stats) {
+  unsigned char *data = c->out;
+  size_t size = sizeof(c->out) - c->stream.avail_out;
+  while (size > 0) {
+    ssize_t num_bytes_written = write(fd, data, size);
+    count_syscall(stats, num_bytes_written);
+    if (num_bytes_written <= 0) return -1;
+    data += num_bytes_written;
+    size -= num_bytes_written;
+  }
+  c->stream.next_out = c->out;
+  c->stream.avail_out = sizeof(c->out);
+  return 0;
+}
+
+/**
+ * Compress with the given zlib flush mode, writing out the chunk as it fills
+ * up, and whatever's left of it as well unless not flushing.
+ */
+static int compress_and_write(Compressor *c, int fd, const void *data,
+                              size_t size, int flush, Stats *stats) {
+  z_stream *z = &c->stream;
+  z->next_in = (Bytef *)data;
+  z->avail_in = size;
+  for (;;) {
+    deflate(z, flush);
+    // all is compressed, and flushed if asked, once the chunk isn't full
+    if (z->avail_out > 0) break;
+    if (write_chunk(c, fd, stats) < 0) return -1;
+  }
+  if (flush == Z_NO_FLUSH) return 0;
+  return write_chunk(c, fd, stats);
+}
+
+/**
+ * Compress the data into the gzip stream written to fd, which may hold it
+ * back until more is compressed, or flushed.  Returns -1 upon error writing.
+ */
+int write_compressed(Compressor *compressor, int fd, const void *data,
+                     size_t size, Stats *stats) {
+  if (size == 0) return 0;
+  compressor->has_unflushed = true;
+  return compress_and_write(compressor, fd, data, size, Z_NO_FLUSH, stats);
+}
+
+/**
+ * Write out everything compressed so far, so whatever reads the stream can
+ * decompress all of it without waiting for the rest.
+ */
+int flush_compressed(Compressor *compressor, int fd, Stats *stats) {
+  if (!compressor->has_unflushed) return 0;
+  compressor->has_unflushed = false;
+  return compress_and_write(compressor, fd, NULL, 0, Z_SYNC_FLUSH, stats);
+}
+
+/**
+ * End the gzip stream, writing out its trailer.
+ */
+int finish_compressed(Compressor *compressor, int fd, Stats *stats) {
+  compressor->has_unflushed = false;
+  return compress_and_write(compressor, fd, NULL, 0, Z_FINISH, stats);
+}
+
+void free_compressor(Compressor *compressor) {
+  if (compressor == NULL) return;
+  deflateEnd(&compressor->stream);
+  free(compressor);
+}
+
+#else  // without zlib, nothing is ever decompressed, nor compressed
+
+bool is_gzipped_file(int fd) { return false; }
+
+ssize_t read_decompressed(Decompressor **decompressor, int fd, void *data,
+                          size_t size) {
+  return read(fd, data, size);
+}
+
+bool has_pending_input(Decompressor *decompressor) { return false; }
+
+void free_decompressor(Decompressor *decompressor) {}
+
+Compressor *new_compressor(int level) {
+  errno = ENOSYS;
+  return NULL;
+}
+
+int write_compressed(Compressor *compressor, int fd, const void *data,
+                     size_t size, Stats *stats) {
+  errno = ENOSYS;
+  return -1;
+}
+
+int flush_compressed(Compressor *compressor, int fd, Stats *stats) {
+  errno = ENOSYS;
+  return -1;
+}
+
+int finish_compressed(Compressor *compressor, int fd, Stats *stats) {
+  errno = ENOSYS;
+  return -1;
+}
+
+void free_compressor(Compressor *compressor) {}
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include "stats.h"
+#include <stdbool.h>
+#include <sys/types.h>
+
+// gzipped inputs can be decompressed, and outputs gzipped, by the very threads
+// reading and writing them, instead of by extra processes piped to mkmimo
+#define DEFAULT_DECOMPRESS_INPUTS 0
+#define DEFAULT_COMPRESS_OUTPUTS 0  // the gzip level, or none when 0
+extern int DECOMPRESS_INPUTS;
+extern int COMPRESS_OUTPUTS;
+
+// whether mkmimo was built with zlib (See: Makefile)
+#ifdef ZLIB_SUPPORTED
+#define CODECS_SUPPORTED true
+#else
+#define CODECS_SUPPORTED false
+#endif
+
+typedef struct decompressor Decompressor;
+typedef struct compressor Compressor;
+
+bool is_gzipped_file(int fd);
+ssize_t read_decompressed(Decompressor **decompressor, int fd, void *data,
+                          size_t size);
+bool has_pending_input(Decompressor *decompressor);
+void free_decompressor(Decompressor *decompressor);
+
+Compressor *new_compressor(int level);
+int write_compressed(Compressor *compressor, int fd, const void *data,
+                     size_t size, Stats *stats);
+int flush_compressed(Compressor *compressor, int fd, Stats *stats);
+int finish_compressed(Compressor *compressor, int fd, Stats *stats);
+void free_compressor(Compressor *compressor);
+
+#endif /* CODEC_H */
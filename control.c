@@ -0,0 +1,224 @@
+#include "control.h"
+#include "mkmimo.h"
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// longest command accepted, e.g., attach output followed by a long path
+#define MAX_COMMAND_LENGTH 4096
+// most file descriptors passed along but not yet taken by a command
+#define MAX_PASSED_FDS 16
+
+static const ControlOps *control_ops;
+static int listening_fd = -1;
+static pthread_t control_thread;
+
+/**
+ * Attach a stream of given name with the first file descriptor passed along
+ * the commands, or by opening the name as a path if none is left, which waits
+ * for the other end of a named pipe.
+ */
+static int attach(char *name, int flags, int *fds, int *num_fds,
+                  int (*attach_stream)(char *name, int fd)) {
+  int fd;
+  if (*num_fds > 0) {
+    fd = fds[0];
+    memmove(fds, fds + 1, --*num_fds * sizeof(int));
+  } else {
+    fd = open(name, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0) return -1;
+  }
+  // the stream can't be left half attached
+  int cancel_state;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+  char *kept_name = strdup(name);
+  int result = attach_stream(kept_name, fd);
+  if (result < 0) {
+    int err = errno;
+    close(fd);
+    free(kept_name);
+    errno = err;
+  }
+  pthread_setcancelstate(cancel_state, NULL);
+  return result;
+}
+
+static int detach(const char *name, int (*detach_stream)(const char *name)) {
+  int cancel_state;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+  int result = detach_stream(name);
+  pthread_setcancelstate(cancel_state, NULL);
+  return result;
+}
+
+static inline char *after_prefix(char *command, const char *prefix) {
+  size_t length = strlen(prefix);
+  return strncmp(command, prefix, length) ? NULL : command + length;
+}
+
+/**
+ * Run a command, one of:
+ *
+ *   attach input NAME
+ *   attach output NAME
+ *   detach input NAME
+ *   detach output NAME
+ *
+ * Returns 0 upon success, or -1 with errno set.
+ */
+static int run_command(char *command, int *fds, int *num_fds) {
+  char *name;
+  if ((name = after_prefix(command, "attach input ")) != NULL)
+    return attach(name, O_RDONLY, fds, num_fds, control_ops->attach_input);
+  if ((name = after_prefix(command, "attach output ")) != NULL)
+    return attach(name, O_WRONLY | O_CREAT | O_TRUNC, fds, num_fds,
+                  control_ops->attach_output);
+  if ((name = after_prefix(command, "detach input ")) != NULL)
+    return detach(name, control_ops->detach_input);
+  if ((name = after_prefix(command, "detach output ")) != NULL)
+    return detach(name, control_ops->detach_output);
+  errno = EINVAL;
+  return -1;
+}
+
+/**
+ * Run the command, and reply to it with a line, either ok, or error followed
+ * by what went wrong.
+ */
+static void run_and_reply(int conn_fd, char *command, int *fds, int *num_fds) {
+  DEBUG("control: %s", command);
+  char reply[BUFSIZ];
+  int size = run_command(command, fds, num_fds) < 0
+                 ? snprintf(reply, sizeof(reply), "error: %s\n",
+                            strerror(errno))
+                 : snprintf(reply, sizeof(reply), "ok\n");
+  if (send(conn_fd, reply, size, MSG_NOSIGNAL) < 0) perror("control reply");
+}
+
+/**
+ * Keep the file descriptors passed along what's received, closing the ones
+ * that don't fit.
+ */
+static void keep_passed_fds(struct msghdr *msg, int *fds, int *num_fds) {
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    int num_passed = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (int i = 0; i < num_passed; ++i) {
+      int fd;
+      memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      if (*num_fds < MAX_PASSED_FDS) {
+        fds[(*num_fds)++] = fd;
+      } else {
+        close(fd);
+      }
+    }
+  }
+}
+
+/**
+ * Run the commands received over a connection, each on its own line, until
+ * it's closed.  File descriptors passed along are taken by the attach
+ * commands in the order they are received.
+ */
+static void serve_connection(int conn_fd) {
+  char line[MAX_COMMAND_LENGTH];
+  int length = 0;
+  int fds[MAX_PASSED_FDS];
+  int num_fds = 0;
+  for (;;) {
+    union {
+      char buf[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))];
+      struct cmsghdr align;
+    } control;
+    struct iovec iov = {line + length, sizeof(line) - length};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    ssize_t num_bytes_received = recvmsg(conn_fd, &msg, 0);
+    if (num_bytes_received <= 0) break;
+    keep_passed_fds(&msg, fds, &num_fds);
+    length += num_bytes_received;
+    char *command = line, *end;
+    while ((end = memchr(command, '\n', line + length - command)) != NULL) {
+      *end = '\0';
+      if (end > command && end[-1] == '\r') end[-1] = '\0';
+      if (*command != '\0') run_and_reply(conn_fd, command, fds, &num_fds);
+      command = end + 1;
+    }
+    length -= command - line;
+    memmove(line, command, length);
+    if (length == sizeof(line)) {
+      fprintf(stderr, "control: Command too long\n");
+      break;
+    }
+  }
+  for (int i = 0; i < num_fds; ++i) close(fds[i]);
+}
+
+/**
+ * Function executed by the control thread, serving one connection at a time
+ * until cancelled.
+ */
+static void *serve_control_connections(void *arg) {
+  for (;;) {
+    int conn_fd = accept(listening_fd, NULL, NULL);
+    if (conn_fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      perror("accept control connection");
+      break;
+    }
+    serve_connection(conn_fd);
+    close(conn_fd);
+  }
+  return NULL;
+}
+
+/**
+ * Listen on CONTROL_SOCKET for commands to attach and detach streams, which
+ * are run by the given functions.  A socket left behind at the path, e.g., by
+ * an earlier run, is replaced, but not other kinds of files.  Returns -1 upon
+ * error.
+ */
+int start_control_server(const ControlOps *ops) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(CONTROL_SOCKET) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, CONTROL_SOCKET);
+  struct stat st;
+  if (stat(CONTROL_SOCKET, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(CONTROL_SOCKET);
+  listening_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listening_fd < 0) return -1;
+  if (bind(listening_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(listening_fd, SOMAXCONN) < 0) {
+    int err = errno;
+    close(listening_fd);
+    listening_fd = -1;
+    errno = err;
+    return -1;
+  }
+  control_ops = ops;
+  CHECK_ERRNO(pthread_create, &control_thread, NULL, serve_control_connections,
+              NULL);
+  return 0;
+}
+
+/**
+ * Stop taking commands, and remove the socket.
+ */
+void stop_control_server(void) {
+  if (listening_fd < 0) return;
+  CHECK_ERRNO(pthread_cancel, control_thread);
+  CHECK_ERRNO(pthread_join, control_thread, NULL);
+  close(listening_fd);
+  unlink(CONTROL_SOCKET);
+  listening_fd = -1;
+}
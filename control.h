@@ -0,0 +1,24 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+// inputs and outputs can be attached and detached at runtime by commands sent
+// over a Unix domain socket, which can pass their file descriptors along
+#define DEFAULT_MAX_ATTACHED_STREAMS 64
+extern char *CONTROL_SOCKET;
+extern int MAX_ATTACHED_STREAMS;
+
+/**
+ * What an implementation does for each command, returning 0 upon success, or
+ * -1 with errno set.  The name is kept by the stream once attached.
+ */
+typedef struct control_ops {
+  int (*attach_input)(char *name, int fd);
+  int (*attach_output)(char *name, int fd);
+  int (*detach_input)(const char *name);
+  int (*detach_output)(const char *name);
+} ControlOps;
+
+int start_control_server(const ControlOps *ops);
+void stop_control_server(void);
+
+#endif /* CONTROL_H */
@@ -1,9 +1,15 @@
 #include "mkmimo.h"
+#include "control.h"
+#include "mkmimo_epoll.h"
 #include "mkmimo_multithreaded.h"
 #include "mkmimo_nonblocking.h"
+#include "mkmimo_uring.h"
+#include "mkmimo_workers.h"
+#include "partition.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,10 +25,38 @@ static int (*mkmimo)(Inputs *, Outputs *) = NULL;
 
 /* Declared externally in mkmimo.h */
 int BLOCKSIZE = DEFAULT_BLOCKSIZE;
+int MAX_BUFFERED_MIB = DEFAULT_MAX_BUFFERED_MIB;
+int POOL_HIGH_WATER_MIB = DEFAULT_POOL_HIGH_WATER_MIB;
+int BUFFER_ARENA = DEFAULT_BUFFER_ARENA;
+int MMAP_INPUTS = DEFAULT_MMAP_INPUTS;
+int FAILOVER = DEFAULT_FAILOVER;
+SplitRecordPolicy SPLIT_RECORD_POLICY = SPLIT_RECORD_RESEND;
+char *CONTROL_SOCKET = NULL;
+int DECOMPRESS_INPUTS = DEFAULT_DECOMPRESS_INPUTS;
+int COMPRESS_OUTPUTS = DEFAULT_COMPRESS_OUTPUTS;
+int MAX_ATTACHED_STREAMS = DEFAULT_MAX_ATTACHED_STREAMS;
+int ADAPTIVE_BLOCKSIZE = DEFAULT_ADAPTIVE_BLOCKSIZE;
+int MIN_BLOCKSIZE = DEFAULT_MIN_BLOCKSIZE;
+int MAX_BLOCKSIZE = DEFAULT_MAX_BLOCKSIZE;
+int TARGET_READS_PER_SEC = DEFAULT_TARGET_READS_PER_SEC;
+int TARGET_FILL_LATENCY_USEC = DEFAULT_TARGET_FILL_LATENCY_USEC;
+int MIN_BATCH_BYTES = DEFAULT_MIN_BATCH_BYTES;
+int MAX_FLUSH_LATENCY_USEC = DEFAULT_MAX_FLUSH_LATENCY_USEC;
+char RECORD_DELIMITER[MAX_RECORD_DELIMITER_LENGTH] = DEFAULT_RECORD_DELIMITER;
+int RECORD_DELIMITER_LENGTH = sizeof(DEFAULT_RECORD_DELIMITER) - 1;
+RecordFraming RECORD_FRAMING = FRAMING_DELIMITER;
+PartitionKey PARTITION_KEY = {
+    .kind = PARTITION_NONE,
+    .delimiter = DEFAULT_PARTITION_KEY_DELIMITER,
+    .delimiter_length = sizeof(DEFAULT_PARTITION_KEY_DELIMITER) - 1,
+};
 
 static char NAME_FOR_STDIN[] = "/dev/stdin";
 static char NAME_FOR_STDOUT[] = "/dev/stdout";
 
+// file listing the weights of outputs
+static char *OUTPUT_WEIGHTS = NULL;
+
 static inline void clean_up(Inputs *inputs, Outputs *outputs) {
   for (int i = 0; i < inputs->num_inputs; i++) {
     close(inputs->inputs[i].fd);
@@ -31,16 +65,18 @@ static inline void clean_up(Inputs *inputs, Outputs *outputs) {
 }
 
 static inline int open_inputs(char *argv[], Inputs *inputs, int num_in,
-                              bool use_stdin) {
+                              int base_idx_in, bool use_stdin) {
   inputs->num_inputs = num_in;
-  inputs->inputs = calloc(inputs->num_inputs, sizeof(struct input));
+  // leaving room for the ones to be attached at runtime
+  inputs->max_inputs = num_in + (CONTROL_SOCKET ? MAX_ATTACHED_STREAMS : 0);
+  inputs->inputs = calloc(inputs->max_inputs, sizeof(struct input));
 
   for (int i = 0; i < inputs->num_inputs; i++) {
     // Open file or default to stdin
     char *name = NAME_FOR_STDIN;
     int fd = 0;
     if (!use_stdin) {
-      name = argv[1 + i];
+      name = argv[base_idx_in + i];
       fd = open(name, O_RDONLY);
       if (fd < 0) {
         perrorf("open %s", name);
@@ -65,16 +101,68 @@ static inline int open_inputs(char *argv[], Inputs *inputs, int num_in,
   return 0;
 }
 
+/**
+ * Strip the weight given after the last @ of an output path, e.g., out.1@4,
+ * returning it, or 1 if there's none.  A path that already exists is taken
+ * as is, so a new one that ends with @ and digits itself should be given
+ * with an explicit weight, e.g., out@2@1.
+ */
+static inline int strip_output_weight(char *name) {
+  char *at = strrchr(name, '@');
+  if (at == NULL || at[1] == '\0' || at[strspn(at + 1, "0123456789") + 1])
+    return 1;
+  if (access(name, F_OK) == 0)
+    return 1;
+  int weight = atoi(at + 1);
+  if (weight <= 0) {
+    fprintf(stderr, "%s: Invalid output weight, using 1\n", name);
+    weight = 1;
+  }
+  *at = '\0';
+  return weight;
+}
+
+/**
+ * Read the weights of outputs from a file whose lines hold a path and a
+ * weight, separated by whitespace, where lines starting with # are ignored.
+ */
+static inline int read_output_weights(const char *path, Outputs *outputs) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    perrorf("open %s", path);
+    return 1;
+  }
+  char line[BUFSIZ], name[BUFSIZ];
+  int weight;
+  for (int lineno = 1; fgets(line, sizeof(line), file) != NULL; ++lineno) {
+    char *p = line + strspn(line, " \t\r\n");
+    if (*p == '\0' || *p == '#') continue;
+    if (sscanf(p, "%s %d", name, &weight) != 2 || weight <= 0) {
+      fprintf(stderr, "%s:%d: Invalid output weight\n", path, lineno);
+      fclose(file);
+      return 1;
+    }
+    for (int i = 0; i < outputs->num_outputs; i++)
+      if (!strcmp(outputs->outputs[i].name, name))
+        outputs->outputs[i].weight = weight;
+  }
+  fclose(file);
+  return 0;
+}
+
 static inline int open_outputs(char *argv[], Outputs *outputs, int num_out,
                                int base_idx_out, bool use_stdout) {
   outputs->num_outputs = num_out;
-  outputs->outputs = calloc(num_out, sizeof(Output));
+  outputs->max_outputs = num_out + (CONTROL_SOCKET ? MAX_ATTACHED_STREAMS : 0);
+  outputs->outputs = calloc(outputs->max_outputs, sizeof(Output));
 
   for (int i = 0; i < num_out; i++) {
     char *name = NAME_FOR_STDOUT;
     int fd = 1;
+    int weight = 1;
     if (!use_stdout) {
       name = argv[base_idx_out + i];
+      weight = strip_output_weight(name);
       fd = open(name, O_WRONLY | O_CREAT | O_TRUNC,
                 S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
       if (fd < 0) {
@@ -89,21 +177,95 @@ static inline int open_outputs(char *argv[], Outputs *outputs, int num_out,
         .is_closed = 0,
         .is_writable = 0,
         .is_busy = 0,
+        .weight = weight,
     };
     outputs->outputs[i] = this;
   }
 
+  if (OUTPUT_WEIGHTS != NULL && read_output_weights(OUTPUT_WEIGHTS, outputs))
+    return 1;
+  for (int i = 0; i < num_out; i++)
+    if (outputs->outputs[i].weight != 1) outputs->are_weighted = true;
+
   outputs->last_closed = outputs->num_outputs;
   return 0;
 }
 
+static inline void parse_record_delimiter_or_exit(char *escaped) {
+  if (escaped == NULL || parse_record_delimiter(escaped)) {
+    fprintf(stderr, "%s: Invalid record delimiter\n", escaped ? escaped : "");
+    exit(1);
+  }
+}
+
+static inline void parse_record_framing_or_exit(char *name) {
+  if (name == NULL || parse_record_framing(name)) {
+    fprintf(stderr, "%s: Invalid record framing\n", name ? name : "");
+    exit(1);
+  }
+}
+
+static inline void parse_partition_key_or_exit(char *spec) {
+  if (spec == NULL || parse_partition_key(spec)) {
+    fprintf(stderr, "%s: Invalid partition key\n", spec ? spec : "");
+    exit(1);
+  }
+}
+
+static inline void parse_partition_key_delimiter_or_exit(char *escaped) {
+  if (escaped == NULL || parse_partition_key_delimiter(escaped)) {
+    fprintf(stderr, "%s: Invalid partition key delimiter\n",
+            escaped ? escaped : "");
+    exit(1);
+  }
+}
+
 static inline int parse_arguments(int argc, char *argv[], Inputs *inputs,
                                   Outputs *outputs) {
+  // Parse options given before any input or output
+  int base_idx_in = 1;
+  for (; base_idx_in < argc; ++base_idx_in) {
+    char *opt = argv[base_idx_in];
+    if (opt[0] != '-' || opt[1] == '\0') {
+      break;
+    } else if (!strcmp(opt, "--")) {
+      ++base_idx_in;
+      break;
+    } else if (!strncmp(opt, "-d", 2)) {
+      // record delimiter, e.g., -d '\0' or -d'\r\n'
+      parse_record_delimiter_or_exit(opt[2] != '\0' ? opt + 2
+                                                    : argv[++base_idx_in]);
+    } else if (!strncmp(opt, "-f", 2)) {
+      // record framing, e.g., -f u32be or -fvarint
+      parse_record_framing_or_exit(opt[2] != '\0' ? opt + 2
+                                                  : argv[++base_idx_in]);
+    } else if (!strncmp(opt, "-k", 2)) {
+      // partition records by a key, e.g., -k f2 or -kb1-8
+      parse_partition_key_or_exit(opt[2] != '\0' ? opt + 2
+                                                 : argv[++base_idx_in]);
+    } else if (!strncmp(opt, "-w", 2)) {
+      // file listing the weights of outputs, e.g., -w weights.conf
+      OUTPUT_WEIGHTS = opt[2] != '\0' ? opt + 2 : argv[++base_idx_in];
+      if (OUTPUT_WEIGHTS == NULL) {
+        fprintf(stderr, "-w: Missing file of output weights\n");
+        exit(1);
+      }
+    } else if (!strncmp(opt, "-t", 2)) {
+      // delimiter between the fields of the key, e.g., -t, or -t '\0'
+      parse_partition_key_delimiter_or_exit(opt[2] != '\0'
+                                                ? opt + 2
+                                                : argv[++base_idx_in]);
+    } else {
+      fprintf(stderr, "%s: Unknown option\n", opt);
+      exit(1);
+    }
+  }
+
   // Count number of inputs and outputs
   int num_in = 0, num_out = 0;
   bool use_stdin = false, use_stdout = false;
-  int base_idx_out = 1;
-  for (int i = 1; i < argc; ++i) {
+  int base_idx_out = base_idx_in;
+  for (int i = base_idx_in; i < argc; ++i) {
     if (!strncmp(argv[i], ">", 2)) {
       num_in = num_out;
       base_idx_out = i + 1;
@@ -123,7 +285,7 @@ static inline int parse_arguments(int argc, char *argv[], Inputs *inputs,
     num_out = 1;
   }
 
-  if (open_inputs(argv, inputs, num_in, use_stdin)) {
+  if (open_inputs(argv, inputs, num_in, base_idx_in, use_stdin)) {
     return 1;
   } else if (open_outputs(argv, outputs, num_out, base_idx_out, use_stdout)) {
     return 2;
@@ -141,12 +303,105 @@ static inline void parse_environ(void) {
     mkmimo = mkmimo_nonblocking;
   } else if (!strcmp(impl, "multithreaded")) {
     mkmimo = mkmimo_multithreaded;
+#ifdef EPOLL_SUPPORTED
+  } else if (!strcmp(impl, "epoll")) {
+    mkmimo = mkmimo_epoll;
+  } else if (!strcmp(impl, "workers")) {
+    mkmimo = mkmimo_workers;
+#endif
+  } else if (!strcmp(impl, "uring")) {
+    mkmimo = mkmimo_uring;
   } else {
     fprintf(stderr, "%s: Invalid MKMIMO_IMPL\n", impl);
     exit(1);
   }
   // get initial buffer size
   readIntFromEnv(BLOCKSIZE, BLOCKSIZE, BLOCKSIZE > 0, DEFAULT_BLOCKSIZE);
+  // get bounds on the memory held by buffers
+  readIntFromEnv(MAX_BUFFERED_MIB, MAX_BUFFERED_MIB, MAX_BUFFERED_MIB >= 0,
+                 DEFAULT_MAX_BUFFERED_MIB);
+  readIntFromEnv(POOL_HIGH_WATER_MIB, POOL_HIGH_WATER_MIB,
+                 POOL_HIGH_WATER_MIB >= 0, DEFAULT_POOL_HIGH_WATER_MIB);
+  readIntFromEnv(BUFFER_ARENA, BUFFER_ARENA, 1, DEFAULT_BUFFER_ARENA);
+  readIntFromEnv(MMAP_INPUTS, MMAP_INPUTS, 1, DEFAULT_MMAP_INPUTS);
+  // get whether to reroute what failed outputs leave behind, and how
+  readIntFromEnv(FAILOVER, FAILOVER, 1, DEFAULT_FAILOVER);
+  char *policy = getenv("SPLIT_RECORD_POLICY");
+  if (policy != NULL) {
+    if (parse_split_record_policy(policy)) {
+      fprintf(stderr, "%s: Invalid SPLIT_RECORD_POLICY, using default\n",
+              policy);
+    } else {
+      DEBUG("SPLIT_RECORD_POLICY=%s", policy);
+    }
+  }
+  // get how each input tunes its block size
+  readIntFromEnv(ADAPTIVE_BLOCKSIZE, ADAPTIVE_BLOCKSIZE, 1,
+                 DEFAULT_ADAPTIVE_BLOCKSIZE);
+  readIntFromEnv(MIN_BLOCKSIZE, MIN_BLOCKSIZE, MIN_BLOCKSIZE > 0,
+                 DEFAULT_MIN_BLOCKSIZE);
+  readIntFromEnv(MAX_BLOCKSIZE, MAX_BLOCKSIZE, MAX_BLOCKSIZE >= MIN_BLOCKSIZE,
+                 DEFAULT_MAX_BLOCKSIZE);
+  readIntFromEnv(TARGET_READS_PER_SEC, TARGET_READS_PER_SEC,
+                 TARGET_READS_PER_SEC > 0, DEFAULT_TARGET_READS_PER_SEC);
+  readIntFromEnv(TARGET_FILL_LATENCY_USEC, TARGET_FILL_LATENCY_USEC,
+                 TARGET_FILL_LATENCY_USEC > 0,
+                 DEFAULT_TARGET_FILL_LATENCY_USEC);
+  // get how long each input can batch records
+  readIntFromEnv(MIN_BATCH_BYTES, MIN_BATCH_BYTES, MIN_BATCH_BYTES >= 0,
+                 DEFAULT_MIN_BATCH_BYTES);
+  readIntFromEnv(MAX_FLUSH_LATENCY_USEC, MAX_FLUSH_LATENCY_USEC,
+                 MAX_FLUSH_LATENCY_USEC >= 0, DEFAULT_MAX_FLUSH_LATENCY_USEC);
+  // get record delimiter
+  char *delimiter = getenv("RECORD_DELIMITER");
+  if (delimiter != NULL) {
+    if (parse_record_delimiter(delimiter)) {
+      fprintf(stderr, "%s: Invalid RECORD_DELIMITER, using default\n",
+              delimiter);
+    } else {
+      DEBUG("RECORD_DELIMITER=%s", delimiter);
+    }
+  }
+  // get record framing
+  char *framing = getenv("RECORD_FRAMING");
+  if (framing != NULL) {
+    if (parse_record_framing(framing)) {
+      fprintf(stderr, "%s: Invalid RECORD_FRAMING, using default\n", framing);
+    } else {
+      DEBUG("RECORD_FRAMING=%s", framing);
+    }
+  }
+  // get whether to decompress gzipped inputs, and how much to compress outputs
+  readIntFromEnv(DECOMPRESS_INPUTS, DECOMPRESS_INPUTS, 1,
+                 DEFAULT_DECOMPRESS_INPUTS);
+  readIntFromEnv(COMPRESS_OUTPUTS, COMPRESS_OUTPUTS,
+                 COMPRESS_OUTPUTS >= 0 && COMPRESS_OUTPUTS <= 9,
+                 DEFAULT_COMPRESS_OUTPUTS);
+  // get where to take commands for attaching and detaching streams
+  CONTROL_SOCKET = getenv("CONTROL_SOCKET");
+  if (CONTROL_SOCKET != NULL && *CONTROL_SOCKET == '\0') CONTROL_SOCKET = NULL;
+  readIntFromEnv(MAX_ATTACHED_STREAMS, MAX_ATTACHED_STREAMS,
+                 MAX_ATTACHED_STREAMS >= 0, DEFAULT_MAX_ATTACHED_STREAMS);
+  // get the file listing the weights of outputs
+  OUTPUT_WEIGHTS = getenv("OUTPUT_WEIGHTS");
+  // get partition key and the delimiter between its fields
+  char *key = getenv("PARTITION_KEY");
+  if (key != NULL) {
+    if (parse_partition_key(key)) {
+      fprintf(stderr, "%s: Invalid PARTITION_KEY, not partitioning\n", key);
+    } else {
+      DEBUG("PARTITION_KEY=%s", key);
+    }
+  }
+  char *key_delimiter = getenv("PARTITION_KEY_DELIMITER");
+  if (key_delimiter != NULL) {
+    if (parse_partition_key_delimiter(key_delimiter)) {
+      fprintf(stderr, "%s: Invalid PARTITION_KEY_DELIMITER, using default\n",
+              key_delimiter);
+    } else {
+      DEBUG("PARTITION_KEY_DELIMITER=%s", key_delimiter);
+    }
+  }
 }
 
 int main(int argc, char *argv[]) {
@@ -160,10 +415,52 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
+  if (PARTITION_KEY.kind != PARTITION_NONE && mkmimo != mkmimo_multithreaded) {
+    fprintf(stderr, "Partitioning by key requires MKMIMO_IMPL=multithreaded\n");
+    return 1;
+  }
+  if (CONTROL_SOCKET != NULL && mkmimo != mkmimo_multithreaded) {
+    fprintf(stderr, "CONTROL_SOCKET requires MKMIMO_IMPL=multithreaded\n");
+    return 1;
+  }
+  if ((DECOMPRESS_INPUTS || COMPRESS_OUTPUTS) && !CODECS_SUPPORTED) {
+    fprintf(stderr, "DECOMPRESS_INPUTS and COMPRESS_OUTPUTS need mkmimo "
+                    "built with zlib\n");
+    return 1;
+  }
+  if ((DECOMPRESS_INPUTS || COMPRESS_OUTPUTS) &&
+      mkmimo != mkmimo_multithreaded) {
+    fprintf(stderr, "DECOMPRESS_INPUTS and COMPRESS_OUTPUTS require "
+                    "MKMIMO_IMPL=multithreaded\n");
+    return 1;
+  }
+  if (outputs.are_weighted && mkmimo != mkmimo_multithreaded &&
+      mkmimo != mkmimo_nonblocking) {
+    fprintf(stderr,
+            "Output weights need MKMIMO_IMPL=multithreaded or nonblocking\n");
+    return 1;
+  }
+
+  if (FAILOVER && mkmimo != mkmimo_multithreaded &&
+      mkmimo != mkmimo_nonblocking && mkmimo != mkmimo_workers) {
+    fprintf(stderr, "FAILOVER is ignored unless MKMIMO_IMPL=multithreaded, "
+                    "nonblocking, or workers\n");
+    FAILOVER = 0;
+  }
+  if (FAILOVER && PARTITION_KEY.kind != PARTITION_NONE) {
+    // records of a key must go to the same output, and none other
+    fprintf(stderr, "FAILOVER is ignored when partitioning by key\n");
+    FAILOVER = 0;
+  }
+  // so a consumer gone away shows up as an error writing to its output
+  if (FAILOVER) signal(SIGPIPE, SIG_IGN);
+
   DEBUG("Reading from %d inputs...", inputs.num_inputs);
   DEBUG("Writing to %d outputs...", outputs.num_outputs);
 
+  start_stats_reporter(&inputs, &outputs);
   int exitstatus = mkmimo(&inputs, &outputs);
+  stop_stats_reporter();
 
   clean_up(&inputs, &outputs);
   DEBUG("%s", "All done!");
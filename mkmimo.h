@@ -3,7 +3,10 @@
 
 #define _POSIX_C_SOURCE 200809L
 
+#include "blocksize.h"
 #include "buffer.h"
+#include "codec.h"
+#include "stats.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <stdbool.h>
@@ -20,12 +23,17 @@
 #define DEBUG(fmt, args...)
 #endif
 
-// a shorthand for printing error messages
-#define perrorf(fmt, args...)                        \
-  do {                                               \
-    char strerrbuf[BUFSIZ];                          \
-    strerror_r(errno, strerrbuf, sizeof(strerrbuf)); \
-    fprintf(stderr, fmt ": %s", args, strerrbuf);    \
+// a shorthand for printing error messages, with whichever strerror_r(3) the
+// file is given, as the GNU one may leave the buffer alone
+#ifdef _GNU_SOURCE
+#define STRERROR_R(err, buf) strerror_r(err, buf, sizeof(buf))
+#else
+#define STRERROR_R(err, buf) (strerror_r(err, buf, sizeof(buf)), buf)
+#endif
+#define perrorf(fmt, args...)                                        \
+  do {                                                               \
+    char strerrbuf[BUFSIZ];                                          \
+    fprintf(stderr, fmt ": %s", args, STRERROR_R(errno, strerrbuf)); \
   } while (0)
 
 // a shorthand for checking error return values from system and library calls
@@ -49,11 +57,17 @@ typedef struct input {
   int is_near_eof;
   int is_readable;
   int is_buffered;
+  int is_detaching;  // Whether asked to stop reading (See: CONTROL_SOCKET)
+  Stats stats;
+  BlockSizing sizing;          // (See: ADAPTIVE_BLOCKSIZE)
+  MappedFile mapped;           // (See: MMAP_INPUTS)
+  Decompressor *decompressor;  // (See: DECOMPRESS_INPUTS)
 } Input;
 
-typedef struct {
+typedef struct inputs {
   Input *inputs;
   int num_inputs;
+  int max_inputs;    // Room for the ones attached later (See: CONTROL_SOCKET)
 
   int last_closed;   // Index to insert next closed input
   int num_closed;    // Num already closed
@@ -69,11 +83,28 @@ typedef struct output {
   int is_closed;
   int is_writable;
   int is_busy;
+  int is_detaching;  // Whether asked to stop writing (See: CONTROL_SOCKET)
+  int is_waiting;    // Whether waiting for buffers (See: CONTROL_SOCKET)
+  Stats stats;
+  Compressor *compressor;  // (See: COMPRESS_OUTPUTS)
+
+  // for routing in proportion to the weights of outputs (See: OUTPUT_WEIGHTS)
+  int weight;                      // Share of bytes relative to other outputs
+  double bytes_routed_per_weight;  // Bytes routed so far divided by weight
+
+  // for routing to the outputs draining fastest (See: LEAST_LOADED)
+  double drain_rate;         // Bytes written per usec, averaged over buffers
+  bool has_drain_rate;       // Whether the drain rate was ever measured
+  uint64_t usec_routed;      // When the current buffer was routed
+  uint64_t usec_progressed;  // When the current buffer was last written
+  int num_bytes_routed;      // Size of the current buffer when routed
 } Output;
 
-typedef struct {
+typedef struct outputs {
   Output *outputs;
   int num_outputs;
+  int max_outputs;   // Room for the ones attached later (See: CONTROL_SOCKET)
+  bool are_weighted;  // Whether any output has a weight other than 1
   int last_closed;   // Index to insert next closed output
   int next_output;   // Index of the last used output for exchange
   int num_closed;    // Num already closed
@@ -0,0 +1,378 @@
+#include "mkmimo_epoll.h"
+#include "mkmimo_nonblocking.h"
+#include "queue.h"
+
+#ifdef EPOLL_SUPPORTED
+#include <sys/epoll.h>
+
+// number of milliseconds for epoll_wait to wait for I/O events
+static int POLL_TIMEOUT_MSEC = -1;
+
+// maximum number of events to pick up with a single epoll_wait(2)
+static int EPOLL_MAX_EVENTS = DEFAULT_EPOLL_MAX_EVENTS;
+
+static int epoll_fd = -1;
+static struct epoll_event *events;
+
+/**
+ * Ready lists, so every step only visits the inputs/outputs that can make
+ * progress instead of scanning all of them.
+ */
+static Queue *readable_inputs;   // readable inputs with room in their buffer
+static Queue *buffered_inputs;   // inputs holding complete records
+static Queue *idle_outputs;      // open outputs with empty buffers
+static Queue *writable_outputs;  // busy outputs not known to block on write
+
+/**
+ * Inputs and outputs are distinguished in the epoll_event data by their
+ * indexes, where outputs come after all inputs.
+ */
+static Inputs *all_inputs;
+static Outputs *all_outputs;
+
+// whether to exit with an error, e.g., upon records lost with a failed output
+static bool something_went_wrong;
+
+/**
+ * Arm the output to be notified once when it becomes writable again.
+ */
+static inline void rearm_output(Output *output) {
+  struct epoll_event ev = {
+      .events = EPOLLOUT | EPOLLET | EPOLLONESHOT,
+      .data.u64 = all_inputs->num_inputs + (output - all_outputs->outputs),
+  };
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, output->fd, &ev) < 0) {
+    // outputs that cannot be polled, e.g., regular files, never block, so
+    // simply regard them writable again
+    DEBUG("%s: cannot be polled, regarding as writable", output->name);
+    SET_FLAG(all_outputs, output, writable, 1);
+  }
+}
+
+/**
+ * Initialize an empty buffer for each input and output, set all of them to be
+ * nonblocking, and register them to epoll only once.
+ */
+static inline int initialize_ios(Inputs *inputs, Outputs *outputs) {
+  epoll_fd = epoll_create1(0);
+  if (epoll_fd < 0) {
+    perror("epoll_create1");
+    return 1;
+  }
+  readable_inputs = new_queue();
+  buffered_inputs = new_queue();
+  idle_outputs = new_queue();
+  writable_outputs = new_queue();
+  all_inputs = inputs;
+  all_outputs = outputs;
+
+  reserve_buffer_arena(inputs->num_inputs + outputs->num_outputs);
+  for (int i = 0; i < inputs->num_inputs; i++) {
+    Input *input = &inputs->inputs[i];
+    input->buffer = new_buffer();
+    if (setNonblocking(input->fd) < 0) {
+      perrorf("setNonblocking %s", input->name);
+      return 1;
+    }
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLET, .data.u64 = i};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, input->fd, &ev) < 0) {
+      if (errno != EPERM) {
+        perrorf("epoll_ctl %s", input->name);
+        return 1;
+      }
+      // regular files cannot be polled but are always readable
+      DEBUG("%s: cannot be polled, regarding as always readable", input->name);
+    }
+    // every input is readable until read(2) says otherwise
+    SET(input, readable, 1);
+    queue(readable_inputs, input);
+  }
+
+  for (int i = 0; i < outputs->num_outputs; i++) {
+    Output *output = &outputs->outputs[i];
+    output->buffer = new_buffer();
+    if (setNonblocking(output->fd) < 0) {
+      perrorf("setNonblocking %s", output->name);
+      return 2;
+    }
+    // outputs are armed only after they become busy (See: rearm_output)
+    struct epoll_event ev = {.events = EPOLLET | EPOLLONESHOT,
+                             .data.u64 = inputs->num_inputs + i};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, output->fd, &ev) < 0 &&
+        errno != EPERM) {
+      perrorf("epoll_ctl %s", output->name);
+      return 2;
+    }
+    // every idle output is writable until write(2) says otherwise
+    SET(output, writable, 1);
+    queue(idle_outputs, output);
+  }
+
+  int num_fds = inputs->num_inputs + outputs->num_outputs;
+  if (EPOLL_MAX_EVENTS > num_fds) EPOLL_MAX_EVENTS = num_fds;
+  events = calloc(EPOLL_MAX_EVENTS, sizeof(struct epoll_event));
+  return 0;
+}
+
+static inline int records_are_flowing_between(Inputs *inputs,
+                                              Outputs *outputs) {
+  // we can be sure no data will flow if all of the following holds:
+  if (
+      // 1. all inputs are closed
+      inputs->num_closed == inputs->num_inputs &&
+      // 2. no data is sitting in input buffers
+      inputs->num_buffered == 0 &&
+      // 3. no data is pending in output buffers
+      outputs->num_busy == 0) {
+    DEBUG("%s", "no data flow possible, skipping epoll");
+    return 0;
+  } else if (outputs->num_closed == outputs->num_outputs) {
+    DEBUG("%s", "all outputs closed, no data flow possible");
+    return 0;
+  } else
+    DEBUG(
+        "%d open inputs, %d buffered inputs, %d open outputs, %d busy "
+        "outputs",
+        inputs->num_inputs - inputs->num_closed, inputs->num_buffered,
+        outputs->num_outputs - outputs->num_closed, outputs->num_busy);
+
+  // only check for new events without blocking if there's something to do
+  int timeout_msec =
+      is_empty(readable_inputs) && is_empty(writable_outputs)
+          ? POLL_TIMEOUT_MSEC
+          : 0;
+  int num_events = epoll_wait(epoll_fd, events, EPOLL_MAX_EVENTS, timeout_msec);
+  if (num_events < 0) {
+    if (errno == EINTR) return 1;
+    perror("epoll_wait");
+    return 0;
+  }
+  // put inputs/outputs that became ready into the ready lists
+  for (int i = 0; i < num_events; ++i) {
+    struct epoll_event *ev = &events[i];
+    if (ev->data.u64 < inputs->num_inputs) {
+      Input *input = &inputs->inputs[ev->data.u64];
+      if (input->is_closed || input->is_readable) continue;
+      input->is_near_eof = !!(ev->events & EPOLLHUP);
+      SET(input, readable, 1);
+      // inputs with full buffers are put back after exchange
+      if (input->buffer->size < input->buffer->capacity)
+        queue(readable_inputs, input);
+    } else {
+      Output *output = &outputs->outputs[ev->data.u64 - inputs->num_inputs];
+      if (output->is_closed || output->is_writable) continue;
+      SET(output, writable, 1);
+      if (output->is_busy) queue(writable_outputs, output);
+    }
+  }
+  DEBUG("epoll returned %d events, %d readable inputs, %d writable outputs",
+        num_events, inputs->num_readable, outputs->num_writable);
+  return 1;
+}
+
+static inline void mark_buffered(Inputs *inputs, Input *input) {
+  if (input->is_buffered) return;
+  SET(input, buffered, 1);
+  queue(buffered_inputs, input);
+}
+
+static inline void close_input(Inputs *inputs, Input *input) {
+  close(input->fd);
+  SET(input, closed, 1);
+  SET(input, readable, 0);
+  // pass along any trailing bytes without a record separator as the last
+  // record since no more data can follow it
+  Buffer *buf = input->buffer;
+  if (buf->size > 0 && buf->end_of_last_record < buf->begin + buf->size - 1) {
+    buf->end_of_last_record = buf->begin + buf->size - 1;
+    mark_buffered(inputs, input);
+  }
+}
+
+static inline int read_from_readable(Inputs *inputs) {
+  // drain every readable input until read(2) would block as epoll is
+  // edge-triggered
+  while (!is_empty(readable_inputs)) {
+    Input *input = dequeue(readable_inputs);
+    Buffer *buf = input->buffer;
+    int scan_end_of_record_down_to = buf->end_of_last_record + 1;
+    for (;;) {
+      int num_bytes_readable = buf->capacity - buf->size;
+      // stop reading if buffer is already full, until it's exchanged
+      if (num_bytes_readable <= 0) {
+        DEBUG("%s: buffer is full: %d used out of %d", input->name, buf->size,
+              buf->capacity);
+        break;
+      }
+      DEBUG("%s: can read %d bytes", input->name, num_bytes_readable);
+      int num_bytes_read = read(input->fd, buf->data + buf->begin + buf->size,
+                                num_bytes_readable);
+      DEBUG("%s: %d bytes read", input->name, num_bytes_read);
+      count_syscall(&input->stats, num_bytes_read);
+      if (num_bytes_read < 0) {
+        if (errno == EAGAIN) {
+          // stop reading when input is exhausted, until epoll says otherwise
+          SET(input, readable, 0);
+        } else {
+          // close the input on other errors
+          perrorf("read %s", input->name);
+          DEBUG("%s: input closed due to error", input->name);
+          close_input(inputs, input);
+        }
+        break;
+      } else if (num_bytes_read == 0) {
+        // EOF reached, close the input
+        DEBUG("%s: input closed", input->name);
+        close_input(inputs, input);
+        break;
+      }
+      // read normally, reflect size increase
+      buf->size += num_bytes_read;
+      // find the last record separator in the buffer, or close the input
+      // upon malformed records as upon errors, after the ones before
+      if (find_end_of_last_record(buf, scan_end_of_record_down_to) < 0) {
+        perrorf("read %s", input->name);
+        if (buf->end_of_last_record > -1) mark_buffered(inputs, input);
+        close_input(inputs, input);
+        break;
+      }
+      DEBUG("%s: record ends at %d", input->name, buf->end_of_last_record);
+      if (buf->end_of_last_record > -1) {
+        mark_buffered(inputs, input);
+      } else if (buf->size == buf->capacity) {
+        // enlarge the buffer so a record that is larger than the current
+        // buffer capacity can be read
+        DEBUG("%s: doubling buffer size to %d bytes", input->name,
+              buf->capacity * 2);
+        enlarge_buffer(buf, buf->capacity * 2);
+        STATS_ADD(&input->stats, num_growths, 1);
+      }
+      // bound the next scan for end-of-record separator
+      scan_end_of_record_down_to = buf->begin + buf->size;
+    }
+  }
+  DEBUG("read from readable inputs, %d now buffered", inputs->num_buffered);
+  return inputs->num_buffered;
+}
+
+static inline int write_to_writable(Outputs *outputs) {
+  // write to each writable output its buffered records
+  while (!is_empty(writable_outputs)) {
+    Output *output = dequeue(writable_outputs);
+    Buffer *buf = output->buffer;
+    while (buf->size > 0) {
+      int num_bytes_written = write(output->fd, buf->data + buf->begin,
+                                    buf->size);
+      DEBUG("%s: wrote %d bytes", output->name, num_bytes_written);
+      count_syscall(&output->stats, num_bytes_written);
+      if (num_bytes_written >= 0) {
+        // normal write
+        buf->begin += num_bytes_written;
+        buf->size -= num_bytes_written;
+      } else if (errno == EAGAIN) {
+        // output is busy, will try again once epoll says it's writable
+        DEBUG("%s: output busy, %d bytes still left", output->name, buf->size);
+        SET(output, writable, 0);
+        rearm_output(output);
+        break;
+      } else {
+        // something went wrong
+        perrorf("write %s", output->name);
+        DEBUG("%s: output closed due to error", output->name);
+        close(output->fd);
+        SET(output, closed, 1);
+        SET(output, writable, 0);
+        SET(output, busy, 0);
+        // XXX the buffer should be routed to another output, but is lost
+        something_went_wrong = true;
+        break;
+      }
+    }
+    if (output->is_closed) continue;
+    if (buf->size == 0) {
+      // output becomes idle once all buffered data is written
+      SET(output, busy, 0);
+      count_written_buffer(&output->stats, buf);
+      clear_buffer(buf);  // giving back any large block right away
+      queue(idle_outputs, output);
+    } else if (output->is_writable) {
+      // unpollable outputs simply try again at the next step
+      queue(writable_outputs, output);
+    }
+  }
+  DEBUG("wrote to writable outputs, %d still busy", outputs->num_busy);
+  return outputs->num_busy;
+}
+
+static inline int exchange_buffered_records(Inputs *inputs, Outputs *outputs) {
+  int num_exchanges = 0;
+  // every buffered input should swap its buffer with an idle output
+  while (!is_empty(buffered_inputs) && !is_empty(idle_outputs)) {
+    Input *input = dequeue(buffered_inputs);
+    Output *output = dequeue(idle_outputs);
+    DEBUG("routing %d bytes: %s > %s",
+          input->buffer->end_of_last_record + 1 - input->buffer->begin,
+          input->name, output->name);
+
+    // Swap buffers between the buffered input and the idle output
+    Buffer *buf = input->buffer;
+    input->buffer = output->buffer;
+    output->buffer = buf;
+
+    // Reset input buffer
+    clear_buffer(input->buffer);
+
+    // Make sure the trailing bytes at the end of input's buffer isn't lost
+    move_trailing_data_after_last_record(input->buffer, output->buffer);
+    count_submitted_buffer(&input->stats, output->buffer);
+    // now, mark the input as holding an incomplete buffer
+    SET(input, buffered, 0);
+    // which has room to read more if input is still readable
+    if (input->is_readable) queue(readable_inputs, input);
+    // and mark the output as busy
+    SET(output, busy, 1);
+    if (output->is_writable) queue(writable_outputs, output);
+    // keep track of the number of exchanges
+    ++num_exchanges;
+  }
+  DEBUG("exchanged %d input-output pairs", num_exchanges);
+  return num_exchanges;
+}
+
+static inline void parse_environ(void) {
+  readIntFromEnv(POLL_TIMEOUT_MSEC, POLL_TIMEOUT_MSEC, POLL_TIMEOUT_MSEC >= -1,
+                 -1);
+  readIntFromEnv(EPOLL_MAX_EVENTS, EPOLL_MAX_EVENTS, EPOLL_MAX_EVENTS > 0,
+                 DEFAULT_EPOLL_MAX_EVENTS);
+}
+
+/**
+ * Edge-triggered epoll(7) implementation of mkmimo
+ */
+int mkmimo_epoll(Inputs *inputs, Outputs *outputs) {
+  parse_environ();
+  if (initialize_ios(inputs, outputs)) {
+    perror("mkmimo");
+    return 1;
+  }
+
+  while (records_are_flowing_between(inputs, outputs)) {
+    write_to_writable(outputs);
+    if (read_from_readable(inputs) > 0)
+      while (exchange_buffered_records(inputs, outputs) > 0)
+        write_to_writable(outputs);
+    DEBUG("%s", "----------------------------------------");
+  }
+
+  close(epoll_fd);
+  return something_went_wrong ? 1 : 0;
+}
+
+#else
+
+int mkmimo_epoll(Inputs *inputs, Outputs *outputs) {
+  fprintf(stderr, "epoll: Not supported on this platform\n");
+  return 1;
+}
+
+#endif /* EPOLL_SUPPORTED */
@@ -0,0 +1,15 @@
+#ifndef MKMIMO_EPOLL_H
+#define MKMIMO_EPOLL_H
+
+#ifdef __linux__
+#define EPOLL_SUPPORTED
+#endif
+
+#include "mkmimo.h"
+
+int mkmimo_epoll(Inputs *inputs, Outputs *outputs);
+
+// maximum number of I/O events to pick up with a single epoll_wait(2)
+#define DEFAULT_EPOLL_MAX_EVENTS 1024
+
+#endif /* MKMIMO_EPOLL_H */
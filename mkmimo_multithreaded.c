@@ -1,60 +1,699 @@
+#define _GNU_SOURCE  // for ppoll(2)
 #include "mkmimo_multithreaded.h"
+#include "control.h"
+#include "partition.h"
 #include "queue.h"
+#include "ring.h"
+#include <poll.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 /**
  * Parameters
  */
 static int MULTIBUFFERING = DEFAULT_MULTIBUFFERING;
+static int ZERO_COPY = DEFAULT_ZERO_COPY;
+static int LOCK_FREE = DEFAULT_LOCK_FREE;
+static int WORK_STEALING = DEFAULT_WORK_STEALING;
+static int SEQUENCE_NUMBERS = DEFAULT_SEQUENCE_NUMBERS;
+static int REORDER_WINDOW = DEFAULT_REORDER_WINDOW;
+static int WRITEV_BATCH = DEFAULT_WRITEV_BATCH;
+static int SLICE_SIZE = DEFAULT_SLICE_SIZE;
 
 /**
-  * Buffer pools
+  * Buffer pools, kept in either a queue guarded by a mutex or a lock-free ring
   */
-static Queue *full_buffers;
-static Queue *empty_buffers;
+typedef struct {
+  Queue *queue;
+  Ring *ring;
+} BufferPool;
+static BufferPool full_buffers;
+static BufferPool empty_buffers;
+
+static inline void put_buffer(BufferPool *pool, Buffer *buf) {
+  if (pool->ring != NULL) {
+    ring_enqueue_or_wait(pool->ring, buf);
+  } else {
+    queue_and_signal(pool->queue, buf);
+  }
+}
+
+static inline Buffer *take_buffer(BufferPool *pool) {
+  return pool->ring != NULL ? ring_dequeue_or_wait(pool->ring)
+                            : dequeue_or_wait(pool->queue);
+}
+
+static inline Buffer *try_take_buffer(BufferPool *pool) {
+  return pool->ring != NULL ? ring_try_dequeue(pool->ring)
+                            : dequeue_if_non_empty(pool->queue);
+}
+
+static inline bool has_no_buffers(BufferPool *pool) {
+  return pool->ring != NULL ? ring_is_empty(pool->ring)
+                            : is_empty(pool->queue);
+}
+
+static inline void init_buffer_pool(BufferPool *pool, int num_buffers) {
+  pool->queue = NULL;
+  pool->ring = NULL;
+  if (LOCK_FREE) {
+    // every buffer fits, so putting one never has to wait
+    pool->ring = new_ring(num_buffers);
+  } else {
+    pool->queue = new_queue();
+  }
+}
+
+/**
+  * Local pools of full buffers, one per output, when work stealing or
+  * partitioning by key.  When work stealing, inputs hand their buffers to the
+  * outputs in turn, and each output takes from its own pool first, then steals
+  * from the neighbours when it runs out.  When partitioning, each output only
+  * takes from its own pool.
+  */
+static Input *first_input;
+static Output *first_output;
+static int num_local_pools;
+static BufferPool *local_full_buffers;
+static int *next_pool_of_inputs;  // Pool to put the next buffer of each input
+static sem_t num_full_buffers;    // Total number of buffers in local pools
+
+// when outputs are weighted, each input routes its buffers to the output
+// furthest behind its share, i.e., with the least bytes routed per weight
+static bool outputs_are_weighted;
+static double *bytes_routed_per_weight;  // Of every output, for every input
+
+/**
+ * Pick the output that received the least bytes per weight from the input,
+ * and charge it for the buffer, so bytes are distributed in proportion to the
+ * weights, however large each buffer grows.
+ */
+static inline int pick_weighted_output(Input *input, Buffer *buf) {
+  double *routed =
+      &bytes_routed_per_weight[(input - first_input) * num_local_pools];
+  int picked = 0;
+  for (int i = 1; i < num_local_pools; ++i)
+    if (first_output[picked].is_closed ||
+        (!first_output[i].is_closed && routed[i] < routed[picked]))
+      picked = i;
+  routed[picked] += (double)buf->size / first_output[picked].weight;
+  return picked;
+}
+
+/**
+ * Index of the output to take over the buffers of one closed due to an error,
+ * i.e., the next one still open.
+ */
+static inline int next_open_output_after(Output *output) {
+  int i = output - first_output;
+  for (int j = 1; j < num_local_pools; ++j)
+    if (!first_output[(i + j) % num_local_pools].is_closed) return i + j;
+  return i + 1;
+}
+
+static inline void put_full_buffer_to(int local_pool_index, Buffer *buf) {
+  if (local_full_buffers != NULL) {
+    put_buffer(&local_full_buffers[local_pool_index % num_local_pools], buf);
+    if (WORK_STEALING) CHECK_ERRNO(sem_post, &num_full_buffers);
+  } else {
+    put_buffer(&full_buffers, buf);
+  }
+}
+
+/**
+ * Put a buffer whose records are all written back to the empty pool.  A slice
+ * also lets go of the buffer it points into, which goes back as well once no
+ * other slice of it is left, while a buffer sliced waits likewise.
+ */
+static inline void recycle_buffer(Buffer *buf) {
+  Buffer *parent = buf->parent;
+  if (parent != NULL) {
+    clear_buffer(buf);
+    put_buffer(&empty_buffers, buf);
+    buf = parent;
+  }
+  if (!release_slice(buf)) return;
+  // giving back a large block right away rather than once grabbed again
+  clear_buffer(buf);
+  put_buffer(&empty_buffers, buf);
+}
+
+/**
+ * Number of buffers handed off to the outputs and not yet written, or
+ * dropped, including the ones an output that failed hands over to the others,
+ * so the end of stream is handed off only once none is left (See: FAILOVER)
+ */
+static int num_buffers_in_flight;
+static pthread_mutex_t in_flight_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t all_buffers_written = PTHREAD_COND_INITIALIZER;
+
+static inline void hand_off_full_buffer(int local_pool_index, Buffer *buf) {
+  __atomic_add_fetch(&num_buffers_in_flight, 1, __ATOMIC_SEQ_CST);
+  put_full_buffer_to(local_pool_index, buf);
+}
+
+// sequence number to stamp on the next buffer handed off
+static uint64_t next_seq_to_stamp;
+
+static inline void submit_full_buffer(Input *input, Buffer *buf) {
+  count_submitted_buffer(&input->stats, buf);
+  if (SEQUENCE_NUMBERS && buf->size > 0)
+    buf->seq = __atomic_fetch_add(&next_seq_to_stamp, 1, __ATOMIC_RELAXED);
+  int *next_pool = &next_pool_of_inputs[input - first_input];
+  if (outputs_are_weighted) *next_pool = pick_weighted_output(input, buf);
+  hand_off_full_buffer(*next_pool, buf);
+  // taking turns among the outputs still open
+  if (WORK_STEALING)
+    *next_pool =
+        next_open_output_after(&first_output[*next_pool]) % num_local_pools;
+}
+
+static inline Buffer *take_full_buffer(Output *output) {
+  uint64_t usec_began = stats_clock_usec();
+  Buffer *buf = NULL;
+  if (PARTITION_KEY.kind != PARTITION_NONE || outputs_are_weighted) {
+    buf = take_buffer(&local_full_buffers[output - first_output]);
+  } else if (!WORK_STEALING) {
+    buf = take_buffer(&full_buffers);
+  } else {
+    // wait until there's a buffer this output can take
+    while (sem_wait(&num_full_buffers) < 0) {
+      if (errno != EINTR) {
+        perror("sem_wait");
+        abort();
+      }
+    }
+    // then look in its own pool first, then the neighbours'
+    int i = output - first_output;
+    for (int j = 0; buf == NULL; ++j)
+      buf = try_take_buffer(&local_full_buffers[(i + j) % num_local_pools]);
+  }
+  count_blocked_since(&output->stats, usec_began);
+  return buf;
+}
+
+/**
+ * Take a full buffer for the output only if one is ready, without waiting.
+ */
+static inline Buffer *try_take_full_buffer(Output *output) {
+  if (PARTITION_KEY.kind != PARTITION_NONE || outputs_are_weighted)
+    return try_take_buffer(&local_full_buffers[output - first_output]);
+  if (!WORK_STEALING) return try_take_buffer(&full_buffers);
+  if (sem_trywait(&num_full_buffers) < 0) return NULL;
+  Buffer *buf = NULL;
+  int i = output - first_output;
+  for (int j = 0; buf == NULL; ++j)
+    buf = try_take_buffer(&local_full_buffers[(i + j) % num_local_pools]);
+  return buf;
+}
+
+/**
+ * Take a full buffer from the output's own pool only if one is ready, i.e.,
+ * without stealing from the others.
+ */
+static inline Buffer *try_take_own_full_buffer(Output *output) {
+  BufferPool *pool = &local_full_buffers[output - first_output];
+  if (!WORK_STEALING) return try_take_buffer(pool);
+  if (sem_trywait(&num_full_buffers) < 0) return NULL;
+  Buffer *buf = try_take_buffer(pool);
+  // leaving the one counted for another pool to whoever takes it
+  if (buf == NULL) CHECK_ERRNO(sem_post, &num_full_buffers);
+  return buf;
+}
+
+static inline void init_full_buffer_pools(Inputs *inputs, Outputs *outputs,
+                                          int num_buffers) {
+  first_input = inputs->inputs;
+  first_output = outputs->outputs;
+  next_pool_of_inputs = calloc(inputs->max_inputs, sizeof(int));
+  // staggered, but within the outputs, as it points at one (See: WORK_STEALING)
+  for (int i = 0; i < inputs->num_inputs; ++i)
+    next_pool_of_inputs[i] = i % outputs->num_outputs;
+  outputs_are_weighted = outputs->are_weighted;
+  if (outputs_are_weighted && PARTITION_KEY.kind != PARTITION_NONE) {
+    fprintf(stderr, "Output weights are ignored when partitioning by key\n");
+    outputs_are_weighted = false;
+  }
+  // stolen buffers would reach whatever merges the outputs out of order
+  if (WORK_STEALING && (PARTITION_KEY.kind != PARTITION_NONE ||
+                        outputs_are_weighted || SEQUENCE_NUMBERS)) {
+    fprintf(stderr, "WORK_STEALING is ignored when partitioning by key, "
+                    "weighting outputs, or numbering sequences\n");
+    WORK_STEALING = 0;
+  }
+  if (outputs_are_weighted)
+    bytes_routed_per_weight =
+        calloc(inputs->num_inputs * outputs->num_outputs, sizeof(double));
+  if (WORK_STEALING && sem_init(&num_full_buffers, 0, 0) < 0) {
+    perror("sem_init: falling back to a single pool of full buffers");
+    WORK_STEALING = 0;
+  }
+  if (WORK_STEALING || PARTITION_KEY.kind != PARTITION_NONE ||
+      outputs_are_weighted) {
+    num_local_pools = outputs->num_outputs;
+    local_full_buffers = calloc(num_local_pools, sizeof(BufferPool));
+    for (int i = 0; i < num_local_pools; ++i)
+      init_buffer_pool(&local_full_buffers[i], num_buffers);
+  } else {
+    init_buffer_pool(&full_buffers, num_buffers);
+  }
+}
 
 /**
-  * Flags
+  * Flags, set by one thread and read by others without a lock, so they're
+  * accessed atomically, making what's done before setting one visible to the
+  * threads seeing it set
   */
 static bool data_is_flowing_in = true;
 static bool data_should_flow_in = true;
 static bool data_should_flow_out = true;
 static bool something_went_wrong = false;
+static int num_outputs_open;  // Updated atomically (See: FAILOVER)
+
+static inline bool is_set(bool *flag) {
+  return __atomic_load_n(flag, __ATOMIC_ACQUIRE);
+}
+
+static inline void set_flag(bool *flag, bool value) {
+  __atomic_store_n(flag, value, __ATOMIC_RELEASE);
+}
+
+/**
+  * Marker handed off to every output once all inputs are done, and all the
+  * buffers handed off are written, so an output stops as soon as it takes one
+  */
+static Buffer end_of_stream;
+
+/**
+  * Let the main thread waiting for the buffers in flight know none is left,
+  * or that it needn't wait anymore.
+  */
+static inline void signal_all_buffers_written(void) {
+  CHECK_ERRNO(pthread_mutex_lock, &in_flight_lock);
+  CHECK_ERRNO(pthread_cond_broadcast, &all_buffers_written);
+  CHECK_ERRNO(pthread_mutex_unlock, &in_flight_lock);
+}
+
+/**
+  * Recycle a buffer handed off to an output once it's written, or dropped.
+  */
+static inline void retire_full_buffer(Buffer *buf) {
+  recycle_buffer(buf);
+  if (__atomic_sub_fetch(&num_buffers_in_flight, 1, __ATOMIC_SEQ_CST) == 0 &&
+      !__atomic_load_n(&data_is_flowing_in, __ATOMIC_SEQ_CST))
+    signal_all_buffers_written();
+}
 
 /**
   * Stop all threads upon error.
   */
 static inline void teardown_all_threads_due_to_error(void) {
   // XXX this tears down all input threads
-  data_should_flow_in = false;
+  set_flag(&data_should_flow_in, false);
   // XXX this tears down all output threads
-  data_should_flow_out = false;
+  set_flag(&data_should_flow_out, false);
   // escalate error to exit status
-  something_went_wrong = true;
+  set_flag(&something_went_wrong, true);
+  signal_all_buffers_written();
+}
+
+/**
+  * Grab a buffer from the empty pool and clear it for fresh data.
+  */
+static inline Buffer *grab_empty_buffer(Stats *stats) {
+  uint64_t usec_began = stats_clock_usec();
+  Buffer *buf = take_buffer(&empty_buffers);
+  if (stats != NULL) count_blocked_since(stats, usec_began);
+  clear_buffer(buf);
+  return buf;
+}
+
+/**
+  * Buffers of records scattered by their keys, one for each pair of an input
+  * and an output, so records are batched rather than handed off one by one.
+  */
+static Buffer **partitioned_buffers;
+
+static inline Buffer **partitions_of(Input *input) {
+  return &partitioned_buffers[(input - first_input) * num_local_pools];
 }
 
 /**
- * Find the last record separator in a full buffer.
+ * Submit the partition of the input to the pool of its output, and replace it
+ * with an empty buffer, unless it's the last one from the input.
  */
-static inline void find_record_separator(Buffer *buf,
-                                         int scan_end_of_record_down_to) {
-  for (int j = buf->begin + buf->size - 1; j >= scan_end_of_record_down_to;
-       --j) {
-    char c = ((char *)buf->data)[j];
-    if (c == '\n') {
-      buf->end_of_last_record = j;
-      break;
+static inline void submit_partition(Input *input, int i, bool is_last) {
+  Buffer **partitions = partitions_of(input);
+  if (partitions[i]->size > 0) {
+    count_submitted_buffer(&input->stats, partitions[i]);
+    hand_off_full_buffer(i, partitions[i]);
+  } else if (is_last) {
+    put_buffer(&empty_buffers, partitions[i]);
+  } else {
+    return;
+  }
+  partitions[i] = is_last ? NULL : grab_empty_buffer(&input->stats);
+}
+
+/**
+ * Scatter the records in the buffer to the partitions their keys hash to, and
+ * recycle the buffer.  Partitions are submitted as they fill up, and all at
+ * once when the input is closed or seems drained, so no record is held back
+ * while waiting for more.
+ */
+static inline void scatter_records(Input *input, Buffer *buf,
+                                   bool input_seems_drained) {
+  Buffer **partitions = partitions_of(input);
+  const char *data = buf->data;
+  int content_begin, content_end;
+  for (int pos = buf->begin; pos < buf->begin + buf->size;) {
+    int next = find_record_at(buf, pos, &content_begin, &content_end);
+    int i = partition_of_record(data + content_begin,
+                                content_end - content_begin, num_local_pools);
+    int size = next - pos;
+    if (partitions[i]->size + size > partitions[i]->capacity) {
+      submit_partition(input, i, false);
+      // a record larger than the buffer is batched alone
+      if (size > partitions[i]->capacity) enlarge_buffer(partitions[i], size);
     }
+    Buffer *part = partitions[i];
+    memcpy(part->data + part->begin + part->size, data + pos, size);
+    part->size += size;
+    pos = next;
   }
+  put_buffer(&empty_buffers, buf);
+  if (input->is_closed || input_seems_drained)
+    for (int i = 0; i < num_local_pools; ++i)
+      submit_partition(input, i, input->is_closed);
 }
 
 /**
-  * Grab a buffer from the empty pool and clear it for fresh data.
+ * Reorder window of a merging mkmimo, holding the records of the sequence
+ * numbers ahead of the next one to hand off, so the records split by another
+ * mkmimo are handed off in their original order.  Each input reads the
+ * records of one sequence at a time, which end where the sequence header of
+ * another one is read.  Inputs running ahead wait once as many buffers as
+ * sequences in the window are held back, so the memory stays bounded.
+ */
+#define UNSEQUENCED UINT64_MAX
+typedef struct {
+  uint64_t seq;
+  Queue *buffers;    // Records held back until the sequence is next
+  bool is_used;
+  bool is_complete;  // Whether all records of the sequence were read
+} ReorderSlot;
+static ReorderSlot *reorder_window;  // Slot of each sequence number modulo size
+static uint64_t next_seq_to_hand_off;
+static int num_buffers_held_back;
+static uint64_t *sequence_of_inputs;  // Of the records each input is reading
+static int next_pool_in_order;
+static int num_inputs_open;
+static int num_inputs_waiting;    // Since the window last moved
+static uint64_t num_window_moves;
+static pthread_mutex_t reorder_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reorder_window_moved = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Wake the inputs waiting for the window, which count themselves again if
+ * they still have to wait.
+ */
+static inline void window_moved(void) {
+  ++num_window_moves;
+  num_inputs_waiting = 0;
+  CHECK_ERRNO(pthread_cond_broadcast, &reorder_window_moved);
+}
+
+/**
+ * Hand off the records of the next sequences as far as they were read, and
+ * move the window past the complete ones.
+ */
+static inline void hand_off_next_sequences(void) {
+  bool has_moved = false;
+  for (;;) {
+    ReorderSlot *slot =
+        &reorder_window[next_seq_to_hand_off % REORDER_WINDOW];
+    if (!slot->is_used || slot->seq != next_seq_to_hand_off) break;
+    for (; !is_empty(slot->buffers); --num_buffers_held_back)
+      hand_off_full_buffer(next_pool_in_order++, dequeue(slot->buffers));
+    if (!slot->is_complete) break;
+    slot->is_used = false;
+    ++next_seq_to_hand_off;
+    has_moved = true;
+  }
+  if (has_moved) window_moved();
+}
+
+/**
+ * Skip the sequence numbers that no input is going to read, which are the
+ * ones before the earliest held in the window, or before the given one when
+ * the window is empty.  Returns whether the window moved.
+ */
+static inline bool skip_missing_sequences(uint64_t seq) {
+  uint64_t earliest = seq;
+  for (int i = 0; i < REORDER_WINDOW; ++i)
+    if (reorder_window[i].is_used && reorder_window[i].seq < earliest)
+      earliest = reorder_window[i].seq;
+  if (earliest == UNSEQUENCED) return false;
+  // moving just enough to let the given one in
+  if (earliest - next_seq_to_hand_off >= REORDER_WINDOW)
+    earliest -= REORDER_WINDOW - 1;
+  if (earliest <= next_seq_to_hand_off) return false;
+  DEBUG("skipping sequence numbers %llu through %llu",
+        (unsigned long long)next_seq_to_hand_off,
+        (unsigned long long)earliest - 1);
+  next_seq_to_hand_off = earliest;
+  hand_off_next_sequences();
+  window_moved();
+  return true;
+}
+
+/**
+ * Whether the records of given sequence must wait for the window to move,
+ * i.e., when it's beyond the window, or the window is full of buffers.
+ */
+static inline bool must_wait_for_window(uint64_t seq, Buffer *buf) {
+  if (seq <= next_seq_to_hand_off) return false;
+  if (seq - next_seq_to_hand_off >= REORDER_WINDOW) return true;
+  return buf != NULL && num_buffers_held_back >= REORDER_WINDOW;
+}
+
+/**
+ * Hand off the buffer holding records of the sequence the input is reading
+ * in order, or hold it back in the window until the sequence is next.  A NULL
+ * buffer only marks the end of the sequence.  When every open input is
+ * waiting for the window to move, the sequences none of them is reading are
+ * deemed missing, e.g., dropped by whatever was between the splitting mkmimo
+ * and this one, and skipped.
+ */
+static void hand_off_in_order(Input *input, Buffer *buf, bool ends_sequence) {
+  uint64_t seq = sequence_of_inputs[input - first_input];
+  if (buf != NULL && buf->size == 0) {
+    put_buffer(&empty_buffers, buf);
+    buf = NULL;
+  }
+  if (seq == UNSEQUENCED) {
+    // records before any sequence header are handed off right away
+    if (buf != NULL) submit_full_buffer(input, buf);
+    return;
+  }
+  if (buf != NULL) count_submitted_buffer(&input->stats, buf);
+  CHECK_ERRNO(pthread_mutex_lock, &reorder_lock);
+  uint64_t usec_began = stats_clock_usec();
+  uint64_t counted_since = UINT64_MAX;
+  while (must_wait_for_window(seq, buf)) {
+    if (counted_since != num_window_moves) {
+      counted_since = num_window_moves;
+      ++num_inputs_waiting;
+    }
+    if (num_inputs_waiting < num_inputs_open || !skip_missing_sequences(seq))
+      CHECK_ERRNO(pthread_cond_wait, &reorder_window_moved, &reorder_lock);
+  }
+  count_blocked_since(&input->stats, usec_began);
+  if (seq < next_seq_to_hand_off) {
+    // records of a skipped sequence can only be handed off out of order
+    if (buf != NULL) hand_off_full_buffer(next_pool_in_order++, buf);
+  } else {
+    ReorderSlot *slot = &reorder_window[seq % REORDER_WINDOW];
+    if (!slot->is_used) {
+      slot->seq = seq;
+      slot->is_used = true;
+      slot->is_complete = false;
+    }
+    if (buf != NULL) {
+      queue(slot->buffers, buf);
+      ++num_buffers_held_back;
+    }
+    if (ends_sequence) slot->is_complete = true;
+    hand_off_next_sequences();
+  }
+  CHECK_ERRNO(pthread_mutex_unlock, &reorder_lock);
+}
+
+/**
+ * Stop waiting for the closed input in the window, and hand off everything
+ * held back once all inputs are closed.
+ */
+static inline void close_input_in_order(Input *input) {
+  CHECK_ERRNO(pthread_mutex_lock, &reorder_lock);
+  --num_inputs_open;
+  // the ones waiting may be all that are left open
+  CHECK_ERRNO(pthread_cond_broadcast, &reorder_window_moved);
+  if (num_inputs_open == 0)
+    while (skip_missing_sequences(UNSEQUENCED))
+      ;
+  CHECK_ERRNO(pthread_mutex_unlock, &reorder_lock);
+}
+
+/**
+ * Carry the records between given positions of the buffer over to the front
+ * of the one the input is reading into, ahead of the trailing bytes of the
+ * record being read.
+ */
+static inline void carry_over_records(Input *input, Buffer *buf, int begin,
+                                      int end) {
+  Buffer *reading = input->buffer;
+  int size = end - begin;
+  int capacity = reading->capacity;
+  // leaving room for reading more
+  while (capacity - reading->size <= size) capacity *= 2;
+  if (capacity > reading->capacity) enlarge_buffer(reading, capacity);
+  memmove(reading->data + size, reading->data, reading->size);
+  memcpy(reading->data, buf->data + begin, size);
+  reading->size += size;
+  reading->end_of_last_record = size - 1;
+}
+
+/**
+ * Hand off the records in the buffer in the order of their sequence numbers,
+ * splitting the buffer at the sequence headers, which are dropped.  Since the
+ * headers seldom fall on the boundaries of what's read, the records after the
+ * last header are carried over to be handed off along with what's read next,
+ * instead of on their own, so fewer and fuller buffers are handed off.
+ */
+static inline void submit_sequenced_records(Input *input, Buffer *buf,
+                                            bool input_seems_drained) {
+  uint64_t seq;
+  int header_size;
+  for (;;) {
+    int end = buf->begin + buf->size;
+    int pos = find_sequence_header(buf, buf->begin, end, &seq, &header_size);
+    if (pos < 0) break;
+    int rest_begin = pos + header_size;
+    uint64_t next_seq;
+    int next_header_size;
+    if (pos > buf->begin && !input->is_closed && !input_seems_drained &&
+        find_sequence_header(buf, rest_begin, end, &next_seq,
+                             &next_header_size) < 0) {
+      carry_over_records(input, buf, rest_begin, end);
+      buf->size = pos - buf->begin;
+      hand_off_in_order(input, buf, true);
+      sequence_of_inputs[input - first_input] = seq;
+      return;
+    }
+    Buffer *rest = buf;
+    if (pos > buf->begin) {
+      // records before the header end the sequence the input was reading
+      rest = grab_empty_buffer(&input->stats);
+      if (end - pos > rest->capacity) enlarge_buffer(rest, end - pos);
+      memcpy(rest->data, buf->data + pos, end - pos);
+      rest->size = end - pos;
+      buf->size = pos - buf->begin;
+      hand_off_in_order(input, buf, true);
+    } else {
+      hand_off_in_order(input, NULL, true);
+    }
+    rest->begin += header_size;
+    rest->size -= header_size;
+    sequence_of_inputs[input - first_input] = seq;
+    buf = rest;
+  }
+  hand_off_in_order(input, buf, input->is_closed);
+  if (input->is_closed) close_input_in_order(input);
+}
+
+static inline void init_reorder_window(Inputs *inputs) {
+  if (REORDER_WINDOW > 0 && PARTITION_KEY.kind != PARTITION_NONE) {
+    fprintf(stderr, "REORDER_WINDOW is ignored when partitioning by key\n");
+    REORDER_WINDOW = 0;
+  }
+  if (REORDER_WINDOW <= 0) return;
+  reorder_window = calloc(REORDER_WINDOW, sizeof(ReorderSlot));
+  for (int i = 0; i < REORDER_WINDOW; ++i)
+    reorder_window[i].buffers = new_queue();
+  sequence_of_inputs = malloc(inputs->num_inputs * sizeof(uint64_t));
+  for (int i = 0; i < inputs->num_inputs; ++i)
+    sequence_of_inputs[i] = UNSEQUENCED;
+  num_inputs_open = inputs->num_inputs;
+}
+
+/**
+ * Submit the records in a large buffer in slices, each pointing into its data
+ * rather than holding a copy, so several outputs can write them at once.  The
+ * slices are of about SLICE_SIZE bytes, or larger so there are no more of
+ * them than the outputs open, and cut as long as empty buffers are at hand,
+ * while the last one takes whatever's left.  The buffer itself holds the
+ * first slice, and is recycled only after all of them are.
+ */
+static inline void submit_sliced_buffer(Input *input, Buffer *buf) {
+  int num_outputs = __atomic_load_n(&num_outputs_open, __ATOMIC_RELAXED);
+  int slice_size = num_outputs > 1 ? buf->size / num_outputs : buf->size;
+  if (slice_size < SLICE_SIZE) slice_size = SLICE_SIZE;
+  // what outputs do with the slices handed off doesn't change the whole
+  Buffer whole = *buf;
+  int end = whole.begin + whole.size;
+  // held while cutting, besides its own slice, so it's not recycled midway
+  buf->num_slices = 2;
+  Buffer *last = buf, *slice;
+  int pos = whole.begin, slice_end;
+  while ((slice_end = end_of_slice(&whole, pos, slice_size)) < end &&
+         (slice = try_take_buffer(&empty_buffers)) != NULL) {
+    last->size = slice_end - last->begin;
+    last->end_of_last_record = slice_end - 1;
+    submit_full_buffer(input, last);
+    clear_buffer(slice);
+    point_slice_at(slice, buf, slice_end, end);
+    last = slice;
+    pos = slice_end;
+  }
+  submit_full_buffer(input, last);
+  recycle_buffer(buf);
+}
+
+/**
+ * Submit the records in the buffer to the output threads, as a whole, or in
+ * slices when it's large, in the order of their sequence numbers when
+ * reordering, or scattered by their keys when partitioning.
+ */
+static inline void submit_records(Input *input, Buffer *buf,
+                                  bool input_seems_drained) {
+  if (REORDER_WINDOW > 0) {
+    submit_sequenced_records(input, buf, input_seems_drained);
+  } else if (PARTITION_KEY.kind == PARTITION_NONE) {
+    if (SLICE_SIZE > 0 && buf->size > SLICE_SIZE) {
+      submit_sliced_buffer(input, buf);
+    } else {
+      submit_full_buffer(input, buf);
+    }
+  } else {
+    scatter_records(input, buf, input_seems_drained);
+  }
+}
+
+/**
+  * Whether streams may be attached and detached at runtime, and the signals
+  * left unblocked while an input is waited for, which include the one to see
+  * whether it's detached, blocked otherwise so it's never missed
+  * (See: detach_input)
   */
-static inline Buffer *grab_empty_buffer(void) {
-  Buffer *buf = dequeue_or_wait(empty_buffers);
-  clear_buffer(buf);
-  return buf;
+static bool is_under_control;
+static sigset_t signals_while_waiting;
+
+static inline int wait_for_input(Input *input) {
+  struct pollfd p = {.fd = input->fd, .events = POLLIN};
+  return ppoll(&p, 1, NULL, &signals_while_waiting);
 }
 
 /**
@@ -65,21 +704,56 @@ static inline Buffer *grab_empty_buffer(void) {
 static void *read_buffers_from_input(void *arg) {
   Input *input = arg;
 
-  input->buffer = grab_empty_buffer();
-  DEBUG("%s: grabbed an empty buffer %p", input->name, input->buffer);
-  while (data_should_flow_in) {
+  if (input->buffer == NULL) {
+    input->buffer = grab_empty_buffer(&input->stats);
+    DEBUG("%s: grabbed an empty buffer %p", input->name, input->buffer);
+  }
+  if (PARTITION_KEY.kind != PARTITION_NONE)
+    for (int i = 0; i < num_local_pools; ++i)
+      partitions_of(input)[i] = grab_empty_buffer(&input->stats);
+  while (is_set(&data_should_flow_in)) {
     // Read from input to fill up the buffer with at least one record
     Buffer *buf = input->buffer;
     int scan_end_of_record_down_to = buf->end_of_last_record + 1;
+    // a short read suggests there's nothing more to read for now
+    bool input_seems_drained = false;
     for (;;) {
-      int num_bytes_readable = buf->capacity - buf->size;
+      if (input->is_detaching) {
+        // hand off the records read so far, but not the partial one
+        find_end_of_last_record(buf, buf->begin);
+        int end = buf->end_of_last_record + 1;
+        if (end < buf->begin) end = buf->begin;
+        if (end < buf->begin + buf->size)
+          fprintf(stderr, "%s: Dropping %d bytes of a partial record\n",
+                  input->name, buf->begin + buf->size - end);
+        buf->size = end - buf->begin;
+        DEBUG("%s: input detached", input->name);
+        close(input->fd);
+        input->is_closed = 1;
+        break;
+      }
+      if (is_under_control && !has_pending_input(input->decompressor) &&
+          wait_for_input(input) < 0 && errno == EINTR)
+        continue;
+      int num_bytes_readable = num_bytes_to_read(&input->sizing, buf);
       DEBUG("%s: can read %d bytes", input->name, num_bytes_readable);
 
-      int num_bytes_read = read(input->fd, buf->data + buf->begin + buf->size,
-                                num_bytes_readable);
+      int num_bytes_read =
+          DECOMPRESS_INPUTS
+              ? read_decompressed(&input->decompressor, input->fd,
+                                  buf->data + buf->begin + buf->size,
+                                  num_bytes_readable)
+              : read(input->fd, buf->data + buf->begin + buf->size,
+                     num_bytes_readable);
       DEBUG("%s: %d bytes read", input->name, num_bytes_read);
+      count_syscall(&input->stats, num_bytes_read);
 
-      if (num_bytes_read < 0) {
+      if (num_bytes_read < 0 && (errno == EINTR || errno == EAGAIN)) {
+        // interrupted to see whether it's detached, or what was pending
+        // decompressed to nothing yet
+        continue;
+
+      } else if (num_bytes_read < 0) {
         // Close input upon errors
         perrorf("read %s returned %d", input->name, num_bytes_read);
         DEBUG("%s: input closed due to error", input->name);
@@ -98,14 +772,30 @@ static void *read_buffers_from_input(void *arg) {
       } else {
         // Normal read
         buf->size += num_bytes_read;
+        input_seems_drained = num_bytes_read < num_bytes_readable;
       }
 
-      find_record_separator(buf, scan_end_of_record_down_to);
+      if (find_end_of_last_record(buf, scan_end_of_record_down_to) < 0) {
+        // Close input upon malformed records as upon errors, handing off the
+        // ones before
+        perrorf("read %s", input->name);
+        DEBUG("%s: input closed due to malformed records", input->name);
+        close(input->fd);
+        input->is_closed = 1;
+        teardown_all_threads_due_to_error();
+        break;
+      }
       DEBUG("%s: record ends at %d", input->name, buf->end_of_last_record);
+      adapt_block_size(&input->sizing, buf, num_bytes_read);
 
       // Stop reading if at least one complete record has been read into the
-      // buffer
+      // buffer, unless more can be batched with them before long
       if (buf->end_of_last_record > -1) {
+        uint64_t usec_left = usec_left_to_batch(&input->sizing, buf);
+        if (usec_left == 0) break;
+        struct pollfd p = {.fd = input->fd, .events = POLLIN};
+        if (poll(&p, 1, (usec_left + 999) / 1000) > 0) continue;
+        input_seems_drained = true;
         break;
 
       } else if (buf->size == buf->capacity) {
@@ -114,6 +804,7 @@ static void *read_buffers_from_input(void *arg) {
         DEBUG("%s: doubling buffer size to %d bytes", input->name,
               buf->capacity * 2);
         enlarge_buffer(buf, buf->capacity * 2);
+        STATS_ADD(&input->stats, num_growths, 1);
 
         // Bound the next scan for end-of-record separator
         scan_end_of_record_down_to = buf->begin + buf->size;
@@ -121,27 +812,29 @@ static void *read_buffers_from_input(void *arg) {
     }
     DEBUG("%s: filled buffer %p, holding %d bytes", input->name, input->buffer,
           input->buffer->size);
+    start_next_batch(&input->sizing);
 
     if (input->is_closed) {
       // Once input is closed, submit the last filled buffer to output threads,
       // and exit the loop since no more can be read
       DEBUG("%s: submitting the last filled buffer %p", input->name,
             input->buffer);
-      queue_and_signal(full_buffers, input->buffer);
+      submit_records(input, input->buffer, true);
       break;
     } else if (input->buffer->size > 0) {
       // Otherwise, keep only complete records in the buffer and move the
       // trailing bytes to a new empty buffer
       DEBUG("%s: grabbing next empty buffer", input->name);
-      Buffer *overflow = grab_empty_buffer();
+      Buffer *overflow = grab_empty_buffer(&input->stats);
       DEBUG("%s: grabbed an empty buffer %p", input->name, overflow);
       // Submit the trimmed buffer and continue the same steps with the new
       // buffer
       DEBUG("%s: submitting after trimming the filled buffer %p", input->name,
             input->buffer);
       move_trailing_data_after_last_record(overflow, input->buffer);
-      queue_and_signal(full_buffers, input->buffer);
+      Buffer *filled = input->buffer;
       input->buffer = overflow;
+      submit_records(input, filled, input_seems_drained);
     } else {
       // XXX This should never happen, but it's harmless try to fill the buffer
       // again if it ever does
@@ -151,92 +844,447 @@ static void *read_buffers_from_input(void *arg) {
           input->name);
     }
   }
+  free_decompressor(input->decompressor);
+  input->decompressor = NULL;
 
   DEBUG("%s: stops input thread", input->name);
   return NULL;
 }
 
+/**
+ * Function executed by the input threads instead when the input is a mapped
+ * regular file.  Chunks of complete records are handed off right from the
+ * mapping, without reading them into the buffers, so outputs can write
+ * different chunks of the file in parallel.
+ */
+static void *map_buffers_from_input(void *arg) {
+  Input *input = arg;
+
+  while (is_set(&data_should_flow_in) && !input->is_detaching) {
+    Buffer *buf = grab_empty_buffer(&input->stats);
+    int num_bytes_mapped = map_next_records(&input->mapped, buf);
+    DEBUG("%s: %d bytes mapped", input->name, num_bytes_mapped);
+    if (num_bytes_mapped < 0) {
+      perrorf("read %s", input->name);
+      teardown_all_threads_due_to_error();
+    }
+    if (num_bytes_mapped <= 0) {
+      put_buffer(&empty_buffers, buf);
+      break;
+    }
+    STATS_ADD(&input->stats, num_bytes, num_bytes_mapped);
+    submit_full_buffer(input, buf);
+  }
+  // the mapping stays until the process exits, as outputs may still be
+  // writing from it
+  DEBUG("%s: input closed", input->name);
+  close(input->fd);
+  input->is_closed = 1;
+  DEBUG("%s: stops input thread", input->name);
+  return NULL;
+}
+
+/**
+ * Function executed by the input threads instead when zero-copy is enabled and
+ * the input is a pipe.  Complete records are spliced into the pipes of the
+ * buffers, so they are never copied back and forth to user space, until a
+ * record too large for a pipe requires falling back to reading into memory.
+ */
+static void *splice_buffers_from_input(void *arg) {
+  Input *input = arg;
+
+  int scratch_pipe[2];
+  if (open_pipe(scratch_pipe) < 0) {
+    // e.g., out of file descriptors, which are better left for the streams
+    DEBUG("%s: no pipe to peek with, reading into memory", input->name);
+    return read_buffers_from_input(arg);
+  }
+  input->buffer = grab_empty_buffer(&input->stats);
+  DEBUG("%s: grabbed an empty buffer %p", input->name, input->buffer);
+  while (is_set(&data_should_flow_in)) {
+    int num_bytes_moved =
+        splice_records_from(input->buffer, input->fd, scratch_pipe);
+    DEBUG("%s: %d bytes spliced", input->name, num_bytes_moved);
+    count_syscall(&input->stats, num_bytes_moved);
+    if (num_bytes_moved < 0) {
+      DEBUG("%s: falling back to reading into memory", input->name);
+      move_data_out_of_pipe(input->buffer);
+      break;
+    } else if (num_bytes_moved == 0) {
+      // EOF reached, close input
+      DEBUG("%s: input closed", input->name);
+      close(input->fd);
+      input->is_closed = 1;
+      break;
+    }
+    // Submit the buffer holding complete records and continue with a new one
+    DEBUG("%s: submitting the spliced buffer %p", input->name, input->buffer);
+    submit_full_buffer(input, input->buffer);
+    input->buffer = grab_empty_buffer(&input->stats);
+  }
+  close(scratch_pipe[0]);
+  close(scratch_pipe[1]);
+
+  if (!input->is_closed && is_set(&data_should_flow_in))
+    return read_buffers_from_input(arg);
+  // Once input is closed, submit what's left in the last buffer
+  if (input->buffer->size > 0) {
+    submit_full_buffer(input, input->buffer);
+  } else {
+    put_buffer(&empty_buffers, input->buffer);
+  }
+  DEBUG("%s: stops input thread", input->name);
+  return NULL;
+}
+
+static inline void close_output_due_to_error(Output *output) {
+  perrorf("write %s", output->name);
+  DEBUG("%s: output closed due to error", output->name);
+  close(output->fd);
+  output->is_closed = 1;
+  // the other outputs take over the records left unless none is open
+  if (!FAILOVER ||
+      __atomic_sub_fetch(&num_outputs_open, 1, __ATOMIC_SEQ_CST) == 0)
+    teardown_all_threads_due_to_error();
+}
+
+/**
+ * Leave in the buffer the output failed to write only the records it hasn't,
+ * so another output can take over without duplicating any, or tear down all
+ * threads if one was split, and SPLIT_RECORD_POLICY says so.
+ */
+static inline void skip_written_records_of(Output *output, Buffer *buf,
+                                           int records_begin) {
+  if (skip_written_records(buf, records_begin) < 0) {
+    fprintf(stderr, "%s: Failed in the middle of a record\n", output->name);
+    teardown_all_threads_due_to_error();
+    buf->size = 0;
+  } else if (STATS_ENABLED) {
+    buf->num_records = count_records(buf);
+  }
+}
+
+/**
+ * Write the records of a batch of buffers to the output, each after its
+ * sequence header, in as few writev(2) calls as possible.  Returns the number
+ * of buffers completely written, which falls short only when the output is
+ * closed due to an error.
+ */
+static int write_batch_to(Output *output, Buffer **batch, int num_buffers) {
+  struct iovec iovs[2 * MAX_WRITEV_BATCH];
+  int end_iov_of[MAX_WRITEV_BATCH];
+  char headers[MAX_WRITEV_BATCH][MAX_SEQUENCE_HEADER_LENGTH];
+  int num_iovs = 0;
+  for (int i = 0; i < num_buffers; ++i) {
+    Buffer *buf = batch[i];
+    if (SEQUENCE_NUMBERS && buf->size > 0)
+      iovs[num_iovs++] = (struct iovec){
+          headers[i], format_sequence_header(headers[i], buf->seq)};
+    iovs[num_iovs++] = (struct iovec){buf->data + buf->begin, buf->size};
+    end_iov_of[i] = num_iovs;
+  }
+  struct iovec *iov = iovs, *end = iovs + num_iovs;
+  int num_written = 0;
+  for (;;) {
+    while (iov < end && iov->iov_len == 0) ++iov;
+    while (num_written < num_buffers && iov - iovs >= end_iov_of[num_written])
+      ++num_written;
+    if (iov == end) break;
+    ssize_t num_bytes_written = writev(output->fd, iov, end - iov);
+    DEBUG("%s: wrote %zd bytes from %d buffers", output->name,
+          num_bytes_written, num_buffers - num_written);
+    count_syscall(&output->stats, num_bytes_written);
+    if (num_bytes_written <= 0) {
+      close_output_due_to_error(output);
+      if (FAILOVER && num_written < num_buffers) {
+        // advance the buffer it stopped in past what's written of it
+        Buffer *buf = batch[num_written];
+        int records_begin = buf->begin;
+        int num_bytes_left = iovs[end_iov_of[num_written] - 1].iov_len;
+        buf->begin += buf->size - num_bytes_left;
+        buf->size = num_bytes_left;
+        skip_written_records_of(output, buf, records_begin);
+      }
+      break;
+    }
+    // skip what's written, which may end in the middle of a buffer
+    for (; iov < end && (size_t)num_bytes_written >= iov->iov_len; ++iov)
+      num_bytes_written -= iov->iov_len;
+    if (num_bytes_written > 0) {
+      iov->iov_base = (char *)iov->iov_base + num_bytes_written;
+      iov->iov_len -= num_bytes_written;
+    }
+  }
+  return num_written;
+}
+
+/**
+ * Compress the records of a batch of buffers, each after its sequence header,
+ * into the gzip stream of the output, and flush it, so whatever reads the
+ * output can decompress every record written without waiting for the rest.
+ * Returns the number of buffers written, which is none when the output is
+ * closed due to an error, since there's no telling how much of the flushed
+ * data made it, and any of the batch may have been, i.e., whatever reads the
+ * output may get some of the records that are rerouted to the others too.
+ */
+static int write_compressed_batch_to(Output *output, Buffer **batch,
+                                     int num_buffers) {
+  char header[MAX_SEQUENCE_HEADER_LENGTH];
+  for (int i = 0; i < num_buffers; ++i) {
+    Buffer *buf = batch[i];
+    if ((SEQUENCE_NUMBERS && buf->size > 0 &&
+         write_compressed(output->compressor, output->fd, header,
+                          format_sequence_header(header, buf->seq),
+                          &output->stats) < 0) ||
+        write_compressed(output->compressor, output->fd,
+                         buf->data + buf->begin, buf->size,
+                         &output->stats) < 0) {
+      close_output_due_to_error(output);
+      return 0;
+    }
+  }
+  if (flush_compressed(output->compressor, output->fd, &output->stats) < 0) {
+    close_output_due_to_error(output);
+    return 0;
+  }
+  DEBUG("%s: compressed %d buffers", output->name, num_buffers);
+  return num_buffers;
+}
+
+/**
+ * Move the records held in the pipe of the buffer to the output without
+ * copying them, or write them from memory if the output doesn't support
+ * splice(2).  Returns whether all were moved.
+ */
+static bool splice_buffer_to(Output *output, Buffer *buf) {
+  int num_bytes_to_splice = buf->size;
+  while (buf->size > 0) {
+    int num_bytes_written = splice_data_to(buf, output->fd);
+    if (num_bytes_written < 0 && errno == EINVAL) {
+      // Fall back to writing from memory if output doesn't support splice
+      DEBUG("%s: cannot splice, writing from memory", output->name);
+      move_data_out_of_pipe(buf);
+      return write_batch_to(output, &buf, 1) == 1;
+    }
+    DEBUG("%s: wrote %d bytes", output->name, num_bytes_written);
+    count_syscall(&output->stats, num_bytes_written);
+    if (num_bytes_written <= 0) {
+      close_output_due_to_error(output);
+      if (FAILOVER) {
+        // what's spliced can't be looked back at to find where records begin
+        bool is_spliced = buf->size < num_bytes_to_splice;
+        move_data_out_of_pipe(buf);
+        skip_written_records_of(output, buf, is_spliced ? -1 : buf->begin);
+      }
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Call to detach an output, put in the pool like a buffer to wake it up if
+ * it's waiting for one, which any other output taking it puts back while the
+ * one detached is still waiting (See: detach_output)
+ */
+static Buffer detach_call;
+static Output *output_being_detached;
+static pthread_mutex_t detach_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t output_stopped_waiting = PTHREAD_COND_INITIALIZER;
+
+static inline bool is_detaching(Output *output) {
+  return __atomic_load_n(&output->is_detaching, __ATOMIC_SEQ_CST);
+}
+
+static inline bool is_waiting(Output *output) {
+  return __atomic_load_n(&output->is_waiting, __ATOMIC_SEQ_CST);
+}
+
+static inline void signal_output_stopped_waiting(void) {
+  CHECK_ERRNO(pthread_mutex_lock, &detach_lock);
+  CHECK_ERRNO(pthread_cond_broadcast, &output_stopped_waiting);
+  CHECK_ERRNO(pthread_mutex_unlock, &detach_lock);
+}
+
+static inline void stop_waiting(Output *output) {
+  __atomic_store_n(&output->is_waiting, false, __ATOMIC_SEQ_CST);
+  if (is_detaching(output)) signal_output_stopped_waiting();
+}
+
+/**
+ * Answer the call to detach an output taken by this one.  Returns whether
+ * it's the one detached.  Otherwise, the call is put back if the one detached
+ * is still waiting, and this one waits until it isn't, so as not to take the
+ * call again meanwhile.
+ */
+static inline bool answer_detach_call(Output *output) {
+  if (is_detaching(output)) return true;
+  CHECK_ERRNO(pthread_mutex_lock, &detach_lock);
+  Output *detached = output_being_detached;
+  if (detached != NULL && !detached->is_closed && is_waiting(detached)) {
+    put_full_buffer_to(0, &detach_call);
+    while (!detached->is_closed && is_waiting(detached))
+      CHECK_ERRNO(pthread_cond_wait, &output_stopped_waiting, &detach_lock);
+  }
+  CHECK_ERRNO(pthread_mutex_unlock, &detach_lock);
+  return false;
+}
+
+/**
+ * Hand over the buffers routed to an output closed due to an error to the
+ * next one open, until the end of stream, as more may still be routed to it.
+ * When stealing, the others take whatever's routed to it later anyway, so
+ * only what's there is handed over.  Returns whether the end of stream was
+ * taken.
+ */
+static inline bool hand_over_full_buffers(Output *output) {
+  for (;;) {
+    Buffer *buf = WORK_STEALING ? try_take_own_full_buffer(output)
+                                : take_full_buffer(output);
+    if (buf == NULL) return false;
+    if (buf == &end_of_stream) return true;
+    if (is_set(&data_should_flow_out)) {
+      put_full_buffer_to(next_open_output_after(output), buf);
+    } else {
+      retire_full_buffer(buf);
+    }
+  }
+}
+
 /**
  * Function executed by the output threads. Reads a filled buffer produced by
- * input threads,
- * writes it, and adds the
- * buffer back into the empty buffer queue.
+ * input threads, along with any others already waiting, writes them, and adds
+ * the buffers back into the empty buffer queue.  It stops once it takes the
+ * end of stream.
  */
 static void *write_buffers_to_output(void *arg) {
   Output *output = arg;
 
-  while (data_should_flow_out) {
-    // Grab a filled buffer
+  Buffer *batch[MAX_WRITEV_BATCH];
+  bool has_records[MAX_WRITEV_BATCH];
+  if (COMPRESS_OUTPUTS &&
+      (output->compressor = new_compressor(COMPRESS_OUTPUTS)) == NULL) {
+    perror("new_compressor");
+    abort();
+  }
+  bool has_reached_end = false;
+  while (is_set(&data_should_flow_out)) {
+    // Grab a filled buffer, unless detached before waiting for one
     DEBUG("%s: waiting for a filled buffer", output->name);
-    Buffer *buf = output->buffer = dequeue_or_wait(full_buffers);
+    __atomic_store_n(&output->is_waiting, true, __ATOMIC_SEQ_CST);
+    if (is_detaching(output)) {
+      DEBUG("%s: output is now detached", output->name);
+      break;
+    }
+    Buffer *buf = output->buffer = take_full_buffer(output);
+    stop_waiting(output);
+    if (buf == &detach_call) {
+      if (answer_detach_call(output)) {
+        DEBUG("%s: output is now detached", output->name);
+        break;
+      }
+      continue;
+    }
+    if (buf == &end_of_stream) {
+      DEBUG("%s: reached the end of stream", output->name);
+      has_reached_end = true;
+      break;
+    }
     DEBUG("%s: got a filled buffer %p, holding %d bytes", output->name, buf,
           buf->size);
+    // and the ones already waiting behind it, unless they may be spliced, or
+    // would run further ahead of other outputs than a merging mkmimo expects
+    int num_batched = 1;
+    batch[0] = buf;
+    bool has_taken_detach_call = false;
+    while (num_batched < WRITEV_BATCH && !ZERO_COPY && !SEQUENCE_NUMBERS &&
+           !has_reached_end && !has_taken_detach_call &&
+           (batch[num_batched] = try_take_full_buffer(output)) != NULL) {
+      if (batch[num_batched] == &end_of_stream) {
+        has_reached_end = true;
+      } else if (batch[num_batched] == &detach_call) {
+        has_taken_detach_call = true;
+      } else {
+        ++num_batched;
+      }
+    }
+    for (int i = 0; i < num_batched; ++i) has_records[i] = batch[i]->size > 0;
 
     // Write all buffered data to the output
-    int num_bytes_writable = buf->size;
-    int buf_offset = 0;
-    while (num_bytes_writable > 0) {
-      int num_bytes_written = write(
-          output->fd, buf->data + buf->begin + buf_offset, num_bytes_writable);
-      DEBUG("%s: wrote %d bytes", output->name, num_bytes_written);
-
-      if (num_bytes_written <= 0) {
-        perrorf("write %s", output->name);
-        DEBUG("%s: output closed due to error", output->name);
-        close(output->fd);
-        output->is_closed = 1;
-        teardown_all_threads_due_to_error();
-        break;
-      }
+    int num_written =
+        buf->is_in_pipe ? splice_buffer_to(output, buf)
+        : output->compressor != NULL
+            ? write_compressed_batch_to(output, batch, num_batched)
+            : write_batch_to(output, batch, num_batched);
 
-      buf_offset += num_bytes_written;
-      num_bytes_writable -= num_bytes_written;
+    // Return the written buffers back to the pool and continue with the next
+    // available ones
+    for (int i = 0; i < num_written; ++i) {
+      if (has_records[i]) count_written_buffer(&output->stats, batch[i]);
+      retire_full_buffer(batch[i]);
+      DEBUG("%s: recycling the buffer %p", output->name, batch[i]);
     }
-
-    if (num_bytes_writable == 0) {
-      // Return the buffer back to the pool and continue with the next available
-      // buffer
-      queue_and_signal(empty_buffers, buf);
-      DEBUG("%s: recycling the buffer %p", output->name, buf);
-    } else {
-      // Otherwise, the output was closed before everything in the buffer was
-      // written, so send the buffer back to filled pool, so someone else can
-      // handle it
+    // Otherwise, the output was closed before everything in the buffers was
+    // written, so send them back to filled pool, so someone else can handle
+    // them
+    for (int i = num_written; i < num_batched; ++i) {
+      if (has_records[i] && batch[i]->size == 0) {
+        // nothing's left once what's written is skipped (See: FAILOVER)
+        retire_full_buffer(batch[i]);
+        continue;
+      }
       DEBUG("%s: resubmitting the buffer %p since output closed prematurely",
-            output->name, buf);
-      queue_and_signal(full_buffers, buf);
-      // XXX This can inevitably create duplicate records
-      // TODO Allow user to choose whether to drop or retransmit such records
+            output->name, batch[i]);
+      put_full_buffer_to(next_open_output_after(output), batch[i]);
+      // XXX unless FAILOVER, this can inevitably create duplicate records
+    }
+
+    // Stop once detached, leaving the rest of the buffers to other outputs
+    if (has_taken_detach_call) answer_detach_call(output);
+    if (is_detaching(output)) {
+      DEBUG("%s: output is now detached", output->name);
+      break;
     }
 
-    // Stop once the output is closed
+    // Stop once the output is closed, handing over the buffers routed to it
     if (output->is_closed) {
       DEBUG("%s: output is now closed", output->name);
+      if (FAILOVER && local_full_buffers != NULL)
+        has_reached_end = hand_over_full_buffers(output);
       break;
     }
 
-    // Also stop if no data is flowing in and remains in the pool
-    if (!data_is_flowing_in && is_empty(full_buffers)) {
-      DEBUG("%s: anticipates no more buffers to arrive", output->name);
-      data_should_flow_out = false;
+    // Also stop if the end of stream was taken along with the batch
+    if (has_reached_end) {
+      DEBUG("%s: reached the end of stream", output->name);
       break;
     }
   }
 
-  DEBUG("%s: stops output thread", output->name);
-  return NULL;
-}
+  // Once torn down, keep dropping the buffers handed off until the end of
+  // stream, so no input waits forever for an empty buffer, as no output may
+  // be left to write them
+  if (!has_reached_end && !is_set(&data_should_flow_out)) {
+    Buffer *buf;
+    while ((buf = take_full_buffer(output)) != &end_of_stream)
+      if (buf != &detach_call) retire_full_buffer(buf);
+  }
 
-/**
-  * Function executed as a thread once all input threads are finished to wake
-  * pending output threads to flush all the buffered data.
-  */
-static void *flush_remaining_data(void *arg) {
-  for (int i = 0;; ++i) {
-    Buffer *empty = grab_empty_buffer();
-    DEBUG("Submitting an empty buffer to wake an output thread (%d)", i);
-    queue_and_signal(full_buffers, empty);
+  // Close the output right away, so whatever reads it sees the end without
+  // waiting for the other outputs, e.g., a merging mkmimo holding back
+  // records until the sequence they're in ends
+  if (!output->is_closed) {
+    // ending the gzip stream, even if detached, so it's whole
+    if (output->compressor != NULL &&
+        finish_compressed(output->compressor, output->fd, &output->stats) < 0)
+      perrorf("write %s", output->name);
+    close(output->fd);
+    output->is_closed = 1;
   }
+  signal_output_stopped_waiting();
+  free_compressor(output->compressor);
+  output->compressor = NULL;
+  DEBUG("%s: stops output thread", output->name);
   return NULL;
 }
 
@@ -247,6 +1295,258 @@ static inline void parse_environ(void) {
   // allow multiple buffering factor to be tuned
   readIntFromEnv(MULTIBUFFERING, MULTIBUFFERING, MULTIBUFFERING > 0,
                  DEFAULT_MULTIBUFFERING);
+  // allow zero-copy transfer between pipes to be turned on
+  readIntFromEnv(ZERO_COPY, ZERO_COPY, ZERO_COPY >= 0, DEFAULT_ZERO_COPY);
+  // allow buffers to be handed off through lock-free rings
+  readIntFromEnv(LOCK_FREE, LOCK_FREE, LOCK_FREE >= 0, DEFAULT_LOCK_FREE);
+  // allow full buffers to be kept per output and stolen by idle ones
+  readIntFromEnv(WORK_STEALING, WORK_STEALING, WORK_STEALING >= 0,
+                 DEFAULT_WORK_STEALING);
+  // allow buffers to be stamped with sequence numbers for restoring order
+  readIntFromEnv(SEQUENCE_NUMBERS, SEQUENCE_NUMBERS, SEQUENCE_NUMBERS >= 0,
+                 DEFAULT_SEQUENCE_NUMBERS);
+  // allow records to be reordered by their sequence numbers
+  readIntFromEnv(REORDER_WINDOW, REORDER_WINDOW, REORDER_WINDOW >= 0,
+                 DEFAULT_REORDER_WINDOW);
+  // allow outputs to write several waiting buffers in a single call
+  readIntFromEnv(WRITEV_BATCH, WRITEV_BATCH,
+                 WRITEV_BATCH > 0 && WRITEV_BATCH <= MAX_WRITEV_BATCH,
+                 DEFAULT_WRITEV_BATCH);
+  // allow large buffers to be handed off in slices to several outputs
+  readIntFromEnv(SLICE_SIZE, SLICE_SIZE, SLICE_SIZE >= 0, DEFAULT_SLICE_SIZE);
+}
+
+/**
+  * Whether the records can be spliced from the input without copying
+  */
+static inline bool can_splice_from(Input *input) {
+#ifdef SPLICE_SUPPORTED
+  struct stat st;
+  // length prefixes are not looked for while peeking pipes, nor are the keys
+  // or sequence headers, and records held in pipes can't be decompressed or
+  // compressed, nor can a pipe be waited on in the middle of a record to see
+  // whether it's detached
+  return ZERO_COPY && !is_under_control &&
+         RECORD_FRAMING == FRAMING_DELIMITER &&
+         !DECOMPRESS_INPUTS && !COMPRESS_OUTPUTS &&
+         PARTITION_KEY.kind == PARTITION_NONE && !SEQUENCE_NUMBERS &&
+         REORDER_WINDOW == 0 &&
+         fstat(input->fd, &st) == 0 && S_ISFIFO(st.st_mode);
+#else
+  return false;
+#endif
+}
+
+/**
+  * Whether the records can be handed off right from the mapping of the input,
+  * which holds unless they're scattered by their keys, reordered, or have to
+  * be decompressed first
+  */
+static inline bool can_map(Input *input) {
+  return PARTITION_KEY.kind == PARTITION_NONE && REORDER_WINDOW == 0 &&
+         !(DECOMPRESS_INPUTS && is_gzipped_file(input->fd)) &&
+         map_file(&input->mapped, input->fd) == 0;
+}
+
+/**
+  * Tables of the threads for every input and output, with room for the ones
+  * attached at runtime, so no stream ever moves (See: CONTROL_SOCKET)
+  */
+static Inputs *all_inputs;
+static Outputs *all_outputs;
+static pthread_t *input_threads;
+static pthread_t *output_threads;
+static bool *input_thread_is_running;
+static pthread_mutex_t streams_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t input_thread_stopped = PTHREAD_COND_INITIALIZER;
+
+/**
+  * Function executed by the input threads, reading the input the best way it
+  * can be, and letting the control thread know once it's done.
+  */
+static void *run_input_thread(void *arg) {
+  Input *input = arg;
+  if (can_map(input)) {
+    map_buffers_from_input(input);
+  } else if (can_splice_from(input)) {
+    splice_buffers_from_input(input);
+  } else {
+    read_buffers_from_input(input);
+  }
+  CHECK_ERRNO(pthread_mutex_lock, &streams_lock);
+  input_thread_is_running[input - all_inputs->inputs] = false;
+  CHECK_ERRNO(pthread_cond_broadcast, &input_thread_stopped);
+  CHECK_ERRNO(pthread_mutex_unlock, &streams_lock);
+  return NULL;
+}
+
+static inline void spawn_input_thread(int i) {
+  Input *input = &all_inputs->inputs[i];
+  DEBUG("Spawning input thread for %s", input->name);
+  input_thread_is_running[i] = true;
+  CHECK_ERRNO(pthread_create, &input_threads[i], NULL, run_input_thread,
+              input);
+}
+
+static inline void spawn_output_thread(int i) {
+  Output *output = &all_outputs->outputs[i];
+  DEBUG("Spawning output thread for %s", output->name);
+  CHECK_ERRNO(pthread_create, &output_threads[i], NULL,
+              write_buffers_to_output, output);
+}
+
+/**
+  * Add more empty buffers for a stream attached at runtime, for which the
+  * pools have room.
+  */
+static inline void add_empty_buffers(int num_buffers) {
+  for (int i = 0; i < num_buffers; i++)
+    put_buffer(&empty_buffers, new_buffer());
+}
+
+/**
+  * Attach an input at runtime, unless all inputs have already finished.
+  */
+static int attach_input(char *name, int fd) {
+  int err = 0;
+  CHECK_ERRNO(pthread_mutex_lock, &streams_lock);
+  int i = all_inputs->num_inputs;
+  if (!is_set(&data_is_flowing_in) || !is_set(&data_should_flow_in)) {
+    err = EPIPE;
+  } else if (i == all_inputs->max_inputs) {
+    err = ENOSPC;
+  } else {
+    all_inputs->inputs[i] = (Input){.fd = fd, .name = name};
+    next_pool_of_inputs[i] = i % all_outputs->num_outputs;
+    add_empty_buffers(MULTIBUFFERING);
+    spawn_input_thread(i);
+    __atomic_store_n(&all_inputs->num_inputs, i + 1, __ATOMIC_RELEASE);
+  }
+  CHECK_ERRNO(pthread_mutex_unlock, &streams_lock);
+  errno = err;
+  return err ? -1 : 0;
+}
+
+/**
+  * Attach an output at runtime, unless all inputs have already finished.
+  */
+static int attach_output(char *name, int fd) {
+  int err = 0;
+  CHECK_ERRNO(pthread_mutex_lock, &streams_lock);
+  int i = all_outputs->num_outputs;
+  if (!is_set(&data_is_flowing_in) || !is_set(&data_should_flow_out)) {
+    err = EPIPE;
+  } else if (i == all_outputs->max_outputs) {
+    err = ENOSPC;
+  } else {
+    all_outputs->outputs[i] = (Output){.fd = fd, .name = name, .weight = 1};
+    add_empty_buffers(MULTIBUFFERING);
+    __atomic_add_fetch(&num_outputs_open, 1, __ATOMIC_SEQ_CST);
+    spawn_output_thread(i);
+    __atomic_store_n(&all_outputs->num_outputs, i + 1, __ATOMIC_RELEASE);
+  }
+  CHECK_ERRNO(pthread_mutex_unlock, &streams_lock);
+  errno = err;
+  return err ? -1 : 0;
+}
+
+static void interrupt(int sig) {}
+
+/**
+  * Detach an input, whose thread hands off the complete records it has read
+  * and stops.  The thread is interrupted once, as it may be waiting for the
+  * input, and waited for until it stops.
+  */
+static int detach_input(const char *name) {
+  int i;
+  CHECK_ERRNO(pthread_mutex_lock, &streams_lock);
+  for (i = 0; i < all_inputs->num_inputs; ++i) {
+    Input *input = &all_inputs->inputs[i];
+    if (!input->is_closed && !input->is_detaching &&
+        !strcmp(input->name, name))
+      break;
+  }
+  if (i < all_inputs->num_inputs) all_inputs->inputs[i].is_detaching = 1;
+  CHECK_ERRNO(pthread_mutex_unlock, &streams_lock);
+  if (i == all_inputs->num_inputs) {
+    errno = ENOENT;
+    return -1;
+  }
+  CHECK_ERRNO(pthread_mutex_lock, &streams_lock);
+  if (input_thread_is_running[i]) pthread_kill(input_threads[i], SIGUSR2);
+  while (input_thread_is_running[i])
+    CHECK_ERRNO(pthread_cond_wait, &input_thread_stopped, &streams_lock);
+  CHECK_ERRNO(pthread_mutex_unlock, &streams_lock);
+  return 0;
+}
+
+/**
+  * Detach an output, whose thread finishes writing the buffers it holds and
+  * stops, leaving the rest to other outputs, so the last one can't be.  A
+  * call is put in the pool to wake it up, as it may be waiting for a buffer,
+  * and it's waited for until it stops.
+  */
+static int detach_output(const char *name) {
+  int i, num_outputs_staying = 0;
+  CHECK_ERRNO(pthread_mutex_lock, &streams_lock);
+  Output *output = NULL;
+  for (i = 0; i < all_outputs->num_outputs; ++i) {
+    Output *o = &all_outputs->outputs[i];
+    if (o->is_closed || is_detaching(o)) continue;
+    if (output == NULL && !strcmp(o->name, name)) {
+      output = o;
+    } else {
+      ++num_outputs_staying;
+    }
+  }
+  if (output != NULL && num_outputs_staying > 0) {
+    __atomic_store_n(&output->is_detaching, true, __ATOMIC_SEQ_CST);
+    if (FAILOVER) __atomic_sub_fetch(&num_outputs_open, 1, __ATOMIC_SEQ_CST);
+  }
+  CHECK_ERRNO(pthread_mutex_unlock, &streams_lock);
+  if (output == NULL || num_outputs_staying == 0) {
+    errno = output == NULL ? ENOENT : EBUSY;
+    return -1;
+  }
+  CHECK_ERRNO(pthread_mutex_lock, &detach_lock);
+  output_being_detached = output;
+  put_full_buffer_to(0, &detach_call);
+  while (!output->is_closed)
+    CHECK_ERRNO(pthread_cond_wait, &output_stopped_waiting, &detach_lock);
+  output_being_detached = NULL;
+  CHECK_ERRNO(pthread_mutex_unlock, &detach_lock);
+  return 0;
+}
+
+static const ControlOps control_ops = {
+    .attach_input = attach_input,
+    .attach_output = attach_output,
+    .detach_input = detach_input,
+    .detach_output = detach_output,
+};
+
+/**
+  * Get ready to take commands for attaching and detaching streams at runtime,
+  * unless they'd need more than the pools shared by all inputs and outputs.
+  * This is done before any thread is spawned, so they all inherit the signal
+  * interrupting inputs blocked, to be unblocked only while waiting for them.
+  */
+static inline bool prepare_to_take_control(void) {
+  if (local_full_buffers != NULL || REORDER_WINDOW > 0) {
+    fprintf(stderr, "CONTROL_SOCKET is ignored when partitioning by key, "
+                    "weighting outputs, stealing work, or reordering\n");
+    return false;
+  }
+  // so waiting for an input returns to see whether it's detached
+  struct sigaction action = {.sa_handler = interrupt};
+  sigaction(SIGUSR2, &action, NULL);
+  sigset_t detach_signal;
+  sigemptyset(&detach_signal);
+  sigaddset(&detach_signal, SIGUSR2);
+  CHECK_ERRNO(pthread_sigmask, SIG_BLOCK, &detach_signal,
+              &signals_while_waiting);
+  sigdelset(&signals_while_waiting, SIGUSR2);
+  return true;
 }
 
 /**
@@ -255,56 +1555,101 @@ static inline void parse_environ(void) {
 inline int mkmimo_multithreaded(Inputs *inputs, Outputs *outputs) {
   parse_environ();
 
-  full_buffers = new_queue();
-  empty_buffers = new_queue();
-
   // Initialize the empty pool with k * (I + O) buffers
+  MULTIBUFFERING = cap_multibuffering(
+      MULTIBUFFERING, inputs->num_inputs + outputs->num_outputs);
   int num_buffers =
       MULTIBUFFERING * (inputs->num_inputs + outputs->num_outputs);
+  if (PARTITION_KEY.kind != PARTITION_NONE) {
+    // plus I * O for the partitions every input keeps for every output
+    num_buffers += inputs->num_inputs * outputs->num_outputs;
+    partitioned_buffers = calloc(inputs->num_inputs * outputs->num_outputs,
+                                 sizeof(Buffer *));
+  }
+  init_reorder_window(inputs);
+  if (REORDER_WINDOW > 0)
+    // plus as many as the window can hold back, and two for every input
+    // waiting for the window, i.e., to split a buffer and to read next
+    num_buffers += REORDER_WINDOW + 2 * inputs->num_inputs;
+  // plus room for the ones of streams attached at runtime
+  int max_num_buffers =
+      num_buffers + MULTIBUFFERING * (inputs->max_inputs - inputs->num_inputs +
+                                      outputs->max_outputs -
+                                      outputs->num_outputs);
+  // with room for the end of stream handed off to every output, and the call
+  // to detach every one
+  init_full_buffer_pools(inputs, outputs,
+                         max_num_buffers + 2 * outputs->max_outputs);
+  init_buffer_pool(&empty_buffers, max_num_buffers);
   DEBUG("Creating %d empty buffers", num_buffers);
+  reserve_buffer_arena(num_buffers);
   for (int i = 0; i < num_buffers; i++) {
-    queue(empty_buffers, new_buffer());
+    put_buffer(&empty_buffers, new_buffer());
   }
 
   // Initialize the state
-  data_is_flowing_in = 1;
+  set_flag(&data_is_flowing_in, true);
+  num_outputs_open = outputs->num_outputs;
 
   // Spawn a thread for every input and output
-  pthread_t output_threads[outputs->num_outputs];
-  for (int i = 0; i < outputs->num_outputs; i++) {
-    Output *output = &(outputs->outputs[i]);
-    DEBUG("Spawning output thread for %s", output->name);
-    CHECK_ERRNO(pthread_create, &output_threads[i], NULL,
-                write_buffers_to_output, output);
-  }
-  pthread_t input_threads[inputs->num_inputs];
-  for (int i = 0; i < inputs->num_inputs; i++) {
-    Input *input = &(inputs->inputs[i]);
-    DEBUG("Spawning input thread for %s", input->name);
-    CHECK_ERRNO(pthread_create, &input_threads[i], NULL,
-                read_buffers_from_input, input);
-  }
+  all_inputs = inputs;
+  all_outputs = outputs;
+  input_threads = calloc(inputs->max_inputs, sizeof(pthread_t));
+  output_threads = calloc(outputs->max_outputs, sizeof(pthread_t));
+  input_thread_is_running = calloc(inputs->max_inputs, sizeof(bool));
+  is_under_control = CONTROL_SOCKET != NULL && prepare_to_take_control();
+  for (int i = 0; i < outputs->num_outputs; i++) spawn_output_thread(i);
+  for (int i = 0; i < inputs->num_inputs; i++) spawn_input_thread(i);
+  if (is_under_control && start_control_server(&control_ops) < 0)
+    perror(CONTROL_SOCKET);
 
-  // Wait for all input threads to read all data
-  for (int i = 0; i < inputs->num_inputs; i++) {
+  // Wait for all input threads to read all data, including the ones attached
+  // meanwhile, until none is left to be
+  for (int i = 0;; i++) {
+    CHECK_ERRNO(pthread_mutex_lock, &streams_lock);
+    // Let output threads know no more data is coming in, ordered against
+    // their count of the buffers in flight (See: retire_full_buffer)
+    if (i == inputs->num_inputs)
+      __atomic_store_n(&data_is_flowing_in, false, __ATOMIC_SEQ_CST);
+    CHECK_ERRNO(pthread_mutex_unlock, &streams_lock);
+    if (!is_set(&data_is_flowing_in)) break;
     DEBUG("Waiting for %s and %d more input threads to finish",
           inputs->inputs[i].name, inputs->num_inputs - 1 - i);
     CHECK_ERRNO(pthread_join, input_threads[i], NULL);
   }
   DEBUG("%s", "All input threads finished");
-  // Let output threads know no more data is coming in
-  data_is_flowing_in = false;
-  // Spawn a thread for waking up all pending output threads
-  pthread_t flush_thread;
-  CHECK_ERRNO(pthread_create, &flush_thread, NULL, flush_remaining_data, NULL);
+  // Wait until all the buffers handed off are written, including the ones
+  // outputs that fail meanwhile hand over to the others, unless numbering
+  // sequences, as whatever merges the outputs can't tell the last sequence
+  // of a stream is complete until it ends, so an output still writing may
+  // be waiting for the others to end
+  CHECK_ERRNO(pthread_mutex_lock, &in_flight_lock);
+  while (!SEQUENCE_NUMBERS &&
+         __atomic_load_n(&num_buffers_in_flight, __ATOMIC_SEQ_CST) > 0 &&
+         is_set(&data_should_flow_out))
+    CHECK_ERRNO(pthread_cond_wait, &all_buffers_written, &in_flight_lock);
+  CHECK_ERRNO(pthread_mutex_unlock, &in_flight_lock);
+  // Then let every output know no more buffers are coming, as none is
+  // attached once no data is flowing in
+  for (int i = 0; i < outputs->num_outputs; i++)
+    put_full_buffer_to(i, &end_of_stream);
   // Wait for all output threads to finish writing the buffers
   for (int i = 0; i < outputs->num_outputs; i++) {
     DEBUG("Waiting for %s and %d more output threads to finish",
           outputs->outputs[i].name, outputs->num_outputs - 1 - i);
     CHECK_ERRNO(pthread_join, output_threads[i], NULL);
   }
-  CHECK_ERRNO(pthread_cancel, flush_thread);
+  stop_control_server();
+  // which may leave behind buffers an output that failed handed over after
+  // the others ended, when not waited for
+  int num_buffers_lost = __atomic_load_n(&num_buffers_in_flight,
+                                         __ATOMIC_SEQ_CST);
+  if (num_buffers_lost > 0) {
+    fprintf(stderr, "%d buffers handed over after all outputs ended are "
+                    "lost\n", num_buffers_lost);
+    set_flag(&something_went_wrong, true);
+  }
 
   // Exit with non-zero status if something goes wrong
-  return something_went_wrong ? 1 : 0;
+  return is_set(&something_went_wrong) ? 1 : 0;
 }
@@ -6,5 +6,13 @@
 int mkmimo_multithreaded(Inputs *inputs, Outputs *outputs);
 
 #define DEFAULT_MULTIBUFFERING 2  // use double buffering by default
+#define DEFAULT_ZERO_COPY 0       // copy data through memory by default
+#define DEFAULT_LOCK_FREE 0       // hand off buffers with a mutex by default
+#define DEFAULT_WORK_STEALING 0   // share one pool of full buffers by default
+#define DEFAULT_SEQUENCE_NUMBERS 0  // no sequence headers by default
+#define DEFAULT_REORDER_WINDOW 0    // hand off records unordered by default
+#define DEFAULT_WRITEV_BATCH 1      // write one buffer at a time by default
+#define MAX_WRITEV_BATCH 64         // at most this many in a writev(2)
+#define DEFAULT_SLICE_SIZE 0        // hand off buffers whole by default
 
 #endif /* MKMIMO_MULTITHREADED_H */
@@ -15,6 +15,61 @@ static int POLL_TIMEOUT_MSEC = DEFAULT_POLL_TIMEOUT_MSEC;
 static int THROTTLE_SLEEP_USEC = DEFAULT_THROTTLE_SLEEP_USEC;
 static struct timespec THROTTLE_TIMESPEC;
 
+// whether to route buffers to the idle outputs draining fastest, and move
+// records away from stalled ones
+static int LEAST_LOADED = DEFAULT_LEAST_LOADED;
+static int STRAGGLER_TIMEOUT_USEC = DEFAULT_STRAGGLER_TIMEOUT_USEC;
+
+// whether to exit with an error, e.g., upon a record split by a failed output
+static bool something_went_wrong = false;
+
+// weight of the latest sample in the moving average of drain rates
+#define DRAIN_RATE_EWMA_WEIGHT 0.25
+// drain rate of a stalled output, i.e., a byte per second, so it stays
+// measured, and ranks below any output that wrote something
+#define MIN_DRAIN_RATE 1e-6
+
+static inline uint64_t clock_usec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/**
+ * Start measuring how fast the output drains the buffer just routed to it.
+ */
+static inline void start_draining(Output *output, uint64_t now) {
+  output->usec_routed = output->usec_progressed = now;
+  output->num_bytes_routed = output->buffer->size;
+}
+
+/**
+ * Fold how fast the output drained its buffer since it was routed into the
+ * exponentially weighted moving average of its drain rate, where the first
+ * sample is taken as it is.
+ */
+static inline void update_drain_rate(Output *output, int num_bytes_drained,
+                                     uint64_t now) {
+  uint64_t usec_elapsed = now - output->usec_routed;
+  double rate = (double)num_bytes_drained / (usec_elapsed ? usec_elapsed : 1);
+  if (rate < MIN_DRAIN_RATE) rate = MIN_DRAIN_RATE;
+  output->drain_rate =
+      !output->has_drain_rate
+          ? rate
+          : DRAIN_RATE_EWMA_WEIGHT * rate +
+                (1 - DRAIN_RATE_EWMA_WEIGHT) * output->drain_rate;
+  output->has_drain_rate = true;
+}
+
+/**
+ * Whether an output is expected to drain faster than another, where one yet
+ * to be measured is tried first.
+ */
+static inline bool drains_faster(Output *a, Output *b) {
+  if (!a->has_drain_rate) return b->has_drain_rate;
+  return b->has_drain_rate && a->drain_rate > b->drain_rate;
+}
+
 /*----------------------------------------------------------------------
  Portable function to set a socket into nonblocking mode.
  Calling this on a socket causes all future read() and write() calls on
@@ -26,7 +81,7 @@ static struct timespec THROTTLE_TIMESPEC;
 
  See: http://www.kegel.com/dkftpbench/nonblocking.html
 ----------------------------------------------------------------------*/
-static inline int setNonblocking(int fd) {
+int setNonblocking(int fd) {
   int flags;
 /* If they have O_NONBLOCK, use the Posix way to do it */
 #if defined(O_NONBLOCK)
@@ -45,8 +100,11 @@ static inline int setNonblocking(int fd) {
  * the sockets to be nonblocking.
  */
 static inline int initialize_ios(Inputs *inputs, Outputs *outputs) {
+  reserve_buffer_arena(inputs->num_inputs + outputs->num_outputs);
   for (int i = 0; i < inputs->num_inputs; i++) {
     inputs->inputs[i].buffer = new_buffer();
+    // regular files are mapped to hand off records right from the mapping
+    map_file(&inputs->inputs[i].mapped, inputs->inputs[i].fd);
 
     Input input = inputs->inputs[i];
     if (setNonblocking(input.fd) < 0) {
@@ -166,11 +224,29 @@ static inline int records_are_flowing_between(Inputs *inputs,
       if (p->events != 0) ++num_outputs_to_actually_poll;
     }
   }
+  // wake up in time to catch stragglers while some outputs are idle
+  int timeout_msec = POLL_TIMEOUT_MSEC;
+  if (LEAST_LOADED && outputs->num_busy > 0 &&
+      outputs->num_busy < outputs->num_outputs - outputs->num_closed) {
+    int straggler_timeout_msec = STRAGGLER_TIMEOUT_USEC / 1000 + 1;
+    if (timeout_msec < 0 || timeout_msec > straggler_timeout_msec)
+      timeout_msec = straggler_timeout_msec;
+  }
+  // and in time to hand off the batches that have waited long enough
+  for (int i = 0; i < num_inputs_to_poll; ++i) {
+    Input *input = &inputs->inputs[i];
+    if (!input->is_buffered) continue;
+    uint64_t usec_left = usec_left_to_batch(&input->sizing, input->buffer);
+    if (usec_left == 0) continue;  // waiting for an idle output instead
+    int batch_timeout_msec = (usec_left + 999) / 1000;
+    if (timeout_msec < 0 || timeout_msec > batch_timeout_msec)
+      timeout_msec = batch_timeout_msec;
+  }
   // use poll(2) to wait for any I/O events
   DEBUG("polling %d inputs and %d outputs", num_inputs_to_actually_poll,
         num_outputs_to_actually_poll);
   inputs->num_readable = outputs->num_writable = 0;
-  int num_events = poll(fds, num_fds_to_poll, POLL_TIMEOUT_MSEC);
+  int num_events = poll(fds, num_fds_to_poll, timeout_msec);
   if (num_events < 0) {
     perror("poll");
     return 0;
@@ -186,9 +262,10 @@ static inline int records_are_flowing_between(Inputs *inputs,
       } else {
         Output *output = &outputs->outputs[i - num_inputs_to_poll];
         // regard idle outputs as writable, and only check whether busy
-        // ones become writable
+        // ones become writable, or fail, e.g., as a pipe's reader is gone
         if ((output->is_writable =
-                 (!output->is_busy || !!(p->revents & (POLLOUT | POLLHUP)))))
+                 (!output->is_busy ||
+                  !!(p->revents & (POLLOUT | POLLHUP | POLLERR)))))
           ++outputs->num_writable;
       }
     }
@@ -230,13 +307,28 @@ static inline int read_from_available(Inputs *inputs) {
       Buffer *buf = input->buffer;
       // skip inputs whose buffer is full
       if (buf->size == buf->capacity) continue;
+      if (input->mapped.data != NULL) {
+        // point the empty buffer at the next records in the mapped file
+        int num_bytes_mapped = map_next_records(&input->mapped, buf);
+        DEBUG("%s: %d bytes mapped", input->name, num_bytes_mapped);
+        if (num_bytes_mapped > 0) {
+          STATS_ADD(&input->stats, num_bytes, num_bytes_mapped);
+          SET(input, buffered, 1);
+        } else {
+          if (num_bytes_mapped < 0) perrorf("read %s", input->name);
+          DEBUG("%s: input closed", input->name);
+          close(input->fd);
+          SET(input, closed, 1);
+        }
+        continue;
+      }
       int scan_end_of_record_down_to = buf->end_of_last_record + 1;
       // XXX optionally reading twice to detect the EOF earlier
       for (int num_reads = input->is_near_eof ? 2 : 1; num_reads > 0;
            --num_reads) {
         // read from the input to fill its buffer with at least one
         // record
-        int num_bytes_readable = buf->capacity - buf->size;
+        int num_bytes_readable = num_bytes_to_read(&input->sizing, buf);
         // skip reading if buffer is already full
         if (num_bytes_readable <= 0) {
           DEBUG("%s: buffer is full: %d used out of %d", input->name, buf->size,
@@ -247,6 +339,7 @@ static inline int read_from_available(Inputs *inputs) {
         int num_bytes_read = read(input->fd, buf->data + buf->begin + buf->size,
                                   num_bytes_readable);
         DEBUG("%s: %d bytes read", input->name, num_bytes_read);
+        count_syscall(&input->stats, num_bytes_read);
         if (num_bytes_read < 0) {
           if (errno == EAGAIN)
             // stop reading when input is exhausted
@@ -269,18 +362,20 @@ static inline int read_from_available(Inputs *inputs) {
           // read normally, reflect size increase
           buf->size += num_bytes_read;
         }
-        // find the last record separator in the buffer
-        // TODO use strrchr or a faster string matching algorithm
-        for (int j = buf->begin + buf->size - 1;
-             j >= scan_end_of_record_down_to; --j) {
-          char c = ((char *)buf->data)[j];
-          // TODO support user defined record delimiters
-          if (c == '\n') {
-            buf->end_of_last_record = j;
-            break;
-          }
-        }
+        // find the last record separator in the buffer, or close the input
+        // upon malformed records as upon errors, after the ones before
+        bool is_malformed =
+            find_end_of_last_record(buf, scan_end_of_record_down_to) < 0;
         DEBUG("%s: record ends at %d", input->name, buf->end_of_last_record);
+        adapt_block_size(&input->sizing, buf, num_bytes_read);
+        if (buf->end_of_last_record > -1) SET(input, buffered, 1);
+        if (is_malformed) {
+          perrorf("read %s", input->name);
+          DEBUG("%s: input closed due to malformed records", input->name);
+          close(input->fd);
+          SET(input, closed, 1);
+          break;
+        }
         if (buf->end_of_last_record > -1) {
           // stop reading if at least one record exists in the buffer
           SET(input, buffered, 1);
@@ -290,6 +385,7 @@ static inline int read_from_available(Inputs *inputs) {
           DEBUG("%s: doubling buffer size to %d bytes", input->name,
                 buf->capacity * 2);
           enlarge_buffer(buf, buf->capacity * 2);
+          STATS_ADD(&input->stats, num_growths, 1);
           // bound the next scan for end-of-record separator
           scan_end_of_record_down_to = buf->begin + buf->size;
         }
@@ -320,12 +416,20 @@ static inline int write_to_available(Outputs *outputs) {
       int num_bytes_written =
           write(output->fd, buf->data + buf->begin, num_bytes_writable);
       DEBUG("%s: wrote %d bytes", output->name, num_bytes_written);
+      count_syscall(&output->stats, num_bytes_written);
       if (num_bytes_written >= 0) {
         // normal write
         buf->begin += num_bytes_written;
         buf->size -= num_bytes_written;
+        if (LEAST_LOADED && num_bytes_written > 0) {
+          uint64_t now = output->usec_progressed = clock_usec();
+          if (buf->size == 0)
+            update_drain_rate(output, output->num_bytes_routed, now);
+        }
         if (buf->size == 0) {
           SET(output, busy, 0);
+          count_written_buffer(&output->stats, buf);
+          clear_buffer(buf);  // giving back any large block right away
         } else {
           SET(output, busy, 1);
           DEBUG("%s: %d bytes still left", output->name, buf->size);
@@ -342,7 +446,19 @@ static inline int write_to_available(Outputs *outputs) {
           DEBUG("%s: output closed due to error", output->name);
           close(output->fd);
           SET(output, closed, 1);
-          // XXX the buffer should be routed to another output
+          // the records not yet written are left to be rerouted to another
+          // output, which begin at the beginning of the buffer
+          // (See: reroute_records_of_closed_outputs)
+          if (FAILOVER && skip_written_records(buf, 0) < 0) {
+            fprintf(stderr, "%s: Failed in the middle of a record\n",
+                    output->name);
+            something_went_wrong = true;
+          } else if (FAILOVER && buf->size > 0) {
+            if (STATS_ENABLED) buf->num_records = count_records(buf);
+            continue;
+          }
+          SET(output, busy, 0);
+          clear_buffer(buf);
         }
       }
     }
@@ -351,6 +467,144 @@ static inline int write_to_available(Outputs *outputs) {
   return outputs->num_busy;
 }
 
+/**
+ * Whether an output should be preferred over another when routing records,
+ * i.e., the one further behind its share of bytes when outputs are weighted,
+ * or the one draining faster when LEAST_LOADED.
+ */
+static inline bool is_preferred(Outputs *outputs, Output *a, Output *b) {
+  if (outputs->are_weighted)
+    return a->bytes_routed_per_weight < b->bytes_routed_per_weight;
+  return LEAST_LOADED && drains_faster(a, b);
+}
+
+/**
+ * Charge the output for given bytes routed to it.
+ */
+static inline void charge_routed_bytes(Output *output, int num_bytes) {
+  output->bytes_routed_per_weight += (double)num_bytes / output->weight;
+}
+
+/**
+ * Find an output that isn't busy, i.e., whose buffer is free, taking turns,
+ * or the one preferred when outputs are weighted or LEAST_LOADED.
+ */
+static inline Output *find_idle_output(Outputs *outputs) {
+  Output *output = NULL;
+  bool should_compare = outputs->are_weighted || LEAST_LOADED;
+  // weighted outputs ahead of their share must wait for busy ones behind
+  double least_bytes_routed_per_weight = -1;
+  if (outputs->are_weighted)
+    for (int j = 0; j < outputs->num_outputs; ++j) {
+      Output *o = &outputs->outputs[j];
+      if (o->is_closed) continue;
+      if (least_bytes_routed_per_weight < 0 ||
+          o->bytes_routed_per_weight < least_bytes_routed_per_weight)
+        least_bytes_routed_per_weight = o->bytes_routed_per_weight;
+    }
+  for (int j = 0; j < outputs->num_outputs; ++j) {
+    Output *o = &outputs->outputs[(outputs->next_output + j) %
+                                  outputs->num_outputs];
+    if (o->is_busy || o->is_closed) continue;
+    if (outputs->are_weighted &&
+        o->bytes_routed_per_weight > least_bytes_routed_per_weight)
+      continue;
+    if (output == NULL || is_preferred(outputs, o, output)) output = o;
+    if (!should_compare) break;
+  }
+  if (output != NULL)
+    outputs->next_output =
+        (output - outputs->outputs + 1) % outputs->num_outputs;
+  return output;
+}
+
+/**
+ * Move the records a straggling output hasn't started writing to an idle
+ * output that drains faster.  The straggler keeps the record it's in the
+ * middle of writing, so no record is ever split.
+ */
+static inline int reassign_straggling_buffers(Outputs *outputs) {
+  int num_reassigned = 0;
+  uint64_t now = clock_usec();
+  for (int i = 0; i < outputs->num_outputs; ++i) {
+    if (outputs->num_busy == outputs->num_outputs - outputs->num_closed) break;
+    Output *straggler = &outputs->outputs[i];
+    if (!straggler->is_busy || straggler->is_closed) continue;
+    if (now - straggler->usec_progressed < STRAGGLER_TIMEOUT_USEC) continue;
+    Output *output = find_idle_output(outputs);
+    if (output == NULL) break;
+    if (straggler->has_drain_rate && !drains_faster(output, straggler))
+      continue;
+    // find where the record being written ends, walking from the beginning of
+    // the buffer as length prefixes can't be found otherwise
+    Buffer *buf = straggler->buffer;
+    int pos = 0, content_begin, content_end;
+    while (pos < buf->begin)
+      pos = find_record_at(buf, pos, &content_begin, &content_end);
+    int num_bytes_to_move = buf->begin + buf->size - pos;
+    if (num_bytes_to_move <= 0) continue;
+    DEBUG("reassigning %d bytes: %s > %s", num_bytes_to_move, straggler->name,
+          output->name);
+    // the straggler only gets slower in the eyes of the router
+    update_drain_rate(straggler, straggler->num_bytes_routed - buf->size, now);
+    Buffer *tgt = output->buffer;
+    clear_buffer(tgt);
+    if (tgt->capacity < num_bytes_to_move)
+      enlarge_buffer(tgt, num_bytes_to_move);
+    memcpy(tgt->data, buf->data + pos, num_bytes_to_move);
+    tgt->size = num_bytes_to_move;
+    buf->size -= num_bytes_to_move;
+    charge_routed_bytes(straggler, -num_bytes_to_move);
+    charge_routed_bytes(output, num_bytes_to_move);
+    if (STATS_ENABLED) {
+      tgt->num_records = count_records(tgt);
+      buf->num_records -= tgt->num_records;
+    }
+    if (buf->size == 0) {
+      SET_FLAG(outputs, straggler, busy, 0);
+      if (buf->begin > 0) count_written_buffer(&straggler->stats, buf);
+    } else {
+      start_draining(straggler, now);
+    }
+    SET(output, busy, 1);
+    start_draining(output, now);
+    ++num_reassigned;
+  }
+  DEBUG("reassigned %d straggling buffers", num_reassigned);
+  return num_reassigned;
+}
+
+/**
+ * Hand the records left by outputs closed due to an error over to idle ones,
+ * by swapping their buffers (See: FAILOVER).
+ */
+static inline int reroute_records_of_closed_outputs(Outputs *outputs) {
+  int num_rerouted = 0;
+  if (outputs->num_closed == outputs->num_outputs) {
+    // no output is left to take over any records
+    something_went_wrong = true;
+    return 0;
+  }
+  for (int i = 0; i < outputs->num_outputs; ++i) {
+    Output *closed = &outputs->outputs[i];
+    if (!closed->is_closed || !closed->is_busy) continue;
+    Output *output = find_idle_output(outputs);
+    if (output == NULL) break;
+    DEBUG("rerouting %d bytes: %s > %s", closed->buffer->size, closed->name,
+          output->name);
+    Buffer *buf = closed->buffer;
+    closed->buffer = output->buffer;
+    output->buffer = buf;
+    SET_FLAG(outputs, closed, busy, 0);
+    SET(output, busy, 1);
+    if (LEAST_LOADED) start_draining(output, clock_usec());
+    charge_routed_bytes(output, buf->size);
+    ++num_rerouted;
+  }
+  DEBUG("rerouted %d buffers of closed outputs", num_rerouted);
+  return num_rerouted;
+}
+
 static inline int exchange_buffered_records(Inputs *inputs, Outputs *outputs) {
   int num_exchanges = 0;
   // every buffered input should swap its buffer with an idle output
@@ -367,16 +621,11 @@ static inline int exchange_buffered_records(Inputs *inputs, Outputs *outputs) {
     // find an input whose buffer contains records
     Input *input = &inputs->inputs[i];
     if (!input->is_buffered) continue;
+    // let the input batch more records unless it's closed
+    if (!input->is_closed && usec_left_to_batch(&input->sizing, input->buffer))
+      continue;
     // find an output that isn't busy, i.e., whose buffer is free
-    Output *output = NULL;
-    for (int j = 0; j < outputs->num_outputs; ++j) {
-      Output *o = &outputs->outputs[outputs->next_output];
-      ++outputs->next_output;
-      outputs->next_output %= outputs->num_outputs;
-      if (o->is_busy) continue;
-      output = o;
-      break;
-    }
+    Output *output = find_idle_output(outputs);
     // stop if no idle output can be found
     if (output == NULL) continue;
     DEBUG("routing %d bytes: %s > %s",
@@ -389,23 +638,23 @@ static inline int exchange_buffered_records(Inputs *inputs, Outputs *outputs) {
     output->buffer = buf;
 
     // Reset input buffer
-    input->buffer->size = 0;
-    input->buffer->begin = 0;
-    input->buffer->end_of_last_record = -1;
+    clear_buffer(input->buffer);
 
     // Make sure the trailing bytes at the end of input's buffer isn't lost
     move_trailing_data_after_last_record(input->buffer, output->buffer);
+    count_submitted_buffer(&input->stats, output->buffer);
     // now, mark the input as holding an incomplete buffer
     SET(input, buffered, 0);
+    start_next_batch(&input->sizing);
     // and mark the output as busy
     SET(output, busy, 1);
+    if (LEAST_LOADED) start_draining(output, clock_usec());
+    charge_routed_bytes(output, output->buffer->size);
     // keep track of the number of exchanges
     ++num_exchanges;
   }
-  // TODO any closed but busy output's buffer should be swapped with another
-  // idle output
-  // TODO similarly a straggler output's buffer could be reallocated to
-  // another faster one
+  // (See: reroute_records_of_closed_outputs for closed outputs, and
+  // reassign_straggling_buffers for straggler outputs)
   DEBUG("exchanged %d input-output pairs", num_exchanges);
   return num_exchanges;
 }
@@ -465,6 +714,10 @@ static inline void parse_environ(void) {
   // prepare nanosleep's timespec for throttling
   THROTTLE_TIMESPEC.tv_sec = THROTTLE_SLEEP_USEC / 1000000;
   THROTTLE_TIMESPEC.tv_nsec = (THROTTLE_SLEEP_USEC % 1000000) * 1000;
+  readIntFromEnv(LEAST_LOADED, LEAST_LOADED, LEAST_LOADED >= 0,
+                 DEFAULT_LEAST_LOADED);
+  readIntFromEnv(STRAGGLER_TIMEOUT_USEC, STRAGGLER_TIMEOUT_USEC,
+                 STRAGGLER_TIMEOUT_USEC >= 0, DEFAULT_STRAGGLER_TIMEOUT_USEC);
 }
 
 int mkmimo_nonblocking(Inputs *inputs, Outputs *outputs) {
@@ -481,13 +734,18 @@ int mkmimo_nonblocking(Inputs *inputs, Outputs *outputs) {
 #endif
   signal(SIGUSR1, print_state);
 
-  while (records_are_flowing_between(inputs, outputs)) {
+  while (!something_went_wrong &&
+         records_are_flowing_between(inputs, outputs)) {
     write_to_available(outputs);
+    if (FAILOVER && reroute_records_of_closed_outputs(outputs) > 0)
+      write_to_available(outputs);
     if (read_from_available(inputs) > 0)
       while (exchange_buffered_records(inputs, outputs) > 0)
         write_to_available(outputs);
+    if (LEAST_LOADED && reassign_straggling_buffers(outputs) > 0)
+      write_to_available(outputs);
     DEBUG("%s", "----------------------------------------");
   }
 
-  return 0;
+  return something_went_wrong ? 1 : 0;
 }
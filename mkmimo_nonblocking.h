@@ -10,6 +10,9 @@
 
 int mkmimo_nonblocking(Inputs *inputs, Outputs *outputs);
 
+// sets given file descriptor to do only nonblocking I/O
+int setNonblocking(int fd);
+
 // when POLLHUP support is unreliable, use a timeout to detect input EOFs
 #ifdef POLLHUP_SUPPORT_UNRELIABLE
 #define DEFAULT_POLL_TIMEOUT_MSEC 1000 /* msec */
@@ -21,4 +24,12 @@ int mkmimo_nonblocking(Inputs *inputs, Outputs *outputs);
 // instead of busy waiting
 #define DEFAULT_THROTTLE_SLEEP_USEC 1
 
+// route buffers round-robin to idle outputs by default, instead of to the
+// ones draining fastest
+#define DEFAULT_LEAST_LOADED 0
+
+// number of microseconds an output can go without writing anything before
+// the records it hasn't started writing are moved to a faster idle output
+#define DEFAULT_STRAGGLER_TIMEOUT_USEC 10000
+
 #endif /* MKMIMO_NONBLOCKING_H */
@@ -0,0 +1,481 @@
+#define _DEFAULT_SOURCE  // for syscall(2) and MAP_POPULATE
+#include "mkmimo_uring.h"
+#include "mkmimo_epoll.h"
+#include "mkmimo_nonblocking.h"
+#include "queue.h"
+
+#ifdef URING_SUPPORTED
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+// maximum number of submission queue entries of the ring
+static int URING_ENTRIES = DEFAULT_URING_ENTRIES;
+
+/**
+ * A minimal io_uring(7) set up with raw system calls, so no liburing is
+ * needed.
+ */
+static struct {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned sq_entries;
+  unsigned cq_entries;
+  unsigned sq_tail_to_submit;  // Local tail not yet seen by the kernel
+  unsigned num_to_submit;      // Num entries prepared but not submitted
+  unsigned num_in_flight;      // Num entries submitted but not completed
+} ring;
+
+/**
+ * Lists of inputs/outputs, so every step only visits the ones that can make
+ * progress.  Inputs that have a read in flight are marked readable, and
+ * outputs that have a write in flight are marked writable.
+ */
+static Queue *reads_to_submit;   // open inputs w/o complete records
+static Queue *buffered_inputs;   // inputs holding complete records
+static Queue *idle_outputs;      // open outputs with empty buffers
+static Queue *writes_to_submit;  // busy outputs w/o writes in flight
+
+/**
+ * Inputs and outputs are distinguished in the user_data of each entry by their
+ * indexes, where outputs come after all inputs.
+ */
+static Inputs *all_inputs;
+static Outputs *all_outputs;
+
+// whether to exit with an error, e.g., upon records lost with a failed output
+static bool something_went_wrong;
+
+static inline int setup_ring(unsigned sq_entries, unsigned cq_entries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  // with a completion for every stream, since each has at most one I/O in
+  // flight, however few submission entries there are
+  p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+  p.cq_entries = cq_entries > sq_entries ? cq_entries : sq_entries;
+  ring.fd = syscall(__NR_io_uring_setup, sq_entries, &p);
+  if (ring.fd < 0) return -1;
+  // reading at the current file position is necessary for regular files
+  if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+    close(ring.fd);
+    errno = ENOSYS;
+    return -1;
+  }
+  // map the submission/completion rings and the submission entries
+  size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cq_size > sq_size) sq_size = cq_size;
+    cq_size = sq_size;
+  }
+  void *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED) return -1;
+  void *cq = sq;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              ring.fd, IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED) return -1;
+  }
+  ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+                   IORING_OFF_SQES);
+  if (ring.sqes == MAP_FAILED) return -1;
+  ring.sq_head = sq + p.sq_off.head;
+  ring.sq_tail = sq + p.sq_off.tail;
+  ring.sq_mask = sq + p.sq_off.ring_mask;
+  ring.sq_array = sq + p.sq_off.array;
+  ring.cq_head = cq + p.cq_off.head;
+  ring.cq_tail = cq + p.cq_off.tail;
+  ring.cq_mask = cq + p.cq_off.ring_mask;
+  ring.cqes = cq + p.cq_off.cqes;
+  ring.sq_entries = p.sq_entries;
+  ring.cq_entries = p.cq_entries;
+  ring.sq_tail_to_submit = *ring.sq_tail;
+  ring.num_to_submit = ring.num_in_flight = 0;
+  return 0;
+}
+
+/**
+ * Submit all prepared entries to the kernel, and wait for given number of
+ * completions.
+ */
+static inline int submit_and_wait(unsigned min_complete) {
+  __atomic_store_n(ring.sq_tail, ring.sq_tail_to_submit, __ATOMIC_RELEASE);
+  for (;;) {
+    int num_submitted = syscall(
+        __NR_io_uring_enter, ring.fd, ring.num_to_submit, min_complete,
+        min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (num_submitted < 0) {
+      if (errno == EINTR) continue;
+      perror("io_uring_enter");
+      return -1;
+    }
+    DEBUG("submitted %d entries", num_submitted);
+    ring.num_to_submit -= num_submitted;
+    ring.num_in_flight += num_submitted;
+    return num_submitted;
+  }
+}
+
+/**
+ * Get a cleared submission entry, submitting the prepared ones if the ring is
+ * full.
+ */
+static inline struct io_uring_sqe *next_sqe(void) {
+  while (ring.sq_tail_to_submit -
+             __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >=
+         ring.sq_entries)
+    if (submit_and_wait(0) < 0) abort();
+  unsigned index = ring.sq_tail_to_submit & *ring.sq_mask;
+  struct io_uring_sqe *sqe = &ring.sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring.sq_array[index] = index;
+  ++ring.sq_tail_to_submit;
+  ++ring.num_to_submit;
+  return sqe;
+}
+
+/**
+ * Whether another I/O can be submitted without overflowing the completion
+ * queue, which may be smaller than the number of streams when clamped.
+ */
+static inline bool has_room_for_completion(void) {
+  return ring.num_in_flight + ring.num_to_submit < ring.cq_entries;
+}
+
+/**
+ * Prepare a read or write entry, using the registered memory of the buffer if
+ * possible to save the kernel from mapping pages on every I/O.
+ */
+static inline void prep_rw(int fixed_opcode, int opcode, int fd, Buffer *buf,
+                           void *addr, unsigned len, __u64 user_data) {
+  struct io_uring_sqe *sqe = next_sqe();
+  // registered memory doesn't cover a large block the buffer has outgrown into
+  if (buf->fixed_index >= 0 && buf->data == buf->own_data) {
+    sqe->opcode = fixed_opcode;
+    sqe->buf_index = buf->fixed_index;
+  } else {
+    sqe->opcode = opcode;
+  }
+  sqe->fd = fd;
+  sqe->addr = (unsigned long)addr;
+  sqe->len = len;
+  sqe->off = (__u64)-1;  // at the current file position
+  sqe->user_data = user_data;
+}
+
+/**
+ * Register the memory of all buffers to the kernel.  It's fine to proceed
+ * without them, e.g., when the locked memory limit is too low.
+ */
+static inline void register_buffers(Inputs *inputs, Outputs *outputs) {
+  int num_buffers = inputs->num_inputs + outputs->num_outputs;
+  struct iovec *iovecs = calloc(num_buffers, sizeof(struct iovec));
+  for (int i = 0; i < num_buffers; ++i) {
+    Buffer *buf = i < inputs->num_inputs
+                      ? inputs->inputs[i].buffer
+                      : outputs->outputs[i - inputs->num_inputs].buffer;
+    iovecs[i].iov_base = buf->data;
+    iovecs[i].iov_len = buf->capacity;
+  }
+  if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iovecs,
+              num_buffers) < 0) {
+    DEBUG("%s", "proceeding without registered buffers");
+  } else {
+    for (int i = 0; i < num_buffers; ++i) {
+      Buffer *buf = i < inputs->num_inputs
+                        ? inputs->inputs[i].buffer
+                        : outputs->outputs[i - inputs->num_inputs].buffer;
+      buf->fixed_index = i;
+    }
+  }
+  free(iovecs);
+}
+
+/**
+ * Set up the ring and initialize an empty buffer for each input and output.
+ */
+static inline int initialize_ios(Inputs *inputs, Outputs *outputs) {
+  int num_ios = inputs->num_inputs + outputs->num_outputs;
+  int num_sq_entries = num_ios < URING_ENTRIES ? num_ios : URING_ENTRIES;
+  if (setup_ring(num_sq_entries, num_ios) < 0) return 1;
+  reads_to_submit = new_queue();
+  buffered_inputs = new_queue();
+  idle_outputs = new_queue();
+  writes_to_submit = new_queue();
+  all_inputs = inputs;
+  all_outputs = outputs;
+  reserve_buffer_arena(num_ios);
+  for (int i = 0; i < inputs->num_inputs; i++) {
+    Input *input = &inputs->inputs[i];
+    input->buffer = new_buffer();
+    queue(reads_to_submit, input);
+  }
+  for (int i = 0; i < outputs->num_outputs; i++) {
+    Output *output = &outputs->outputs[i];
+    output->buffer = new_buffer();
+    queue(idle_outputs, output);
+  }
+  register_buffers(inputs, outputs);
+  return 0;
+}
+
+static inline int records_are_flowing_between(Inputs *inputs,
+                                              Outputs *outputs) {
+  // we can be sure no data will flow if all of the following holds:
+  if (
+      // 1. all inputs are closed
+      inputs->num_closed == inputs->num_inputs &&
+      // 2. no data is sitting in input buffers
+      inputs->num_buffered == 0 &&
+      // 3. no data is pending in output buffers
+      outputs->num_busy == 0) {
+    DEBUG("%s", "no data flow possible");
+    return 0;
+  } else if (outputs->num_closed == outputs->num_outputs) {
+    DEBUG("%s", "all outputs closed, no data flow possible");
+    return 0;
+  } else
+    DEBUG(
+        "%d open inputs, %d buffered inputs, %d open outputs, %d busy "
+        "outputs",
+        inputs->num_inputs - inputs->num_closed, inputs->num_buffered,
+        outputs->num_outputs - outputs->num_closed, outputs->num_busy);
+  return 1;
+}
+
+/**
+ * Submit reads for all inputs and writes for all outputs that can make
+ * progress in a single batch, then wait for any of them to complete.  The
+ * rest wait for their turn if the completion queue can't take them all.
+ */
+static inline int submit_reads_and_writes(Inputs *inputs, Outputs *outputs) {
+  while (!is_empty(reads_to_submit) && has_room_for_completion()) {
+    Input *input = dequeue(reads_to_submit);
+    Buffer *buf = input->buffer;
+    DEBUG("%s: reading %d bytes", input->name, buf->capacity - buf->size);
+    prep_rw(IORING_OP_READ_FIXED, IORING_OP_READ, input->fd, buf,
+            buf->data + buf->begin + buf->size, buf->capacity - buf->size,
+            input - inputs->inputs);
+    SET(input, readable, 1);
+  }
+  while (!is_empty(writes_to_submit) && has_room_for_completion()) {
+    Output *output = dequeue(writes_to_submit);
+    Buffer *buf = output->buffer;
+    DEBUG("%s: writing %d bytes", output->name, buf->size);
+    prep_rw(IORING_OP_WRITE_FIXED, IORING_OP_WRITE, output->fd, buf,
+            buf->data + buf->begin, buf->size,
+            inputs->num_inputs + (output - outputs->outputs));
+    SET(output, writable, 1);
+  }
+  return submit_and_wait(ring.num_in_flight + ring.num_to_submit > 0 ? 1 : 0);
+}
+
+static inline void mark_buffered(Inputs *inputs, Input *input) {
+  SET(input, buffered, 1);
+  queue(buffered_inputs, input);
+}
+
+static inline void close_input(Inputs *inputs, Input *input) {
+  close(input->fd);
+  SET(input, closed, 1);
+  // pass along any trailing bytes without a record separator as the last
+  // record since no more data can follow it
+  Buffer *buf = input->buffer;
+  if (buf->size > 0) {
+    buf->end_of_last_record = buf->begin + buf->size - 1;
+    mark_buffered(inputs, input);
+  }
+}
+
+static inline void complete_read(Inputs *inputs, Input *input,
+                                 int num_bytes_read) {
+  SET(input, readable, 0);
+  Buffer *buf = input->buffer;
+  DEBUG("%s: %d bytes read", input->name, num_bytes_read);
+  // completions carry the negated errno instead of setting it
+  if (num_bytes_read < 0) errno = -num_bytes_read;
+  count_syscall(&input->stats, num_bytes_read);
+  if (num_bytes_read < 0) {
+    if (num_bytes_read == -EAGAIN || num_bytes_read == -EINTR) {
+      // simply try again
+      queue(reads_to_submit, input);
+    } else {
+      // close the input on other errors
+      perrorf("read %s", input->name);
+      DEBUG("%s: input closed due to error", input->name);
+      close_input(inputs, input);
+    }
+    return;
+  } else if (num_bytes_read == 0) {
+    // EOF reached, close the input
+    DEBUG("%s: input closed", input->name);
+    close_input(inputs, input);
+    return;
+  }
+  // read normally, reflect size increase
+  int scan_end_of_record_down_to = buf->begin + buf->size;
+  buf->size += num_bytes_read;
+  // find the last record separator in the newly read bytes, or close the
+  // input upon malformed records as upon errors, after the ones before
+  if (find_end_of_last_record(buf, scan_end_of_record_down_to) < 0) {
+    perrorf("read %s", input->name);
+    close_input(inputs, input);
+    return;
+  }
+  DEBUG("%s: record ends at %d", input->name, buf->end_of_last_record);
+  if (buf->end_of_last_record > -1) {
+    // stop reading until the buffer is exchanged
+    mark_buffered(inputs, input);
+  } else {
+    if (buf->size == buf->capacity) {
+      // enlarge the buffer so a record that is larger than the current buffer
+      // capacity can be read
+      DEBUG("%s: doubling buffer size to %d bytes", input->name,
+            buf->capacity * 2);
+      enlarge_buffer(buf, buf->capacity * 2);
+      STATS_ADD(&input->stats, num_growths, 1);
+    }
+    queue(reads_to_submit, input);
+  }
+}
+
+static inline void complete_write(Outputs *outputs, Output *output,
+                                  int num_bytes_written) {
+  SET(output, writable, 0);
+  Buffer *buf = output->buffer;
+  DEBUG("%s: wrote %d bytes", output->name, num_bytes_written);
+  if (num_bytes_written < 0) errno = -num_bytes_written;
+  count_syscall(&output->stats, num_bytes_written);
+  if (num_bytes_written < 0) {
+    if (num_bytes_written == -EAGAIN || num_bytes_written == -EINTR) {
+      // simply try again
+      queue(writes_to_submit, output);
+    } else {
+      // something went wrong
+      perrorf("write %s", output->name);
+      DEBUG("%s: output closed due to error", output->name);
+      close(output->fd);
+      SET(output, closed, 1);
+      SET(output, busy, 0);
+      // XXX the buffer should be routed to another output, but is lost, and
+      // a failed write doesn't reliably raise SIGPIPE here, so it's told
+      something_went_wrong = true;
+    }
+    return;
+  }
+  // normal write
+  buf->begin += num_bytes_written;
+  buf->size -= num_bytes_written;
+  if (buf->size > 0) {
+    DEBUG("%s: %d bytes still left", output->name, buf->size);
+    queue(writes_to_submit, output);
+  } else {
+    // output becomes idle once all buffered data is written
+    SET(output, busy, 0);
+    count_written_buffer(&output->stats, buf);
+    clear_buffer(buf);  // giving back any large block right away
+    queue(idle_outputs, output);
+  }
+}
+
+/**
+ * Reap all completed reads and writes together.
+ */
+static inline int reap_completions(Inputs *inputs, Outputs *outputs) {
+  unsigned head = *ring.cq_head;
+  unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+  int num_completions = tail - head;
+  for (; head != tail; ++head) {
+    struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+    if (cqe->user_data < inputs->num_inputs)
+      complete_read(inputs, &inputs->inputs[cqe->user_data], cqe->res);
+    else
+      complete_write(outputs,
+                     &outputs->outputs[cqe->user_data - inputs->num_inputs],
+                     cqe->res);
+  }
+  __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+  ring.num_in_flight -= num_completions;
+  DEBUG("reaped %d completions", num_completions);
+  return num_completions;
+}
+
+static inline int exchange_buffered_records(Inputs *inputs, Outputs *outputs) {
+  int num_exchanges = 0;
+  // every buffered input should swap its buffer with an idle output
+  while (!is_empty(buffered_inputs) && !is_empty(idle_outputs)) {
+    Input *input = dequeue(buffered_inputs);
+    Output *output = dequeue(idle_outputs);
+    DEBUG("routing %d bytes: %s > %s",
+          input->buffer->end_of_last_record + 1 - input->buffer->begin,
+          input->name, output->name);
+
+    // Swap buffers between the buffered input and the idle output
+    Buffer *buf = input->buffer;
+    input->buffer = output->buffer;
+    output->buffer = buf;
+
+    // Reset input buffer
+    clear_buffer(input->buffer);
+
+    // Make sure the trailing bytes at the end of input's buffer isn't lost
+    move_trailing_data_after_last_record(input->buffer, output->buffer);
+    count_submitted_buffer(&input->stats, output->buffer);
+    // now, mark the input as holding an incomplete buffer to read more into
+    SET(input, buffered, 0);
+    if (!input->is_closed) queue(reads_to_submit, input);
+    // and mark the output as busy
+    SET(output, busy, 1);
+    queue(writes_to_submit, output);
+    // keep track of the number of exchanges
+    ++num_exchanges;
+  }
+  DEBUG("exchanged %d input-output pairs", num_exchanges);
+  return num_exchanges;
+}
+
+static inline void parse_environ(void) {
+  readIntFromEnv(URING_ENTRIES, URING_ENTRIES, URING_ENTRIES > 0,
+                 DEFAULT_URING_ENTRIES);
+}
+
+/**
+ * io_uring(7) implementation of mkmimo
+ */
+int mkmimo_uring(Inputs *inputs, Outputs *outputs) {
+  parse_environ();
+  if (initialize_ios(inputs, outputs)) {
+    // fall back when io_uring is unavailable, e.g., old or restricted kernels
+    DEBUG("io_uring unavailable (%s), falling back", strerror(errno));
+#ifdef EPOLL_SUPPORTED
+    return mkmimo_epoll(inputs, outputs);
+#else
+    return mkmimo_nonblocking(inputs, outputs);
+#endif
+  }
+
+  while (records_are_flowing_between(inputs, outputs)) {
+    if (submit_reads_and_writes(inputs, outputs) < 0) return 1;
+    reap_completions(inputs, outputs);
+    exchange_buffered_records(inputs, outputs);
+    DEBUG("%s", "----------------------------------------");
+  }
+
+  close(ring.fd);
+  return something_went_wrong ? 1 : 0;
+}
+
+#else
+
+int mkmimo_uring(Inputs *inputs, Outputs *outputs) {
+  // fall back when io_uring is unsupported
+  return mkmimo_nonblocking(inputs, outputs);
+}
+
+#endif /* URING_SUPPORTED */
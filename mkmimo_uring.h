@@ -0,0 +1,18 @@
+#ifndef MKMIMO_URING_H
+#define MKMIMO_URING_H
+
+#ifdef __linux__
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+#define URING_SUPPORTED
+#endif
+#endif
+
+#include "mkmimo.h"
+
+int mkmimo_uring(Inputs *inputs, Outputs *outputs);
+
+// maximum number of submission queue entries of the ring
+#define DEFAULT_URING_ENTRIES 4096
+
+#endif /* MKMIMO_URING_H */
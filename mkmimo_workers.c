@@ -0,0 +1,584 @@
+#include "mkmimo_workers.h"
+#include "mkmimo_epoll.h"
+#include "mkmimo_multithreaded.h"
+#include "mkmimo_nonblocking.h"
+#include "queue.h"
+
+#ifdef EPOLL_SUPPORTED
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/**
+ * Parameters
+ */
+static int NUM_WORKERS = DEFAULT_NUM_WORKERS;
+static int MULTIBUFFERING = DEFAULT_MULTIBUFFERING;
+static int EPOLL_MAX_EVENTS = DEFAULT_EPOLL_MAX_EVENTS;
+
+// epoll_event data of the eventfd that wakes up a worker
+#define WAKEUP_EVENT UINT64_MAX
+
+/**
+ * A worker thread multiplexes a fixed subset of the inputs and outputs with
+ * its own epoll(7) instance.
+ */
+typedef struct worker {
+  int index;
+  pthread_t thread;
+  int epoll_fd;
+  int wakeup_fd;  // eventfd(2) for other workers to wake this one up
+  struct epoll_event *events;
+  int max_events;
+  int num_inputs;
+  int num_inputs_done;  // Closed inputs whose records were all submitted
+  int num_outputs;
+  int num_outputs_closed;
+  // what the worker waits for while sleeping, set atomically
+  bool is_waiting_for_full_buffers;
+  bool is_waiting_for_empty_buffers;
+  // ready lists, so every step only visits the inputs/outputs that can make
+  // progress instead of scanning all of them
+  Queue *readable_inputs;   // readable inputs with room in their buffer
+  Queue *buffered_inputs;   // inputs holding complete records
+  Queue *idle_outputs;      // open outputs without buffers
+  Queue *writable_outputs;  // busy outputs not known to block on write
+} Worker;
+
+static Worker *workers;
+static int num_workers;
+
+/**
+ * Inputs and outputs are distinguished in the epoll_event data by their
+ * indexes, where outputs come after all inputs.
+ */
+static Inputs *all_inputs;
+static Outputs *all_outputs;
+
+/**
+ * Buffer pools shared by all workers
+ */
+static Queue *full_buffers;
+static Queue *empty_buffers;
+
+/**
+ * Number of inputs/outputs still open across all workers, updated atomically
+ */
+static int num_inputs_open;
+static int num_outputs_open;
+
+/**
+ * Number of full buffers submitted but not yet written, including the ones
+ * resubmitted by outputs that failed, held by busy outputs of any worker, so
+ * no worker stops while another may still hand one back, updated atomically
+ */
+static int num_buffers_in_flight;
+
+// whether to exit with an error, e.g., upon a record split by a failed output
+static bool something_went_wrong;
+
+static inline void wake_up(Worker *w) {
+  if (eventfd_write(w->wakeup_fd, 1) < 0) perror("eventfd_write");
+}
+
+static inline void wake_up_all_workers(void) {
+  for (int i = 0; i < num_workers; ++i) wake_up(&workers[i]);
+}
+
+/**
+ * Put a full buffer to the shared pool and wake up the workers waiting for
+ * one.  The fence pairs with the one in wait_for_events(), so either the
+ * worker finds the buffer in the pool or this finds the worker waiting.
+ */
+static inline void put_full_buffer(Buffer *buf) {
+  queue_and_signal(full_buffers, buf);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for (int i = 0; i < num_workers; ++i)
+    if (__atomic_exchange_n(&workers[i].is_waiting_for_full_buffers, false,
+                            __ATOMIC_RELAXED))
+      wake_up(&workers[i]);
+}
+
+static inline void put_empty_buffer(Buffer *buf) {
+  clear_buffer(buf);  // giving back any large block right away
+  queue_and_signal(empty_buffers, buf);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for (int i = 0; i < num_workers; ++i)
+    if (__atomic_exchange_n(&workers[i].is_waiting_for_empty_buffers, false,
+                            __ATOMIC_RELAXED))
+      wake_up(&workers[i]);
+}
+
+/**
+ * Arm the output to be notified once when it becomes writable again.
+ */
+static inline void rearm_output(Worker *w, Output *output) {
+  struct epoll_event ev = {
+      .events = EPOLLOUT | EPOLLET | EPOLLONESHOT,
+      .data.u64 = all_inputs->num_inputs + (output - all_outputs->outputs),
+  };
+  if (epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, output->fd, &ev) < 0) {
+    // outputs that cannot be polled, e.g., regular files, never block, so
+    // simply regard them writable again
+    DEBUG("%s: cannot be polled, regarding as writable", output->name);
+    output->is_writable = 1;
+  }
+}
+
+/**
+ * Assign every input and output to a worker in turn, set all of them to be
+ * nonblocking, and register them to the epoll of their worker only once.
+ */
+static inline int initialize_workers(Inputs *inputs, Outputs *outputs) {
+  int num_streams = inputs->num_inputs + outputs->num_outputs;
+  num_workers = NUM_WORKERS > 0 ? NUM_WORKERS : sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_workers < 1) num_workers = 1;
+  if (num_workers > num_streams) num_workers = num_streams;
+  workers = calloc(num_workers, sizeof(Worker));
+  all_inputs = inputs;
+  all_outputs = outputs;
+
+  full_buffers = new_queue();
+  empty_buffers = new_queue();
+  MULTIBUFFERING = cap_multibuffering(MULTIBUFFERING, num_streams);
+  int num_buffers = MULTIBUFFERING * num_streams;
+  DEBUG("Creating %d empty buffers", num_buffers);
+  reserve_buffer_arena(num_buffers);
+  for (int i = 0; i < num_buffers; ++i) queue(empty_buffers, new_buffer());
+  num_inputs_open = inputs->num_inputs;
+  num_outputs_open = outputs->num_outputs;
+
+  for (int i = 0; i < num_workers; ++i) {
+    Worker *w = &workers[i];
+    w->index = i;
+    w->epoll_fd = epoll_create1(0);
+    if (w->epoll_fd < 0) {
+      perror("epoll_create1");
+      return 1;
+    }
+    w->wakeup_fd = eventfd(0, EFD_NONBLOCK);
+    struct epoll_event ev = {.events = EPOLLIN, .data.u64 = WAKEUP_EVENT};
+    if (w->wakeup_fd < 0 ||
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->wakeup_fd, &ev) < 0) {
+      perror("eventfd");
+      return 1;
+    }
+    w->readable_inputs = new_queue();
+    w->buffered_inputs = new_queue();
+    w->idle_outputs = new_queue();
+    w->writable_outputs = new_queue();
+  }
+
+  // inputs and outputs are assigned in turn, so every worker gets as many
+  for (int i = 0; i < inputs->num_inputs; i++) {
+    Worker *w = &workers[i % num_workers];
+    Input *input = &inputs->inputs[i];
+    input->buffer = dequeue(empty_buffers);
+    if (setNonblocking(input->fd) < 0) {
+      perrorf("setNonblocking %s", input->name);
+      return 1;
+    }
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLET, .data.u64 = i};
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, input->fd, &ev) < 0) {
+      if (errno != EPERM) {
+        perrorf("epoll_ctl %s", input->name);
+        return 1;
+      }
+      // regular files cannot be polled but are always readable
+      DEBUG("%s: cannot be polled, regarding as always readable", input->name);
+    }
+    ++w->num_inputs;
+    // every input is readable until read(2) says otherwise
+    input->is_readable = 1;
+    queue(w->readable_inputs, input);
+  }
+
+  for (int i = 0; i < outputs->num_outputs; i++) {
+    Worker *w = &workers[(inputs->num_inputs + i) % num_workers];
+    Output *output = &outputs->outputs[i];
+    if (setNonblocking(output->fd) < 0) {
+      perrorf("setNonblocking %s", output->name);
+      return 2;
+    }
+    // outputs are armed only after they become busy (See: rearm_output)
+    struct epoll_event ev = {.events = EPOLLET | EPOLLONESHOT,
+                             .data.u64 = inputs->num_inputs + i};
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, output->fd, &ev) < 0 &&
+        errno != EPERM) {
+      perrorf("epoll_ctl %s", output->name);
+      return 2;
+    }
+    ++w->num_outputs;
+    queue(w->idle_outputs, output);
+    // every idle output is writable until write(2) says otherwise
+    output->is_writable = 1;
+  }
+
+  for (int i = 0; i < num_workers; ++i) {
+    Worker *w = &workers[i];
+    w->max_events = w->num_inputs + w->num_outputs + 1;
+    if (w->max_events > EPOLL_MAX_EVENTS) w->max_events = EPOLL_MAX_EVENTS;
+    w->events = calloc(w->max_events, sizeof(struct epoll_event));
+  }
+  return 0;
+}
+
+/**
+ * Whether the worker is done, i.e., all its inputs have been submitted, and
+ * its outputs are closed, or no more full buffers are to come from any input
+ * or output of all workers.
+ */
+static inline bool worker_is_done(Worker *w) {
+  if (__atomic_load_n(&num_outputs_open, __ATOMIC_SEQ_CST) == 0) {
+    DEBUG("worker %d: all outputs closed, no data flow possible", w->index);
+    return true;
+  }
+  if (w->num_inputs_done < w->num_inputs) return false;
+  if (w->num_outputs_closed == w->num_outputs) return true;
+  return __atomic_load_n(&num_inputs_open, __ATOMIC_SEQ_CST) == 0 &&
+         __atomic_load_n(&num_buffers_in_flight, __ATOMIC_SEQ_CST) == 0;
+}
+
+/**
+ * Count a buffer written, letting idle outputs of all workers find out once
+ * no more buffers will come.
+ */
+static inline void retire_full_buffer(Buffer *buf) {
+  put_empty_buffer(buf);
+  if (__atomic_sub_fetch(&num_buffers_in_flight, 1, __ATOMIC_SEQ_CST) == 0 &&
+      __atomic_load_n(&num_inputs_open, __ATOMIC_SEQ_CST) == 0)
+    wake_up_all_workers();
+}
+
+/**
+ * Release the last buffer of an input whose records were all submitted.
+ */
+static inline void finish_input(Worker *w, Input *input) {
+  DEBUG("worker %d: %s done", w->index, input->name);
+  put_empty_buffer(input->buffer);
+  input->buffer = NULL;
+  ++w->num_inputs_done;
+  // let idle outputs of all workers find out no more buffers will come
+  if (__atomic_sub_fetch(&num_inputs_open, 1, __ATOMIC_SEQ_CST) == 0)
+    wake_up_all_workers();
+}
+
+static inline void mark_buffered(Worker *w, Input *input) {
+  if (input->is_buffered) return;
+  input->is_buffered = 1;
+  queue(w->buffered_inputs, input);
+}
+
+static inline void close_input(Worker *w, Input *input) {
+  close(input->fd);
+  input->is_closed = 1;
+  input->is_readable = 0;
+  // pass along any trailing bytes without a record separator as the last
+  // record since no more data can follow it
+  Buffer *buf = input->buffer;
+  if (buf->size > 0 && buf->end_of_last_record < buf->begin + buf->size - 1)
+    buf->end_of_last_record = buf->begin + buf->size - 1;
+  if (buf->end_of_last_record > -1) {
+    mark_buffered(w, input);
+  } else {
+    finish_input(w, input);
+  }
+}
+
+static inline void close_output(Worker *w, Output *output) {
+  close(output->fd);
+  output->is_closed = 1;
+  output->is_writable = 0;
+  ++w->num_outputs_closed;
+  // no output is left to take over the records, which are then lost
+  if (__atomic_sub_fetch(&num_outputs_open, 1, __ATOMIC_SEQ_CST) == 0) {
+    something_went_wrong = true;
+    wake_up_all_workers();
+  }
+}
+
+/**
+ * Leave only the records a closed output hasn't written in its buffer, so no
+ * record is duplicated by resubmitting it (See: FAILOVER), or stop all workers
+ * if one was split, and SPLIT_RECORD_POLICY says so.
+ */
+static inline void skip_written_records_of(Output *output) {
+  Buffer *buf = output->buffer;
+  // records begin at the beginning of the buffers inputs submit
+  if (skip_written_records(buf, 0) < 0) {
+    fprintf(stderr, "%s: Failed in the middle of a record\n", output->name);
+    something_went_wrong = true;
+    __atomic_store_n(&num_outputs_open, 0, __ATOMIC_SEQ_CST);
+    wake_up_all_workers();
+    buf->size = 0;
+  } else if (STATS_ENABLED) {
+    buf->num_records = count_records(buf);
+  }
+}
+
+static inline int wait_for_events(Worker *w) {
+  int timeout_msec = 0;
+  if (is_empty(w->readable_inputs) && is_empty(w->writable_outputs)) {
+    // announce what this worker is waiting for before checking the pools for
+    // the last time, so a buffer put after it will wake this worker up
+    if (!is_empty(w->buffered_inputs))
+      __atomic_store_n(&w->is_waiting_for_empty_buffers, true,
+                       __ATOMIC_RELAXED);
+    if (!is_empty(w->idle_outputs))
+      __atomic_store_n(&w->is_waiting_for_full_buffers, true,
+                       __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!(!is_empty(w->buffered_inputs) && !is_empty(empty_buffers)) &&
+        !(!is_empty(w->idle_outputs) && !is_empty(full_buffers)) &&
+        !worker_is_done(w))
+      timeout_msec = -1;
+  }
+
+  int num_events =
+      epoll_wait(w->epoll_fd, w->events, w->max_events, timeout_msec);
+  if (num_events < 0) {
+    if (errno == EINTR) return 0;
+    perror("epoll_wait");
+    return -1;
+  }
+  // put inputs/outputs that became ready into the ready lists
+  for (int i = 0; i < num_events; ++i) {
+    struct epoll_event *ev = &w->events[i];
+    if (ev->data.u64 == WAKEUP_EVENT) {
+      eventfd_t value;
+      eventfd_read(w->wakeup_fd, &value);
+    } else if (ev->data.u64 < all_inputs->num_inputs) {
+      Input *input = &all_inputs->inputs[ev->data.u64];
+      if (input->is_closed || input->is_readable) continue;
+      input->is_near_eof = !!(ev->events & EPOLLHUP);
+      input->is_readable = 1;
+      // inputs with full buffers are put back after submitting records
+      if (input->buffer->size < input->buffer->capacity)
+        queue(w->readable_inputs, input);
+    } else {
+      Output *output =
+          &all_outputs->outputs[ev->data.u64 - all_inputs->num_inputs];
+      if (output->is_closed || output->is_writable) continue;
+      output->is_writable = 1;
+      if (output->is_busy) queue(w->writable_outputs, output);
+    }
+  }
+  DEBUG("worker %d: epoll returned %d events", w->index, num_events);
+  return num_events;
+}
+
+static inline void read_from_readable(Worker *w) {
+  // drain every readable input until read(2) would block as epoll is
+  // edge-triggered
+  while (!is_empty(w->readable_inputs)) {
+    Input *input = dequeue(w->readable_inputs);
+    Buffer *buf = input->buffer;
+    int scan_end_of_record_down_to = buf->end_of_last_record + 1;
+    for (;;) {
+      int num_bytes_readable = buf->capacity - buf->size;
+      // stop reading if buffer is already full, until records are submitted
+      if (num_bytes_readable <= 0) break;
+      int num_bytes_read = read(input->fd, buf->data + buf->begin + buf->size,
+                                num_bytes_readable);
+      DEBUG("%s: %d bytes read", input->name, num_bytes_read);
+      count_syscall(&input->stats, num_bytes_read);
+      if (num_bytes_read < 0) {
+        if (errno == EAGAIN) {
+          // stop reading when input is exhausted, until epoll says otherwise
+          input->is_readable = 0;
+        } else {
+          // close the input on other errors
+          perrorf("read %s", input->name);
+          close_input(w, input);
+        }
+        break;
+      } else if (num_bytes_read == 0) {
+        // EOF reached, close the input
+        DEBUG("%s: input closed", input->name);
+        close_input(w, input);
+        break;
+      }
+      // read normally, reflect size increase
+      buf->size += num_bytes_read;
+      // find the last record separator in the buffer, or close the input
+      // upon malformed records as upon errors, after the ones before
+      if (find_end_of_last_record(buf, scan_end_of_record_down_to) < 0) {
+        perrorf("read %s", input->name);
+        close_input(w, input);
+        break;
+      }
+      if (buf->end_of_last_record > -1) {
+        mark_buffered(w, input);
+      } else if (buf->size == buf->capacity) {
+        // enlarge the buffer so a record that is larger than the current
+        // buffer capacity can be read
+        enlarge_buffer(buf, buf->capacity * 2);
+        STATS_ADD(&input->stats, num_growths, 1);
+      }
+      // bound the next scan for end-of-record separator
+      scan_end_of_record_down_to = buf->begin + buf->size;
+    }
+  }
+}
+
+/**
+ * Submit the records of buffered inputs to the shared pool, replacing their
+ * buffers with empty ones taken from the other pool.
+ */
+static inline int submit_buffered_records(Worker *w) {
+  int num_submitted = 0;
+  while (!is_empty(w->buffered_inputs)) {
+    Buffer *empty = dequeue_if_non_empty(empty_buffers);
+    if (empty == NULL) break;
+    Input *input = dequeue(w->buffered_inputs);
+    Buffer *full = input->buffer;
+    DEBUG("%s: submitting %d bytes", input->name,
+          full->end_of_last_record + 1 - full->begin);
+    clear_buffer(empty);
+    // make sure the trailing bytes at the end of the buffer aren't lost
+    move_trailing_data_after_last_record(empty, full);
+    count_submitted_buffer(&input->stats, full);
+    input->buffer = empty;
+    input->is_buffered = 0;
+    __atomic_add_fetch(&num_buffers_in_flight, 1, __ATOMIC_SEQ_CST);
+    put_full_buffer(full);
+    ++num_submitted;
+    if (input->is_closed) {
+      finish_input(w, input);
+    } else if (input->is_readable) {
+      // which has room to read more if input is still readable
+      queue(w->readable_inputs, input);
+    }
+  }
+  return num_submitted;
+}
+
+/**
+ * Give every idle output a full buffer from the shared pool.
+ */
+static inline int take_full_buffers(Worker *w) {
+  int num_taken = 0;
+  while (!is_empty(w->idle_outputs)) {
+    Buffer *full = dequeue_if_non_empty(full_buffers);
+    if (full == NULL) break;
+    Output *output = dequeue(w->idle_outputs);
+    DEBUG("%s: took %d bytes", output->name, full->size);
+    output->buffer = full;
+    output->is_busy = 1;
+    if (output->is_writable) queue(w->writable_outputs, output);
+    ++num_taken;
+  }
+  return num_taken;
+}
+
+static inline void write_to_writable(Worker *w) {
+  // write to each writable output its buffered records
+  while (!is_empty(w->writable_outputs)) {
+    Output *output = dequeue(w->writable_outputs);
+    Buffer *buf = output->buffer;
+    while (buf->size > 0) {
+      int num_bytes_written =
+          write(output->fd, buf->data + buf->begin, buf->size);
+      DEBUG("%s: wrote %d bytes", output->name, num_bytes_written);
+      count_syscall(&output->stats, num_bytes_written);
+      if (num_bytes_written >= 0) {
+        // normal write
+        buf->begin += num_bytes_written;
+        buf->size -= num_bytes_written;
+      } else if (errno == EAGAIN) {
+        // output is busy, will try again once epoll says it's writable
+        output->is_writable = 0;
+        rearm_output(w, output);
+        break;
+      } else {
+        // something went wrong
+        perrorf("write %s", output->name);
+        close_output(w, output);
+        break;
+      }
+    }
+    if (output->is_closed && FAILOVER && buf->size > 0)
+      skip_written_records_of(output);
+    if (output->is_closed || buf->size == 0) {
+      // output becomes idle once all buffered data is written
+      output->is_busy = 0;
+      output->buffer = NULL;
+      if (buf->size == 0) {
+        count_written_buffer(&output->stats, buf);
+        retire_full_buffer(buf);
+      } else {
+        // XXX unless FAILOVER, what's resubmitted to another output includes
+        // the records already written, which inevitably get duplicated
+        put_full_buffer(buf);
+        // any worker with an open output may take it, even if idle for long
+        wake_up_all_workers();
+      }
+      if (!output->is_closed) queue(w->idle_outputs, output);
+    } else if (output->is_writable) {
+      // unpollable outputs simply try again at the next step
+      queue(w->writable_outputs, output);
+    }
+  }
+}
+
+/**
+ * Function executed by each worker thread
+ */
+static void *run_worker(void *arg) {
+  Worker *w = arg;
+  DEBUG("worker %d: multiplexing %d inputs and %d outputs", w->index,
+        w->num_inputs, w->num_outputs);
+  for (;;) {
+    write_to_writable(w);
+    read_from_readable(w);
+    submit_buffered_records(w);
+    take_full_buffers(w);
+    write_to_writable(w);
+    if (worker_is_done(w)) break;
+    if (wait_for_events(w) < 0) break;
+  }
+  DEBUG("worker %d: done", w->index);
+  return NULL;
+}
+
+static inline void parse_environ(void) {
+  readIntFromEnv(NUM_WORKERS, NUM_WORKERS, NUM_WORKERS >= 0,
+                 DEFAULT_NUM_WORKERS);
+  readIntFromEnv(MULTIBUFFERING, MULTIBUFFERING, MULTIBUFFERING > 0,
+                 DEFAULT_MULTIBUFFERING);
+  readIntFromEnv(EPOLL_MAX_EVENTS, EPOLL_MAX_EVENTS, EPOLL_MAX_EVENTS > 0,
+                 DEFAULT_EPOLL_MAX_EVENTS);
+}
+
+/**
+ * Worker pool implementation of mkmimo, where a fixed number of threads each
+ * multiplex many inputs and outputs with nonblocking I/O
+ */
+int mkmimo_workers(Inputs *inputs, Outputs *outputs) {
+  parse_environ();
+  if (initialize_workers(inputs, outputs)) {
+    perror("mkmimo");
+    return 1;
+  }
+
+  DEBUG("Spawning %d workers", num_workers);
+  for (int i = 0; i < num_workers; ++i)
+    CHECK_ERRNO(pthread_create, &workers[i].thread, NULL, run_worker,
+                &workers[i]);
+  for (int i = 0; i < num_workers; ++i) {
+    CHECK_ERRNO(pthread_join, workers[i].thread, NULL);
+    close(workers[i].epoll_fd);
+    close(workers[i].wakeup_fd);
+  }
+  return something_went_wrong ? 1 : 0;
+}
+
+#else
+
+int mkmimo_workers(Inputs *inputs, Outputs *outputs) {
+  fprintf(stderr, "workers: Not supported on this platform\n");
+  return 1;
+}
+
+#endif /* EPOLL_SUPPORTED */
@@ -0,0 +1,11 @@
+#ifndef MKMIMO_WORKERS_H
+#define MKMIMO_WORKERS_H
+
+#include "mkmimo.h"
+
+int mkmimo_workers(Inputs *inputs, Outputs *outputs);
+
+// number of worker threads, where 0 means one per online processor
+#define DEFAULT_NUM_WORKERS 0
+
+#endif /* MKMIMO_WORKERS_H */
@@ -0,0 +1,125 @@
+#define _GNU_SOURCE  // for memmem(3)
+#include "partition.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Parse which part of the records to use as the key: fN for the N-th field, or
+ * bM-N for the M-th through N-th bytes, where N can be omitted to mean the end
+ * of the record, just as the lists of cut(1).  Returns 0 upon success, or -1
+ * if it is malformed.
+ */
+int parse_partition_key(const char *spec) {
+  char *end;
+  PartitionKey key = PARTITION_KEY;
+  switch (spec[0]) {
+    case 'f':
+      key.kind = PARTITION_BY_FIELD;
+      key.field = strtol(spec + 1, &end, 10);
+      if (end == spec + 1 || *end != '\0' || key.field < 1) return -1;
+      break;
+    case 'b':
+      key.kind = PARTITION_BY_BYTES;
+      key.first_byte = strtol(spec + 1, &end, 10);
+      if (end == spec + 1 || key.first_byte < 1) return -1;
+      if (*end == '\0') {
+        key.last_byte = key.first_byte;
+      } else if (*end == '-' && end[1] == '\0') {
+        key.last_byte = 0;
+      } else if (*end == '-') {
+        const char *last = end + 1;
+        key.last_byte = strtol(last, &end, 10);
+        if (end == last || *end != '\0' || key.last_byte < key.first_byte)
+          return -1;
+      } else {
+        return -1;
+      }
+      break;
+    default:
+      return -1;
+  }
+  PARTITION_KEY = key;
+  return 0;
+}
+
+/**
+ * Parse the delimiter between fields given with C-style escape sequences.
+ * Returns 0 upon success, or -1 if it is empty, too long, or malformed.
+ */
+int parse_partition_key_delimiter(const char *escaped) {
+  char delimiter[MAX_RECORD_DELIMITER_LENGTH];
+  int len =
+      parse_escaped_bytes(escaped, delimiter, MAX_RECORD_DELIMITER_LENGTH);
+  if (len < 0) return -1;
+  memcpy(PARTITION_KEY.delimiter, delimiter, len);
+  PARTITION_KEY.delimiter_length = len;
+  return 0;
+}
+
+static inline uint64_t mix(uint64_t h) {
+  // finalizer of MurmurHash3
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/**
+ * Hash given bytes, mixing them in eight at a time with a couple of multiplies.
+ * Words are read in little endian order, so the same key hashes to the same
+ * value on every machine.
+ */
+uint64_t hash_bytes(const void *data, size_t size) {
+  const unsigned char *p = data;
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ size;
+  for (; size >= 8; p += 8, size -= 8) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    h = mix(h ^ word);
+  }
+  if (size > 0) {
+    uint64_t word = 0;
+    for (int i = 0; i < size; ++i) word |= (uint64_t)p[i] << (8 * i);
+    h = mix(h ^ word);
+  }
+  return h;
+}
+
+/**
+ * Find which partition the record with given content belongs to by hashing
+ * its key.  A missing field or byte range is an empty key.
+ */
+int partition_of_record(const char *content, size_t size, int num_partitions) {
+  const char *key = content, *end = content + size;
+  const char *key_end = end;
+  switch (PARTITION_KEY.kind) {
+    case PARTITION_BY_FIELD:
+      for (int i = 1; i < PARTITION_KEY.field && key < end; ++i) {
+        const char *delimiter = memmem(key, end - key, PARTITION_KEY.delimiter,
+                                       PARTITION_KEY.delimiter_length);
+        key = delimiter != NULL ? delimiter + PARTITION_KEY.delimiter_length
+                                : end;
+      }
+      key_end = memmem(key, end - key, PARTITION_KEY.delimiter,
+                       PARTITION_KEY.delimiter_length);
+      if (key_end == NULL) key_end = end;
+      break;
+    case PARTITION_BY_BYTES: {
+      size_t first = PARTITION_KEY.first_byte - 1;
+      size_t last = PARTITION_KEY.last_byte;
+      if (last == 0 || last > size) last = size;
+      if (first > last) first = last;
+      key = content + first;
+      key_end = content + last;
+      break;
+    }
+    default:
+      return 0;
+  }
+  return hash_bytes(key, key_end - key) % num_partitions;
+}
@@ -0,0 +1,31 @@
+#ifndef PARTITION_H
+#define PARTITION_H
+
+#include "buffer.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// records can be routed by the hash of a key, so the ones with the same key
+// always end up in the same output
+typedef enum {
+  PARTITION_NONE = 0,  // Records go to whichever output is available
+  PARTITION_BY_FIELD,  // Key is a field, e.g., f2 as in cut -f2
+  PARTITION_BY_BYTES,  // Key is a range of bytes, e.g., b1-8 as in cut -b1-8
+} PartitionKind;
+
+#define DEFAULT_PARTITION_KEY_DELIMITER "\t"
+typedef struct {
+  PartitionKind kind;
+  int field;                  // 1-based field number
+  int first_byte, last_byte;  // 1-based inclusive range, last 0 for the end
+  char delimiter[MAX_RECORD_DELIMITER_LENGTH];  // Separates the fields
+  int delimiter_length;
+} PartitionKey;
+extern PartitionKey PARTITION_KEY;
+
+int parse_partition_key(const char *spec);
+int parse_partition_key_delimiter(const char *escaped);
+uint64_t hash_bytes(const void *data, size_t size);
+int partition_of_record(const char *content, size_t size, int num_partitions);
+
+#endif /* PARTITION_H */
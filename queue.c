@@ -71,3 +71,10 @@ void *dequeue_or_wait(Queue *q) {
   CHECK_ERRNO(pthread_mutex_unlock, &(q->lock));
   return elem;
 }
+
+void *dequeue_if_non_empty(Queue *q) {
+  CHECK_ERRNO(pthread_mutex_lock, &(q->lock));
+  void *elem = is_empty(q) ? NULL : dequeue(q);
+  CHECK_ERRNO(pthread_mutex_unlock, &(q->lock));
+  return elem;
+}
@@ -27,5 +27,6 @@ bool is_empty(Queue *q);
 // multithread-friendly versions with mutex and condition variables
 void queue_and_signal(Queue *q, void *elem);
 void *dequeue_or_wait(Queue *q);
+void *dequeue_if_non_empty(Queue *q);
 
 #endif /* QUEUE_H */
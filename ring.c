@@ -0,0 +1,173 @@
+#define _GNU_SOURCE  // for syscall(2)
+
+#include "ring.h"
+#include "mkmimo.h"
+#include <sched.h>
+#ifdef FUTEX_SUPPORTED
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+Ring *new_ring(size_t min_capacity) {
+  size_t capacity = 2;
+  while (capacity < min_capacity) capacity *= 2;
+  Ring *r;
+  if (posix_memalign((void **)&r, CACHE_LINE_SIZE, sizeof(Ring))) {
+    perror("posix_memalign");
+    return NULL;
+  }
+  memset(r, 0, sizeof(Ring));
+  r->cells = malloc(capacity * sizeof(Cell));
+  if (r->cells == NULL) {
+    perror("malloc");
+    free(r);
+    return NULL;
+  }
+  for (size_t i = 0; i < capacity; ++i) r->cells[i].sequence = i;
+  r->mask = capacity - 1;
+  return r;
+}
+
+// TODO destructor
+
+/**
+ * Put the element at the end of the ring.  Returns false if it is full.
+ */
+bool ring_try_enqueue(Ring *r, void *elem) {
+  size_t pos = __atomic_load_n(&r->enqueue_pos, __ATOMIC_RELAXED);
+  for (;;) {
+    Cell *cell = &r->cells[pos & r->mask];
+    size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    ptrdiff_t diff = (ptrdiff_t)sequence - (ptrdiff_t)pos;
+    if (diff == 0) {
+      // the cell is free, so claim the position
+      if (__atomic_compare_exchange_n(&r->enqueue_pos, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        cell->elem = elem;
+        // let the consumer at this position take it
+        __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+        return true;
+      }
+      // otherwise, pos was updated to the latest one
+    } else if (diff < 0) {
+      // the cell still holds what was put a lap ago
+      return false;
+    } else {
+      // another producer claimed the position
+      pos = __atomic_load_n(&r->enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/**
+ * Take the element at the beginning of the ring.  Returns NULL if it is empty.
+ */
+void *ring_try_dequeue(Ring *r) {
+  size_t pos = __atomic_load_n(&r->dequeue_pos, __ATOMIC_RELAXED);
+  for (;;) {
+    Cell *cell = &r->cells[pos & r->mask];
+    size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    ptrdiff_t diff = (ptrdiff_t)sequence - (ptrdiff_t)(pos + 1);
+    if (diff == 0) {
+      // the cell is filled, so claim the position
+      if (__atomic_compare_exchange_n(&r->dequeue_pos, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        void *elem = cell->elem;
+        // let the producer a lap later reuse the cell
+        __atomic_store_n(&cell->sequence, pos + r->mask + 1, __ATOMIC_RELEASE);
+        return elem;
+      }
+    } else if (diff < 0) {
+      // nothing was put at this position yet
+      return NULL;
+    } else {
+      // another consumer claimed the position
+      pos = __atomic_load_n(&r->dequeue_pos, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+bool ring_is_empty(Ring *r) {
+  size_t pos = __atomic_load_n(&r->dequeue_pos, __ATOMIC_RELAXED);
+  Cell *cell = &r->cells[pos & r->mask];
+  return __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) != pos + 1;
+}
+
+static inline void relax_cpu(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+/**
+ * Wake up a thread sleeping for the condition, which must be called after
+ * changing the condition.  The fence pairs with the one in announce_sleep(),
+ * so either the sleeping thread sees the change or this sees the thread,
+ * while the futex is left alone when no thread is sleeping.
+ */
+static inline void wake_up(Waiters *w) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&w->num_sleeping, __ATOMIC_RELAXED) == 0) return;
+  __atomic_add_fetch(&w->futex, 1, __ATOMIC_RELEASE);
+#ifdef FUTEX_SUPPORTED
+  syscall(SYS_futex, &w->futex, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+}
+
+/**
+ * Announce a thread is about to sleep, which must be followed by a last check
+ * of the condition.  Returns the value of the futex to sleep on.
+ */
+static inline unsigned int announce_sleep(Waiters *w) {
+  __atomic_add_fetch(&w->num_sleeping, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return __atomic_load_n(&w->futex, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Sleep until the condition may have changed since given value of the futex
+ * was read.  It returns immediately if it already has.
+ */
+static inline void sleep_on(Waiters *w, unsigned int futex) {
+#ifdef FUTEX_SUPPORTED
+  syscall(SYS_futex, &w->futex, FUTEX_WAIT_PRIVATE, futex, NULL, NULL, 0);
+#else
+  if (__atomic_load_n(&w->futex, __ATOMIC_ACQUIRE) == futex) sched_yield();
+#endif
+}
+
+void ring_enqueue_or_wait(Ring *r, void *elem) {
+  for (int i = 0;; ++i) {
+    if (ring_try_enqueue(r, elem)) break;
+    if (i < RING_SPINS) {
+      relax_cpu();
+      continue;
+    }
+    // a consumer making room after the last try will wake us up
+    unsigned int futex = announce_sleep(&r->not_full);
+    bool enqueued = ring_try_enqueue(r, elem);
+    if (!enqueued) sleep_on(&r->not_full, futex);
+    __atomic_sub_fetch(&r->not_full.num_sleeping, 1, __ATOMIC_RELAXED);
+    if (enqueued) break;
+  }
+  wake_up(&r->not_empty);
+}
+
+void *ring_dequeue_or_wait(Ring *r) {
+  void *elem;
+  for (int i = 0;; ++i) {
+    if ((elem = ring_try_dequeue(r)) != NULL) break;
+    if (i < RING_SPINS) {
+      relax_cpu();
+      continue;
+    }
+    // a producer putting an element after the last try will wake us up
+    unsigned int futex = announce_sleep(&r->not_empty);
+    elem = ring_try_dequeue(r);
+    if (elem == NULL) sleep_on(&r->not_empty, futex);
+    __atomic_sub_fetch(&r->not_empty.num_sleeping, 1, __ATOMIC_RELAXED);
+    if (elem != NULL) break;
+  }
+  wake_up(&r->not_full);
+  return elem;
+}
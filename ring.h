@@ -0,0 +1,56 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define CACHE_LINE_SIZE 64
+
+// futex(2) lets waiting threads sleep in the kernel without any lock
+#ifdef __linux__
+#define FUTEX_SUPPORTED
+#endif
+
+// number of times to retry before going to sleep
+#define RING_SPINS 100
+
+typedef struct Cell Cell;
+typedef struct Waiters Waiters;
+typedef struct Ring Ring;
+
+struct Cell {
+  size_t sequence;  // Position this cell is ready for
+  void *elem;
+};
+
+struct Waiters {
+  unsigned int futex;  // Bumped whenever the awaited condition may change
+  int num_sleeping;    // Number of threads waiting on the futex
+};
+
+/**
+ * Bounded lock-free multi-producer multi-consumer ring buffer based on Dmitry
+ * Vyukov's design, where each cell carries a sequence number telling whether
+ * it's ready for the producer or the consumer at a position.  The positions
+ * are kept on separate cache lines, so producers and consumers don't contend
+ * with each other.
+ */
+struct Ring {
+  Cell *cells;
+  size_t mask;  // Capacity - 1, where capacity is a power of two
+  size_t enqueue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+  size_t dequeue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+  Waiters not_empty __attribute__((aligned(CACHE_LINE_SIZE)));
+  Waiters not_full __attribute__((aligned(CACHE_LINE_SIZE)));
+};
+
+Ring *new_ring(size_t min_capacity);
+bool ring_try_enqueue(Ring *r, void *elem);
+void *ring_try_dequeue(Ring *r);
+bool ring_is_empty(Ring *r);
+
+// blocking versions that spin for a while, then sleep on a futex
+void ring_enqueue_or_wait(Ring *r, void *elem);
+void *ring_dequeue_or_wait(Ring *r);
+
+#endif /* RING_H */
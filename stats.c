@@ -0,0 +1,200 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "stats.h"
+#include "mkmimo.h"
+#include <pthread.h>
+#include <sys/stat.h>
+
+bool STATS_ENABLED = false;
+
+/**
+ * Parameters
+ */
+static int STATS_INTERVAL_MSEC = 0;  // 0 disables reporting
+
+static FILE *stats_file;
+static struct inputs *all_inputs;
+static struct outputs *all_outputs;
+
+static pthread_t reporter_thread;
+static pthread_mutex_t reporter_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reporter_should_stop = PTHREAD_COND_INITIALIZER;
+static bool reporter_is_stopping = false;
+
+static uint64_t usec_started;
+// totals at the previous snapshot for computing rates
+static uint64_t usec_last_snapshot;
+static uint64_t num_bytes_in_last, num_bytes_out_last;
+static uint64_t num_records_in_last, num_records_out_last;
+
+static inline uint64_t clock_usec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void print_json_string(const char *s) {
+  fputc('"', stats_file);
+  for (; *s != '\0'; ++s) {
+    if (*s == '"' || *s == '\\')
+      fprintf(stats_file, "\\%c", *s);
+    else if ((unsigned char)*s < 0x20)
+      fprintf(stats_file, "\\u%04x", *s);
+    else
+      fputc(*s, stats_file);
+  }
+  fputc('"', stats_file);
+}
+
+/**
+ * Print the counters of a stream, adding them to the totals.
+ */
+static void print_stats(const char *name, int is_closed, Stats *stats,
+                        Stats *total) {
+  Stats s = {
+      .num_bytes = STATS_GET(stats, num_bytes),
+      .num_records = STATS_GET(stats, num_records),
+      .num_buffers = STATS_GET(stats, num_buffers),
+      .num_syscalls = STATS_GET(stats, num_syscalls),
+      .num_eagains = STATS_GET(stats, num_eagains),
+      .num_growths = STATS_GET(stats, num_growths),
+      .usec_blocked = STATS_GET(stats, usec_blocked),
+  };
+  fputs("{", stats_file);
+  if (name != NULL) {
+    fputs("\"name\":", stats_file);
+    print_json_string(name);
+    fprintf(stats_file, ",\"closed\":%s,", is_closed ? "true" : "false");
+  }
+  fprintf(stats_file,
+          "\"bytes\":%llu,\"records\":%llu,\"buffers\":%llu,"
+          "\"syscalls\":%llu,\"eagains\":%llu,\"buffer_growths\":%llu,"
+          "\"usec_blocked\":%llu}",
+          (unsigned long long)s.num_bytes, (unsigned long long)s.num_records,
+          (unsigned long long)s.num_buffers,
+          (unsigned long long)s.num_syscalls,
+          (unsigned long long)s.num_eagains, (unsigned long long)s.num_growths,
+          (unsigned long long)s.usec_blocked);
+  if (total != NULL) {
+    total->num_bytes += s.num_bytes;
+    total->num_records += s.num_records;
+    total->num_buffers += s.num_buffers;
+    total->num_syscalls += s.num_syscalls;
+    total->num_eagains += s.num_eagains;
+    total->num_growths += s.num_growths;
+    total->usec_blocked += s.usec_blocked;
+  }
+}
+
+/**
+ * Print a snapshot of the counters of all inputs and outputs as a JSON line,
+ * along with their totals and rates since the previous snapshot.
+ */
+static void print_snapshot(void) {
+  uint64_t now = clock_usec();
+  Stats total_in = {0}, total_out = {0};
+  fprintf(stats_file, "{\"usec_elapsed\":%llu,\"inputs\":[",
+          (unsigned long long)(now - usec_started));
+  for (int i = 0; i < all_inputs->num_inputs; ++i) {
+    Input *input = &all_inputs->inputs[i];
+    if (i > 0) fputc(',', stats_file);
+    print_stats(input->name, input->is_closed, &input->stats, &total_in);
+  }
+  fputs("],\"outputs\":[", stats_file);
+  for (int i = 0; i < all_outputs->num_outputs; ++i) {
+    Output *output = &all_outputs->outputs[i];
+    if (i > 0) fputc(',', stats_file);
+    print_stats(output->name, output->is_closed, &output->stats, &total_out);
+  }
+  fputs("],\"total_in\":", stats_file);
+  print_stats(NULL, 0, &total_in, NULL);
+  fputs(",\"total_out\":", stats_file);
+  print_stats(NULL, 0, &total_out, NULL);
+  double secs = (now - usec_last_snapshot) / 1e6;
+  if (secs <= 0) secs = 1e-6;
+  fprintf(stats_file,
+          ",\"bytes_in_per_sec\":%.0f,\"bytes_out_per_sec\":%.0f,"
+          "\"records_in_per_sec\":%.0f,\"records_out_per_sec\":%.0f}\n",
+          (total_in.num_bytes - num_bytes_in_last) / secs,
+          (total_out.num_bytes - num_bytes_out_last) / secs,
+          (total_in.num_records - num_records_in_last) / secs,
+          (total_out.num_records - num_records_out_last) / secs);
+  fflush(stats_file);
+  usec_last_snapshot = now;
+  num_bytes_in_last = total_in.num_bytes;
+  num_bytes_out_last = total_out.num_bytes;
+  num_records_in_last = total_in.num_records;
+  num_records_out_last = total_out.num_records;
+}
+
+/**
+ * Function executed by the reporter thread
+ */
+static void *report_stats_periodically(void *arg) {
+  CHECK_ERRNO(pthread_mutex_lock, &reporter_lock);
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  while (!reporter_is_stopping) {
+    deadline.tv_sec += STATS_INTERVAL_MSEC / 1000;
+    deadline.tv_nsec += STATS_INTERVAL_MSEC % 1000 * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec += 1;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    while (!reporter_is_stopping &&
+           pthread_cond_timedwait(&reporter_should_stop, &reporter_lock,
+                                  &deadline) != ETIMEDOUT)
+      ;
+    if (!reporter_is_stopping) print_snapshot();
+  }
+  CHECK_ERRNO(pthread_mutex_unlock, &reporter_lock);
+  return NULL;
+}
+
+/**
+ * Open where to report statistics, which can be a file descriptor number or a
+ * path to append to.  Defaults to the standard error.
+ */
+static FILE *open_stats_file(const char *path) {
+  if (path == NULL || *path == '\0') return stderr;
+  if (strspn(path, "0123456789") == strlen(path)) {
+    FILE *f = fdopen(atoi(path), "a");
+    if (f == NULL) perrorf("MKMIMO_STATS_FILE=%s", path);
+    return f;
+  }
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND,
+                S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (fd < 0) {
+    perrorf("open %s", path);
+    return NULL;
+  }
+  return fdopen(fd, "a");
+}
+
+void start_stats_reporter(struct inputs *inputs, struct outputs *outputs) {
+  readIntFromEnv(MKMIMO_STATS_INTERVAL, STATS_INTERVAL_MSEC,
+                 STATS_INTERVAL_MSEC >= 0, 0);
+  if (STATS_INTERVAL_MSEC == 0) return;
+  stats_file = open_stats_file(getenv("MKMIMO_STATS_FILE"));
+  if (stats_file == NULL) return;
+  all_inputs = inputs;
+  all_outputs = outputs;
+  usec_started = usec_last_snapshot = clock_usec();
+  STATS_ENABLED = true;
+  CHECK_ERRNO(pthread_create, &reporter_thread, NULL,
+              report_stats_periodically, NULL);
+}
+
+/**
+ * Stop reporting, and print the final snapshot.
+ */
+void stop_stats_reporter(void) {
+  if (!STATS_ENABLED) return;
+  CHECK_ERRNO(pthread_mutex_lock, &reporter_lock);
+  reporter_is_stopping = true;
+  CHECK_ERRNO(pthread_cond_signal, &reporter_should_stop);
+  CHECK_ERRNO(pthread_mutex_unlock, &reporter_lock);
+  CHECK_ERRNO(pthread_join, reporter_thread, NULL);
+  print_snapshot();
+  STATS_ENABLED = false;
+}
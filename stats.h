@@ -0,0 +1,90 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "buffer.h"
+#include <errno.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/**
+ * Counters of an input/output stream.  Each is updated only by the thread
+ * handling the stream, with a relaxed atomic store instead of an atomic
+ * read-modify-write, so it costs no more than a plain increment, while the
+ * reporter thread can read them at any time and aggregate them lazily.
+ */
+typedef struct stats {
+  uint64_t num_bytes;
+  uint64_t num_records;   // Counted only while reporting (See: count_records)
+  uint64_t num_buffers;   // Buffers exchanged between inputs and outputs
+  uint64_t num_syscalls;  // Calls to read(2), write(2), splice(2), etc.
+  uint64_t num_eagains;   // Calls that would have blocked
+  uint64_t num_growths;   // Times the buffer was enlarged for a large record
+  uint64_t usec_blocked;  // Time spent waiting for buffers from the pools
+} Stats;
+
+// whether statistics are being reported, which turns on the costlier
+// counters, i.e., number of records and time blocked
+extern bool STATS_ENABLED;
+
+#define STATS_ADD(stats, counter, n)                                       \
+  __atomic_store_n(&(stats)->counter, (stats)->counter + (uint64_t)(n), \
+                   __ATOMIC_RELAXED)
+#define STATS_GET(stats, counter) \
+  __atomic_load_n(&(stats)->counter, __ATOMIC_RELAXED)
+
+/**
+ * Count a system call that transferred given number of bytes, or failed with
+ * errno.
+ */
+static inline void count_syscall(Stats *stats, ssize_t num_bytes) {
+  STATS_ADD(stats, num_syscalls, 1);
+  if (num_bytes > 0)
+    STATS_ADD(stats, num_bytes, num_bytes);
+  else if (num_bytes < 0 && errno == EAGAIN)
+    STATS_ADD(stats, num_eagains, 1);
+}
+
+/**
+ * Count a buffer of complete records submitted by an input.  The records are
+ * counted once here, and carried along with the buffer to the output.
+ */
+static inline void count_submitted_buffer(Stats *stats, Buffer *buf) {
+  buf->num_records = STATS_ENABLED ? count_records(buf) : 0;
+  if (buf->size == 0) return;  // e.g., the last one submitted upon EOF
+  STATS_ADD(stats, num_buffers, 1);
+  STATS_ADD(stats, num_records, buf->num_records);
+}
+
+/**
+ * Count a buffer of records completely written to an output.
+ */
+static inline void count_written_buffer(Stats *stats, Buffer *buf) {
+  STATS_ADD(stats, num_buffers, 1);
+  STATS_ADD(stats, num_records, buf->num_records);
+  buf->num_records = 0;
+}
+
+/**
+ * Current time in microseconds to measure the time blocked, or 0 when not
+ * reporting statistics.
+ */
+static inline uint64_t stats_clock_usec(void) {
+  if (!STATS_ENABLED) return 0;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static inline void count_blocked_since(Stats *stats, uint64_t usec_began) {
+  if (STATS_ENABLED)
+    STATS_ADD(stats, usec_blocked, stats_clock_usec() - usec_began);
+}
+
+// periodic reporting of the counters of all inputs and outputs as JSON lines
+struct inputs;
+struct outputs;
+void start_stats_reporter(struct inputs *inputs, struct outputs *outputs);
+void stop_stats_reporter(void);
+
+#endif /* STATS_H */
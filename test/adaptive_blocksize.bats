@@ -0,0 +1,43 @@
+#!/usr/bin/env bats
+load test_helpers
+
+# number of read(2) calls on the inputs, according to the final statistics
+num_reads() {
+    tail -n 1 stats.json | sed 's/.*"total_in":{[^}]*"syscalls":\([0-9]*\).*/\1/'
+}
+
+@test "adaptive block size makes fewer reads of a bulk input" {
+    case ${MKMIMO_IMPL:-multithreaded} in
+        multithreaded|nonblocking) ;;
+        *) skip "block size is adapted only by multithreaded and nonblocking"
+    esac
+    seq 3000000 >input
+    export MMAP_INPUTS=0  # reading the file rather than mapping it
+    MKMIMO_STATS_INTERVAL=10000 MKMIMO_STATS_FILE=stats.json \
+        mkmimo <input >output
+    fixed=$(num_reads)
+    rm -f stats.json
+    ADAPTIVE_BLOCKSIZE=1 \
+        MKMIMO_STATS_INTERVAL=10000 MKMIMO_STATS_FILE=stats.json \
+        mkmimo <input >output
+    adapted=$(num_reads)
+    echo "$fixed reads with fixed block size, $adapted with adaptive one"
+    [[ $adapted -lt $fixed ]]
+    cmp input output
+}
+
+@test "adaptive block size keeps records intact" {
+    export ADAPTIVE_BLOCKSIZE=1 MIN_BLOCKSIZE=64 MAX_BLOCKSIZE=65536
+    export MMAP_INPUTS=0
+    {
+        seq 10000
+        for size in 100000 300000; do
+            head -c $size /dev/urandom | base64 -w 0
+            echo
+        done
+        for i in $(seq 20); do seq $i; sleep 0.01; done
+    } >input
+    mkmimo <input >(cat >out.1) >(cat >out.2)
+    wait
+    cmp <(sort input) <(sort out.*)
+}
@@ -0,0 +1,39 @@
+#!/usr/bin/env bats
+load test_helpers
+
+batching_only_in() {
+    case ${MKMIMO_IMPL:-multithreaded} in
+        multithreaded|nonblocking) ;;
+        *) skip "records are batched only by multithreaded and nonblocking"
+    esac
+    # and not while splicing
+    export ZERO_COPY=0
+}
+
+# number of buffers handed to the outputs, according to the final statistics
+num_buffers_out() {
+    tail -n 1 stats.json |
+        sed 's/.*"total_out":{[^}]*"buffers":\([0-9]*\).*/\1/'
+}
+
+@test "batching records of a trickling input into fewer buffers" {
+    batching_only_in
+    numlines=300
+    for i in $(seq $numlines); do echo $i; sleep 0.001; done |
+        MIN_BATCH_BYTES=4096 MAX_FLUSH_LATENCY_USEC=50000 \
+        MKMIMO_STATS_INTERVAL=10000 MKMIMO_STATS_FILE=stats.json \
+        mkmimo >output
+    cmp <(seq $numlines) output
+    echo "$(num_buffers_out) buffers for $numlines records"
+    [[ $(num_buffers_out) -lt $((numlines / 4)) ]]
+}
+
+@test "batching records no longer than the flush latency" {
+    batching_only_in
+    { echo first; sleep 2; echo second; } |
+        MIN_BATCH_BYTES=4096 MAX_FLUSH_LATENCY_USEC=100000 mkmimo >output &
+    sleep 1
+    [[ $(cat output) = first ]]
+    wait
+    cmp <(echo first; echo second) output
+}
@@ -0,0 +1,52 @@
+#!/usr/bin/env bats
+load test_helpers
+
+skip_unless_compressing() {
+    [[ ${MKMIMO_IMPL:-multithreaded} = multithreaded ]] ||
+        skip "gzip is only handled by the multithreaded implementation"
+}
+
+@test "gzipped inputs are decompressed, and others are read as they are" {
+    skip_unless_compressing
+    seq 200000 | gzip >in.1.gz
+    # concatenated members, through a pipe
+    { seq 200001 300000 | gzip; seq 300001 400000 | gzip -1; } >in.2.gz
+    seq 400001 500000 >in.3
+    DECOMPRESS_INPUTS=1 mkmimo in.1.gz <(cat in.2.gz) in.3 \> out.1 out.2
+    cmp <(seq 500000) <(sort -n out.*)
+}
+
+@test "a truncated gzipped input is an error" {
+    skip_unless_compressing
+    seq 200000 | gzip | head -c 100000 >in.gz
+    ! DECOMPRESS_INPUTS=1 mkmimo in.gz \> out
+}
+
+@test "outputs are gzipped, each a whole stream" {
+    skip_unless_compressing
+    seq 500000 >input
+    COMPRESS_OUTPUTS=6 mkmimo input \> out.1.gz out.2.gz
+    gzip -t out.1.gz out.2.gz
+    cmp input <(zcat out.*.gz | sort -n)
+}
+
+@test "length-prefixed records are framed after decompressing" {
+    skip_unless_compressing
+    framed_records u32be 20000 300 >input
+    gzip <input >in.gz
+    RECORD_FRAMING=u32be DECOMPRESS_INPUTS=1 COMPRESS_OUTPUTS=1 \
+        mkmimo <(cat in.gz) \> out.1.gz out.2.gz
+    cmp <(framed_records -d u32be <input | sort) \
+        <(zcat out.*.gz | framed_records -d u32be | sort)
+}
+
+# The whole batch of the failed output is rerouted, so records that made it
+# into a partially written gzip stream would be duplicated, which /dev/full
+# never lets happen, as it accepts nothing.
+@test "records a gzipped output failed to write go whole to the others" {
+    skip_unless_compressing
+    seq 200000 >input
+    FAILOVER=1 COMPRESS_OUTPUTS=1 mkmimo input \> /dev/full out.1.gz out.2.gz
+    gzip -t out.1.gz out.2.gz
+    cmp input <(zcat out.*.gz | sort -n)
+}
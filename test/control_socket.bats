@@ -0,0 +1,80 @@
+#!/usr/bin/env bats
+load test_helpers
+
+setup_control() {
+    [[ ${MKMIMO_IMPL:-multithreaded} = multithreaded ]] ||
+        skip "streams are only attached by the multithreaded implementation"
+    # which needs the pools shared by all streams
+    export CONTROL_SOCKET=ctl WORK_STEALING=0
+}
+
+wait_for_control() {
+    local i
+    for i in {1..100}; do
+        [[ -S $CONTROL_SOCKET ]] && return
+        sleep 0.1
+    done
+    false
+}
+
+@test "an output attached at runtime takes over one detached" {
+    setup_control
+    mkfifo in
+    mkmimo in \> out.1 &
+    exec 7>in
+    wait_for_control
+    seq 1000 >&7
+    mkmimo_control $CONTROL_SOCKET attach output out.2 8 8>out.2
+    mkmimo_control $CONTROL_SOCKET detach output out.1
+    seq 1001 2000 >&7
+    exec 7>&-
+    wait $!
+    cmp <(seq 2000) <(sort -n out.*)
+    # records read after detaching only went to the attached output
+    [[ $(sort -n out.1 | tail -n 1) -le 1000 ]]
+    ! mkmimo_control $CONTROL_SOCKET detach output out.2
+}
+
+@test "inputs attached and detached at runtime" {
+    setup_control
+    mkfifo in.1 in.2
+    mkmimo in.1 \> out &
+    pid=$!
+    exec 7>in.1
+    wait_for_control
+    seq 1000 >&7
+    # by opening a named pipe, and passing a file descriptor along
+    mkmimo_control $CONTROL_SOCKET attach input in.2 &
+    exec 8>in.2
+    wait $!
+    seq 1001 2000 >&8
+    seq 2001 3000 >in.3
+    mkmimo_control $CONTROL_SOCKET attach input in.3 9 9<in.3
+    # a detached input is no longer read, while its producer is still there
+    mkmimo_control $CONTROL_SOCKET detach input in.2
+    ! (echo 2001 >&8) 2>/dev/null
+    exec 8>&- 7>&-
+    wait $pid
+    # every record is whole, and none but the ones left unread are missing
+    ! grep -vx '[0-9]*' out
+    cmp <(seq 1000; seq 2001 3000) \
+        <(sort -n out | awk '$1 <= 1000 || $1 > 2000')
+    [[ ! -e $CONTROL_SOCKET ]]
+}
+
+@test "an output waiting among others is detached" {
+    setup_control
+    mkfifo in
+    mkmimo in \> out.1 out.2 out.3 &
+    exec 7>in
+    wait_for_control
+    seq 1000 >&7
+    sleep 0.5
+    # while every output waits, any of them may be woken up by the call
+    timeout 10 mkmimo_control $CONTROL_SOCKET detach output out.2
+    seq 1001 2000 >&7
+    exec 7>&-
+    wait $!
+    cmp <(seq 2000) <(sort -n out.*)
+    [[ $(sort -n out.2 | tail -n 1) -le 1000 ]]
+}
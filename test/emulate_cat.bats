@@ -7,3 +7,9 @@ load test_helpers
     # run mkmimo and verify its output
     seq $numlines | mkmimo | cmp - <(seq $numlines)
 }
+
+@test "cat emulation with buffers carved out of an arena" {
+    numlines=1000000
+    export BUFFER_ARENA=1 BLOCKSIZE=65536
+    seq $numlines | mkmimo | cmp - <(seq $numlines)
+}
@@ -0,0 +1,79 @@
+#!/usr/bin/env bats
+load test_helpers
+
+skip_unless_failing_over() {
+    case ${MKMIMO_IMPL:-multithreaded} in
+        multithreaded|nonblocking|workers) ;;
+        *) skip "FAILOVER is not done by the $MKMIMO_IMPL implementation"
+    esac
+}
+
+@test "records an output failed to write go to the others" {
+    skip_unless_failing_over
+    seq 200000 >input
+    FAILOVER=1 mkmimo input \> /dev/full out.1 out.2
+    cmp input <(sort -n out.*)
+}
+
+@test "all outputs failing to write ends with an error" {
+    skip_unless_failing_over
+    seq 200000 >input
+    status=0
+    FAILOVER=1 BLOCKSIZE=4096 timeout 10 mkmimo input \> /dev/full /dev/full 2>/dev/null || status=$?
+    [[ $status -ne 0 && $status -ne 124 ]]
+}
+
+@test "a consumer gone away costs only the records in flight to it" {
+    skip_unless_failing_over
+    export FAILOVER=1 SPLIT_RECORD_POLICY=resend BLOCKSIZE=65536
+    seq -w 1000000 >input
+    mkfifo gone
+    head -c 100001 <gone >out.gone &
+    mkmimo input \> gone out.1
+    wait
+    # records taken over are all whole, and none of them got duplicated
+    ! grep -vx '[0-9]\{7\}' out.1
+    sed '$d' out.gone | sort - out.1 >taken
+    [[ -z $(uniq -d taken) ]]
+    # while only what was left in the pipe to the consumer is lost
+    lost=$(( $(wc -c <input) - $(wc -c <taken) ))
+    echo $lost bytes lost
+    [[ $lost -le $(( 2 * 65536 )) ]]
+}
+
+# checks that a consumer going away without reading anything, well after the
+# others are done, costs only what was left in the pipe to it
+consumer_gone_near_the_end_costs_only_the_pipe() {
+    export FAILOVER=1 SPLIT_RECORD_POLICY=resend BLOCKSIZE=65536
+    seq -w 1000000 >input
+    mkfifo gone
+    sleep 1 <gone &
+    mkmimo input \> gone out.1
+    wait
+    ! grep -vx '[0-9]\{7\}' out.1
+    [[ -z $(sort out.1 | uniq -d) ]]
+    lost=$(( $(wc -c <input) - $(wc -c <out.1) ))
+    echo $lost bytes lost
+    [[ $lost -le 65536 ]]
+}
+
+@test "records of a consumer gone away near the end still go to the others" {
+    skip_unless_failing_over
+    consumer_gone_near_the_end_costs_only_the_pipe
+}
+
+@test "records of a consumer gone away near the end go to the others when stealing" {
+    skip_unless_failing_over
+    WORK_STEALING=1 consumer_gone_near_the_end_costs_only_the_pipe
+}
+
+@test "records lost with a failed output end with an error without failing over" {
+    case ${MKMIMO_IMPL:-multithreaded} in
+        epoll|uring) ;;
+        *) skip "records of a failed output are lost only by epoll and uring"
+    esac
+    seq 200000 >input
+    status=0
+    mkmimo input \> /dev/full out.1 2>stderr || status=$?
+    [[ $status -ne 0 ]]
+}
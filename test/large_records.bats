@@ -11,3 +11,15 @@ load test_helpers
     } | dd of=wide_input
     cmp wide_input <(timeout $timeout mkmimo <wide_input 2>/dev/null)
 }
+
+@test "records larger than the cap on buffered memory" {
+    for size in 1000000 3000000 2000000 3000000; do
+        head -c $size /dev/urandom | base64 -w 0
+        echo
+    done >wide_input
+    MMAP_INPUTS=0 MAX_BUFFERED_MIB=1 POOL_HIGH_WATER_MIB=2 mkmimo <wide_input \
+        >(cat >out.1) >(cat >out.2) 2>stderr
+    wait
+    cmp <(sort wide_input) <(sort out.*)
+    grep -q MAX_BUFFERED_MIB stderr
+}
@@ -0,0 +1,20 @@
+#!/usr/bin/env bats
+load test_helpers
+
+@test "records move away from a stalled sink (may take up to 10s)" {
+    [[ ${MKMIMO_IMPL:-} = nonblocking ]] ||
+        skip "least-loaded routing is only done by the nonblocking implementation"
+    export LEAST_LOADED=1 BLOCKSIZE=1048576
+    numlines=2000000 timeout=10s
+    seq $numlines >input
+    mkfifo stalled
+    # a sink that stalls long enough for every other output to finish
+    (sleep 2; cat) <stalled >out.stalled &
+    timeout $timeout mkmimo input \> stalled out.1 out.2
+    wait
+    # it should only get what fits in the pipe, not a whole buffer
+    echo $(wc -c <out.stalled) bytes went to the stalled sink
+    [[ $(wc -c <out.stalled) -lt $(( BLOCKSIZE / 2 )) ]]
+    # while no record is lost or split
+    cmp input <(sort -n out.*)
+}
@@ -21,3 +21,16 @@ load test_helpers
     # verify output is identical
     cmp <(eval "sort $inputs") <(sort out.*)
 }
+
+@test "all outputs end promptly once inputs end (2 inputs, 100 outputs)" {
+    seq 100000 >in.1
+    : >in.2
+    timeout 10 mkmimo in.1 in.2 \> out.{1..100}
+    cmp in.1 <(sort -n out.*)
+}
+
+@test "more streams than submission entries (20 inputs, 60 outputs)" {
+    for i in {1..20}; do seq $(( (i-1) * 5000 + 1 )) $(( i * 5000 )) >in.$i; done
+    URING_ENTRIES=4 mkmimo in.* \> out.{1..60}
+    cmp <(seq 100000) <(sort -n out.*)
+}
@@ -0,0 +1,30 @@
+#!/usr/bin/env bats
+load test_helpers
+
+@test "records handed off right from mapped files (2 inputs, 4 outputs)" {
+    numlines=500000
+    seq $numlines >in.1
+    {
+        seq 1000
+        for size in 100000 300000; do
+            head -c $size /dev/urandom | base64 -w 0
+            echo
+        done
+    } >in.2
+    MMAP_INPUTS=1 BLOCKSIZE=4096 mkmimo in.1 in.2 \> out.1 out.2 out.3 out.4
+    cmp <(cat in.1 in.2 | sort) <(cat out.* | sort)
+}
+
+@test "length-prefixed records handed off right from a mapped file" {
+    framed_records u32be 20000 300 >input
+    MMAP_INPUTS=1 RECORD_FRAMING=u32be BLOCKSIZE=1000 mkmimo input \> out.1 out.2
+    cmp <(framed_records -d u32be <input | sort) \
+        <(cat out.1 out.2 | framed_records -d u32be | sort)
+}
+
+@test "a mapped file is passed from where it was left to where it ends" {
+    seq 100000 >input
+    (read -r first; MMAP_INPUTS=1 BLOCKSIZE=4096 mkmimo \> out.1 out.2; cat >rest) <input
+    cmp <(tail -n +2 input) <(sort -n out.1 out.2)
+    [[ ! -s rest ]]
+}
@@ -0,0 +1,59 @@
+#!/usr/bin/env bats
+load test_helpers
+
+setup_ordering() {
+    [[ ${MKMIMO_IMPL:-multithreaded} = multithreaded ]] ||
+        skip "reordering requires the multithreaded implementation"
+    numworkers=4 numlines=200000
+    seq $numlines >input
+}
+
+# splits the input to workers that pass the sequence headers through, and
+# merges what they output back in the original order
+split_and_merge() {
+    local worker=$1; shift
+    local splits= merges=
+    for i in $(seq $numworkers); do
+        mkfifo split.$i merge.$i
+        eval "$worker" <split.$i >merge.$i &
+        splits+=" split.$i" merges+=" merge.$i"
+    done
+    SEQUENCE_NUMBERS=1 mkmimo "$@" <input $splits &
+    REORDER_WINDOW=${REORDER_WINDOW:-8} mkmimo "$@" $merges \> output
+    wait
+}
+
+@test "merging splits back in order (1 input, 4 workers, 1 output)" {
+    setup_ordering
+    BLOCKSIZE=1000 split_and_merge cat
+    cmp input output
+}
+
+@test "merging splits back in order despite slow workers" {
+    setup_ordering
+    BLOCKSIZE=500 REORDER_WINDOW=2 split_and_merge \
+        '{ sleep 0.$((RANDOM % 3)); cat; }'
+    cmp input output
+}
+
+@test "merging transformed records back in order" {
+    setup_ordering
+    split_and_merge "awk '/^\x1e/ { print; next } { print \$1 * 2 }'"
+    cmp <(awk '{ print $1 * 2 }' input) output
+}
+
+@test "merging length-prefixed records back in order" {
+    setup_ordering
+    framed_records u32be 10000 300 >input
+    BLOCKSIZE=3000 split_and_merge cat -f u32be
+    cmp input output
+}
+
+@test "merging skips missing sequence numbers rather than waiting for them" {
+    setup_ordering
+    BLOCKSIZE=500 split_and_merge \
+        "awk '/^\x1emkmimo-seq / { dropped = \$2 == 7 } !dropped'"
+    [[ $(wc -l <output) -lt $numlines ]]
+    # every other record comes in order
+    cmp <(grep -Fxf output input) output
+}
@@ -0,0 +1,47 @@
+#!/usr/bin/env bats
+load test_helpers
+
+setup_partitioning() {
+    [[ ${MKMIMO_IMPL:-multithreaded} = multithreaded ]] ||
+        skip "partitioning by key requires the multithreaded implementation"
+    numouts=5 numlines=100000
+    seq $numouts | split -n r/$numouts - out.
+    seq $numlines | awk '{ printf "key%d\t%d\n", $1 % 997, $1 }' >input
+}
+
+# checks that no record is lost and every key ends up in a single output
+every_key_in_one_output() {
+    local key=$1
+    cmp <(sort input) <(cat out.* | sort)
+    for o in out.*; do $key <$o | sort -u; done | sort | uniq -d >dups
+    [[ ! -s dups ]]
+}
+
+@test "partitioning by a field (2 inputs, 5 outputs)" {
+    setup_partitioning
+    split -n l/2 input input.
+    mkmimo -k f1 input.* \> out.*
+    every_key_in_one_output "cut -f1"
+}
+
+@test "partitioning by a field with a delimiter (1 input, 5 outputs)" {
+    setup_partitioning
+    tr '\t' , <input >input.csv; mv input.csv input
+    BLOCKSIZE=100 mkmimo -t, -k f1 <input out.*
+    every_key_in_one_output "cut -d, -f1"
+}
+
+@test "partitioning by a range of bytes (1 input, 5 outputs)" {
+    setup_partitioning
+    PARTITION_KEY=b4-6 mkmimo <input out.*
+    every_key_in_one_output "cut -b4-6"
+}
+
+@test "partitioning is deterministic regardless of inputs" {
+    setup_partitioning
+    cat input | mkmimo -k f1 out.*
+    for o in out.*; do sort $o >$o.sorted; done
+    split -n l/3 input input.
+    mkmimo -k f1 input.* \> out.??
+    for o in out.??; do sort $o | cmp - $o.sorted; done
+}
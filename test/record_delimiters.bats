@@ -0,0 +1,31 @@
+#!/usr/bin/env bats
+load test_helpers
+
+@test "NUL-delimited records (1 input, 10 outputs)" {
+    numouts=10
+    numlines=100000
+    seq $numouts | split -n r/$numouts - out.
+
+    seq $numlines | tr '\n' '\0' | RECORD_DELIMITER='\0' mkmimo out.*
+
+    # verify every output ends with a whole record
+    for o in out.*; do
+        [[ ! -s $o ]] || [[ $(tail -c 1 $o | od -An -tx1) = " 00" ]]
+    done
+    cmp -b <(seq $numlines) <(cat out.* | tr '\0' '\n' | sort -n)
+}
+
+@test "multi-byte record delimiters straddling reads (1 input, 10 outputs)" {
+    numouts=10
+    numlines=100000
+    seq $numouts | split -n r/$numouts - out.
+
+    # a small BLOCKSIZE makes delimiters straddle reads often
+    seq $numlines | sed 's/$/<EOR>/' | tr -d '\n' |
+        BLOCKSIZE=7 mkmimo -d '<EOR>' out.*
+
+    for o in out.*; do
+        [[ ! -s $o ]] || [[ $(tail -c 5 $o) = "<EOR>" ]]
+    done
+    cmp -b <(seq $numlines) <(cat out.* | sed 's/<EOR>/\n/g' | sort -n)
+}
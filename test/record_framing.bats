@@ -0,0 +1,57 @@
+#!/usr/bin/env bats
+load test_helpers
+
+# passes records framed by length prefixes through mkmimo, and checks that
+# every output holds whole records and none of them are lost
+mkmimo_framed_records() {
+    local framing=$1; shift
+    numouts=10 numrecords=2000
+    seq $numouts | split -n r/$numouts - out.
+
+    framed_records $framing $numrecords 3000 >input
+    mkmimo -f $framing <input "$@" out.*
+
+    for o in out.*; do
+        framed_records -d $framing <$o
+    done | sort >output.records
+    framed_records -d $framing <input | sort >input.records
+    cmp input.records output.records
+}
+
+@test "records framed by 32-bit big endian lengths (1 input, 10 outputs)" {
+    mkmimo_framed_records u32be
+}
+
+@test "records framed by 32-bit little endian lengths (1 input, 10 outputs)" {
+    mkmimo_framed_records u32le
+}
+
+@test "records framed by 64-bit big endian lengths (1 input, 10 outputs)" {
+    mkmimo_framed_records u64be
+}
+
+@test "records framed by 64-bit little endian lengths (1 input, 10 outputs)" {
+    mkmimo_framed_records u64le
+}
+
+@test "records framed by varint lengths (1 input, 10 outputs)" {
+    mkmimo_framed_records varint
+}
+
+@test "length prefixes straddling reads" {
+    numrecords=1000
+    framed_records varint $numrecords 300 >input
+    cmp input <(BLOCKSIZE=3 RECORD_FRAMING=varint mkmimo <input)
+}
+
+@test "a malformed length prefix fails the input after the records before it" {
+    framed_records u64be 1000 300 >records
+    { cat records; printf '\377%.0s' {1..8}; cat records; } >input
+    status=0
+    mkmimo -f u64be <(cat input) \> out.1 out.2 2>stderr || status=$?
+    grep -q "Bad message" stderr
+    [[ ${MKMIMO_IMPL:-multithreaded} != multithreaded || $status -ne 0 ]]
+    # only whole records from before the malformed one are written
+    cat out.* | framed_records -d u64be | sort >output.records
+    [[ -z $(comm -13 <(framed_records -d u64be <records | sort) output.records) ]]
+}
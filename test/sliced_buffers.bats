@@ -0,0 +1,31 @@
+#!/usr/bin/env bats
+load test_helpers
+
+skip_unless_slicing() {
+    [[ ${MKMIMO_IMPL:-multithreaded} = multithreaded ]] ||
+        skip "buffers are sliced only by multithreaded"
+}
+
+@test "a single large buffer is spread over all outputs in slices" {
+    skip_unless_slicing
+    seq 100000 >input
+    # read at once into one buffer, while each output takes only what fits in
+    # its pipe before the consumer wakes up
+    mkfifo o.1 o.2 o.3 o.4
+    for i in 1 2 3 4; do { sleep 0.5; cat; } <o.$i >out.$i & done
+    MMAP_INPUTS=0 BLOCKSIZE=1048576 SLICE_SIZE=4096 mkmimo input \> o.*
+    wait
+    cmp input <(sort -n out.*)
+    for out in out.*; do [[ -s $out ]]; done
+    # with every record whole
+    ! grep -vx '[0-9]*' out.*
+}
+
+@test "slices of length-prefixed records" {
+    skip_unless_slicing
+    framed_records u32be 20000 300 >input
+    RECORD_FRAMING=u32be BLOCKSIZE=1048576 SLICE_SIZE=1000 \
+        mkmimo <(cat input) \> out.1 out.2 out.3
+    cmp <(framed_records -d u32be <input | sort) \
+        <(cat out.* | framed_records -d u32be | sort)
+}
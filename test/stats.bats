@@ -0,0 +1,28 @@
+#!/usr/bin/env bats
+load test_helpers
+
+@test "statistics reported as JSON lines (2 inputs, 3 outputs)" {
+    numlines=100000
+    seq $numlines >in.1
+    seq $numlines >in.2
+
+    MKMIMO_STATS_INTERVAL=10 MKMIMO_STATS_FILE=stats.json \
+        mkmimo in.1 in.2 \> out.1 out.2 out.3
+
+    # the final line should account for every byte and record
+    [[ -s stats.json ]]
+    last=$(tail -n 1 stats.json)
+    numbytes=$(cat in.1 in.2 | wc -c)
+    numrecords=$((2 * numlines))
+    for total in total_in total_out; do
+        [[ $last =~ \"$total\":\{\"bytes\":$numbytes,\"records\":$numrecords, ]]
+    done
+    [[ $last =~ \"name\":\"out.3\",\"closed\": ]]
+    cmp <(cat in.1 in.2 | sort) <(cat out.* | sort)
+}
+
+@test "statistics reported to a file descriptor" {
+    seq 1000 | MKMIMO_STATS_INTERVAL=1000 MKMIMO_STATS_FILE=3 mkmimo 3>stats.json >/dev/null
+    [[ $(wc -l <stats.json) -ge 1 ]]
+    [[ $(tail -n 1 stats.json) =~ \"total_out\":\{\"bytes\":3893,\"records\":1000, ]]
+}
@@ -0,0 +1,36 @@
+#!/usr/bin/env bats
+load test_helpers
+
+# number of calls to write the outputs, according to the final statistics
+num_writes() {
+    tail -n 1 stats.json |
+        sed 's/.*"total_out":{[^}]*"syscalls":\([0-9]*\).*/\1/'
+}
+
+@test "writing buffers queued behind a slow output together" {
+    [[ ${MKMIMO_IMPL:-multithreaded} = multithreaded ]] ||
+        skip "vectored writes are done only by multithreaded"
+    numlines=200000
+    seq $numlines >input
+    # which aren't batched while splicing, nor with sequence headers
+    export BLOCKSIZE=512 MULTIBUFFERING=32 ZERO_COPY=0 SEQUENCE_NUMBERS=0
+    MKMIMO_STATS_INTERVAL=10000 MKMIMO_STATS_FILE=stats.json \
+        mkmimo <input | { sleep 0.2; cat; } >output
+    cmp input output
+    unbatched=$(num_writes)
+    rm -f stats.json
+    WRITEV_BATCH=16 MKMIMO_STATS_INTERVAL=10000 MKMIMO_STATS_FILE=stats.json \
+        mkmimo <input | { sleep 0.2; cat; } >output
+    cmp input output
+    echo "$unbatched writes one buffer at a time, $(num_writes) batched"
+    [[ $(num_writes) -lt $unbatched ]]
+}
+
+@test "writing batches of buffers from own pools (2 inputs, 3 outputs)" {
+    numlines=100000
+    seq $numlines >in.1
+    seq $numlines >in.2
+    BLOCKSIZE=512 WRITEV_BATCH=8 WORK_STEALING=1 \
+        mkmimo in.1 in.2 \> out.1 out.2 out.3
+    cmp <(cat in.1 in.2 | sort) <(cat out.* | sort)
+}
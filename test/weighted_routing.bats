@@ -0,0 +1,52 @@
+#!/usr/bin/env bats
+load test_helpers
+
+setup_weighting() {
+    case ${MKMIMO_IMPL:-multithreaded} in
+        multithreaded|nonblocking) ;;
+        *) skip "output weights are only supported by the multithreaded and nonblocking implementations"
+    esac
+    numlines=1000000
+    seq $numlines >input
+}
+
+# checks that the outputs hold all records and the bytes of the first one are
+# about the given multiple of the second one's
+holds_bytes_in_proportion() {
+    local ratio=$1
+    cmp <(sort -n input) <(sort -n out.*)
+    local a=$(wc -c <out.a) b=$(wc -c <out.b)
+    echo "$a : $b bytes, expecting $ratio : 1"
+    (( 100 * a > 95 * ratio * b && 100 * a < 105 * ratio * b ))
+}
+
+@test "output weights given next to the paths (1 input, 2 outputs)" {
+    setup_weighting
+    mkmimo input \> out.a@3 out.b
+    holds_bytes_in_proportion 3
+}
+
+@test "output weights given in a file (2 inputs, 2 outputs)" {
+    setup_weighting
+    split -n l/2 input input.
+    printf '# path weight\nout.a 2\nout.b 1\n' >weights
+    mkmimo -w weights input.* \> out.b out.a
+    holds_bytes_in_proportion 2
+}
+
+@test "output weights with records of varying sizes (1 input, 2 outputs)" {
+    setup_weighting
+    # every hundredth record is much larger, making buffers grow
+    numlines=100000
+    seq $numlines | awk 'NR % 100 == 0 { printf "%010000d\n", $1; next } 1' >input
+    BLOCKSIZE=4096 mkmimo input \> out.a@4 out.b@4
+    holds_bytes_in_proportion 1
+}
+
+@test "output weights are not taken from existing paths (1 input, 2 outputs)" {
+    setup_weighting
+    : >out.a@3
+    mkmimo input \> out.a@3 out.b@1@1
+    [[ ! -e out.a && ! -e out.b ]]
+    cmp <(sort -n input) <(sort -n out.a@3 out.b@1)
+}
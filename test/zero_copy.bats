@@ -0,0 +1,31 @@
+#!/usr/bin/env bats
+load test_helpers
+
+@test "zero-copy between pipes (1 input, 3 outputs)" {
+    export ZERO_COPY=1
+    numlines=1000000
+    seq $numlines | mkmimo >(cat >out.1) >(cat >out.2) >(cat >out.3)
+    sleep 1  # for process substitutions to finish
+    cmp <(seq $numlines) <(sort -n out.*)
+}
+
+@test "zero-copy with records larger than pipes (may take up to 2s)" {
+    export ZERO_COPY=1
+    timeout=2s
+    numrecords=10 record_width=100000 deviation=30000
+    {
+        random_records $record_width~$deviation $numrecords '\n'
+        printf '\n'
+    } >wide_input
+    cmp wide_input <(cat wide_input | timeout $timeout mkmimo | cat)
+}
+
+@test "zero-copy with few file descriptors left for pipes (1 input, 8 outputs)" {
+    export ZERO_COPY=1 MULTIBUFFERING=16
+    numlines=1000000
+    (
+        ulimit -n 48
+        seq $numlines | mkmimo \> out.{1..8}
+    )
+    cmp <(seq $numlines) <(sort -n out.*)
+}